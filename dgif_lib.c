@@ -31,11 +31,22 @@ SPDX-License-Identifier: MIT
 
 /* avoid extra function call in case we use fread (TVT) */
 static int InternalRead(GifFileType *gif, GifByteType *buf, int len) {
+    GifFilePrivateType *Private = (GifFilePrivateType*)gif->Private;
+
     //fprintf(stderr, "### Read: %d\n", len);
+    if (Private->Replay != NULL) {
+	/* DGifSlurp() decoding data it has already read */
+	if ((size_t)len > Private->ReplayLeft)
+	    len = (int)Private->ReplayLeft;
+	memcpy(buf, Private->Replay, len);
+	Private->Replay += len;
+	Private->ReplayLeft -= len;
+	return len;
+    }
     return 
-	(((GifFilePrivateType*)gif->Private)->Read ?
-	 ((GifFilePrivateType*)gif->Private)->Read(gif,buf,len) : 
-	 fread(buf,1,len,((GifFilePrivateType*)gif->Private)->File));
+	(Private->Read ?
+	 Private->Read(gif,buf,len) : 
+	 fread(buf,1,len,Private->File));
 }
 
 static int DGifGetWord(GifFileType *GifFile, GifWord *Word);
@@ -46,6 +57,7 @@ static int DGifGetPrefixChar(GifPrefixType *Prefix, int Code, int ClearCode);
 static int DGifDecompressInput(GifFileType *GifFile, int *Code);
 static int DGifBufferedInput(GifFileType *GifFile, GifByteType *Buf,
                              GifByteType *NextByte);
+static int DGifSlurpRaster(GifFileType *GifFile, SavedImage *sp);
 
 /******************************************************************************
  Open a new GIF file for read, given by its name.
@@ -470,6 +482,11 @@ DGifGetImageDesc(GifFileType *GifFile)
     sp->RasterBits = (unsigned char *)NULL;
     sp->ExtensionBlockCount = 0;
     sp->ExtensionBlocks = (ExtensionBlock *) NULL;
+    sp->CompressedBits = (GifByteType *)NULL;
+    sp->CompressedLength = 0;
+    sp->CompressedRaster = (GifByteType *)NULL;
+    sp->CompressedPixels = 0;
+    sp->CompressedInterlace = false;
 
     GifFile->ImageCount++;
 
@@ -761,6 +778,66 @@ DGifGetCode(GifFileType *GifFile, int *CodeSize, GifByteType **CodeBlock)
     return DGifGetCodeNext(GifFile, CodeBlock);
 }
 
+/******************************************************************************
+ Get the whole of the current image in compressed form, in one buffer: the
+ LZW minimum code size byte, then the data sub-blocks up to and including
+ the empty one that ends them, exactly as they are in the file.  Call this
+ after DGifGetImageDesc() instead of DGifGetLine() or DGifGetCode(); the
+ result is what EGifPutCompressedImage() takes.  The buffer is the
+ caller's to free().
+******************************************************************************/
+int
+DGifGetCompressedImage(GifFileType *GifFile, GifByteType **Data,
+		       size_t *Length)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+    GifByteType *Buffer, Count;
+    size_t Len = 1, Alloc = 4096;
+
+    if (!IS_READABLE(Private)) {
+        /* This file was NOT open for reading: */
+        GifFile->Error = D_GIF_ERR_NOT_READABLE;
+        return GIF_ERROR;
+    }
+
+    if ((Buffer = (GifByteType *)malloc(Alloc)) == NULL) {
+        GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+        return GIF_ERROR;
+    }
+    Buffer[0] = (GifByteType)Private->BitsPerPixel;
+
+    do {
+        /* Room for a block of the largest size, and its count. */
+        if (Len + 256 > Alloc) {
+            GifByteType *Bigger = (GifByteType *)realloc(Buffer, Alloc *= 2);
+
+            if (Bigger == NULL) {
+                free(Buffer);
+                GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+                return GIF_ERROR;
+            }
+            Buffer = Bigger;
+        }
+        /* coverity[check_return] */
+        if (InternalRead(GifFile, &Count, 1) != 1
+                || (Count > 0
+                    && InternalRead(GifFile, Buffer + Len + 1, Count) != Count)) {
+            free(Buffer);
+            GifFile->Error = D_GIF_ERR_READ_FAILED;
+            return GIF_ERROR;
+        }
+        Buffer[Len] = Count;
+        Len += Count + 1;
+    } while (Count > 0);
+
+    Private->Buf[0] = 0;    /* Make sure the buffer is empty! */
+    Private->PixelCount = 0;    /* And local info. indicate image read. */
+
+    *Data = Buffer;
+    *Length = Len;
+    return GIF_OK;
+}
+
 /******************************************************************************
  Continue to get the image code in compressed form. This routine should be
  called until NULL block is returned.
@@ -1126,6 +1203,7 @@ DGifBufferedInput(GifFileType *GifFile, GifByteType *Buf, GifByteType *NextByte)
 int
 DGifSlurp(GifFileType *GifFile)
 {
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
     size_t ImageSize;
     GifRecordType RecordType;
     SavedImage *sp;
@@ -1162,29 +1240,31 @@ DGifSlurp(GifFileType *GifFile)
                   return GIF_ERROR;
               }
 
-	      if (sp->ImageDesc.Interlace) {
-		  int i, j;
-		   /* 
-		    * The way an interlaced image should be read - 
-		    * offsets and jumps...
-		    */
-		  int InterlacedOffset[] = { 0, 4, 2, 1 };
-		  int InterlacedJumps[] = { 8, 8, 4, 2 };
-		  /* Need to perform 4 passes on the image */
-		  for (i = 0; i < 4; i++)
-		      for (j = InterlacedOffset[i]; 
-			   j < sp->ImageDesc.Height;
-			   j += InterlacedJumps[i]) {
-			  if (DGifGetLine(GifFile, 
-					  sp->RasterBits+j*sp->ImageDesc.Width, 
-					  sp->ImageDesc.Width) == GIF_ERROR)
-			      return GIF_ERROR;
-		      }
-	      }
-	      else {
-		  if (DGifGetLine(GifFile,sp->RasterBits,ImageSize)==GIF_ERROR)
+	      if (Private->KeepCompressed) {
+		  int Status;
+
+		  /* Read the LZW data, then decode it from there. */
+		  if (DGifGetCompressedImage(GifFile, &sp->CompressedBits,
+					     &sp->CompressedLength) == GIF_ERROR)
 		      return (GIF_ERROR);
-	      }
+		  Private->Replay = sp->CompressedBits + 1;
+		  Private->ReplayLeft = sp->CompressedLength - 1;
+		  Private->PixelCount = ImageSize;
+		  Status = DGifSlurpRaster(GifFile, sp);
+		  Private->Replay = NULL;
+		  if (Status == GIF_ERROR)
+		      return (GIF_ERROR);
+		  /* Keep the raster too, to tell if it is changed. */
+		  sp->CompressedRaster = (GifByteType *)malloc(ImageSize);
+		  if (sp->CompressedRaster == NULL) {
+		      GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+		      return (GIF_ERROR);
+		  }
+		  memcpy(sp->CompressedRaster, sp->RasterBits, ImageSize);
+		  sp->CompressedPixels = ImageSize;
+		  sp->CompressedInterlace = sp->ImageDesc.Interlace;
+	      } else if (DGifSlurpRaster(GifFile, sp) == GIF_ERROR)
+		  return (GIF_ERROR);
 
               if (GifFile->ExtensionBlocks) {
                   sp->ExtensionBlocks = GifFile->ExtensionBlocks;
@@ -1238,4 +1318,61 @@ DGifSlurp(GifFileType *GifFile)
     return (GIF_OK);
 }
 
+/******************************************************************************
+ Decode the current image into the raster DGifSlurp() has allocated for it.
+******************************************************************************/
+static int
+DGifSlurpRaster(GifFileType *GifFile, SavedImage *sp)
+{
+    if (sp->ImageDesc.Interlace) {
+	int i, j;
+	/* 
+	 * The way an interlaced image should be read - 
+	 * offsets and jumps...
+	 */
+	int InterlacedOffset[] = { 0, 4, 2, 1 };
+	int InterlacedJumps[] = { 8, 8, 4, 2 };
+	/* Need to perform 4 passes on the image */
+	for (i = 0; i < 4; i++)
+	    for (j = InterlacedOffset[i]; 
+		 j < sp->ImageDesc.Height;
+		 j += InterlacedJumps[i]) {
+		if (DGifGetLine(GifFile, 
+				sp->RasterBits+j*sp->ImageDesc.Width, 
+				sp->ImageDesc.Width) == GIF_ERROR)
+		    return GIF_ERROR;
+	    }
+    }
+    else {
+	if (DGifGetLine(GifFile, sp->RasterBits,
+			sp->ImageDesc.Width * sp->ImageDesc.Height)
+	    == GIF_ERROR)
+	    return (GIF_ERROR);
+    }
+
+    return (GIF_OK);
+}
+
+/******************************************************************************
+ Have DGifSlurp() keep each image's compressed data in CompressedBits, as
+ DGifGetCompressedImage() would return it, alongside the decoded raster
+ and a copy of it in CompressedRaster.
+ EGifSpew() and EGifSpewParallel() then write such data out again as it
+ is rather than compress the raster, as long as the raster is unchanged.
+******************************************************************************/
+int
+DGifSetKeepCompressed(GifFileType *GifFile, const bool Keep)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+    if (!IS_READABLE(Private)) {
+        /* This file was NOT open for reading: */
+        GifFile->Error = D_GIF_ERR_NOT_READABLE;
+        return GIF_ERROR;
+    }
+
+    Private->KeepCompressed = Keep;
+    return GIF_OK;
+}
+
 /* end */
@@ -14,6 +14,7 @@ SPDX-License-Identifier: MIT
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 
 #ifdef _WIN32
@@ -21,6 +22,8 @@ SPDX-License-Identifier: MIT
 #else
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #endif /* _WIN32 */
 #include <sys/stat.h>
 
@@ -35,12 +38,43 @@ static const GifPixelType CodeMask[] = {
 /*@-charint@*/
 
 static int EGifPutWord(int Word, GifFileType * GifFile);
+static int EGifWriteImageDesc(GifFileType *GifFile,
+			      const int Left, const int Top,
+			      const int Width, const int Height,
+			      const bool Interlace,
+			      const ColorMapObject *ColorMap);
 static int EGifSetupCompress(GifFileType * GifFile);
 static int EGifCompressLine(GifFileType * GifFile, GifPixelType * Line,
                             int LineLen);
 static int EGifCompressOutput(GifFileType * GifFile, int Code);
-static int EGifBufferedOutput(GifFileType * GifFile, GifByteType * Buf,
-                              int c);
+static int EGifCompressMiss(GifFileType *GifFile, const int Prefix,
+                            const int Pixel, const int Pending);
+static void EGifMarkClear(GifFilePrivateType *Private, const int Pending);
+static int EGifSetupLossy(GifFileType *GifFile, const ColorMapObject *Map);
+static int EGifLossyLookup(GifFilePrivateType *Private, const int Prefix,
+                           const int Pixel);
+static void EGifNoteExtension(GifFileType *GifFile, const int ExtCode,
+                              const int ExtLen, const void *Extension);
+static bool EGifTimeToClear(GifFileType *GifFile, const int Pending);
+static int EGifPutBits(GifFileType * GifFile, const uint32_t Bits,
+                       const int NBits);
+static int EGifFlushCodeBuf(GifFileType * GifFile, const bool Final);
+
+/*
+ * The compressor stages whole 32-bit words of LZW output in CodeBuf and
+ * cuts them into 255-byte sub-blocks only when CODE_BUF_BLOCKS of them
+ * are ready, so the per-code work is a shift, an or and a rare store.
+ */
+#define CODE_BUF_BLOCKS	64
+#define CODE_BUF_FLUSH	(CODE_BUF_BLOCKS * 255)
+#define CODE_BUF_SIZE	(CODE_BUF_FLUSH + 8)  /* + a word past the mark */
+#define BLOCK_BUF_SIZE	((CODE_BUF_BLOCKS + 1) * 256 + 1)
+
+/* Default size of the buffer InternalWrite() coalesces output in. */
+#define WRITE_BUF_SIZE	65536
+
+/* GIF_CLEAR_ADAPTIVE checks its compression ratio this often. */
+#define ADAPTIVE_CHECK_CODES	256
 
 /* extract bytes from an unsigned word */
 #define LOBYTE(x)	((x) & 0xff)
@@ -113,7 +147,7 @@ EGifOpenFileHandle(const int FileHandle, int *Error)
         return NULL;
     }
     /*@i1@*/memset(Private, '\0', sizeof(GifFilePrivateType));
-    if ((Private->HashTable = _InitHashTable()) == NULL) {
+    if ((Private->CodeTable = _InitCodeTable()) == NULL) {
         free(GifFile);
         free(Private);
         if (Error != NULL)
@@ -135,6 +169,9 @@ EGifOpenFileHandle(const int FileHandle, int *Error)
 
     Private->Write = (OutputFunc) 0;    /* No user write routine (MRB) */
     GifFile->UserData = (void *)NULL;    /* No user write handle (MRB) */
+    Private->WriteBufSize = WRITE_BUF_SIZE;
+    EGifDefaultEncoderOptions(&Private->Options);
+    Private->Transparent = NO_TRANSPARENT_COLOR;
 
     GifFile->Error = 0;
 
@@ -170,8 +207,8 @@ EGifOpen(void *userData, OutputFunc writeFunc, int *Error)
 
     memset(Private, '\0', sizeof(GifFilePrivateType));
 
-    Private->HashTable = _InitHashTable();
-    if (Private->HashTable == NULL) {
+    Private->CodeTable = _InitCodeTable();
+    if (Private->CodeTable == NULL) {
         free (GifFile);
         free (Private);
         if (Error != NULL)
@@ -186,6 +223,10 @@ EGifOpen(void *userData, OutputFunc writeFunc, int *Error)
 
     Private->Write = writeFunc;    /* User write routine (MRB) */
     GifFile->UserData = userData;    /* User write handle (MRB) */
+    /* Unbuffered, so write errors show up in the call that caused them. */
+    Private->WriteBufSize = 0;
+    EGifDefaultEncoderOptions(&Private->Options);
+    Private->Transparent = NO_TRANSPARENT_COLOR;
 
     Private->gif89 = false;	/* initially, write GIF87 */
 
@@ -194,6 +235,91 @@ EGifOpen(void *userData, OutputFunc writeFunc, int *Error)
     return GifFile;
 }
 
+/******************************************************************************
+ Output constructor that writes into memory.  If *Buffer is NULL, the
+ library manages a buffer that grows geometrically as output is produced;
+ otherwise *Buffer is the caller's own buffer of *Size bytes and output
+ that doesn't fit in it fails with E_GIF_ERR_BUFFER_FULL.
+ When the GIF is closed (by EGifCloseFile() or EGifSpew()) *Buffer and *Size
+ are set to the output and its length, so both must stay valid until then.
+ A library-managed buffer is handed over as is and must be released with
+ free(); it is freed, and *Buffer set to NULL, if closing fails.
+******************************************************************************/
+GifFileType *
+EGifOpenMemory(GifByteType **Buffer, size_t *Size, int *Error)
+{
+    GifFileType *GifFile;
+    GifFilePrivateType *Private;
+    GifMemoryOutputType *Memory;
+
+    Memory = (GifMemoryOutputType *)malloc(sizeof(GifMemoryOutputType));
+    if (Memory == NULL) {
+        if (Error != NULL)
+	    *Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+        return NULL;
+    }
+
+    if ((GifFile = EGifOpen(NULL, NULL, Error)) == NULL) {
+        free(Memory);
+        return NULL;
+    }
+
+    Memory->BufferOut = Buffer;
+    Memory->SizeOut = Size;
+    Memory->Fixed = (*Buffer != NULL);
+    Memory->Data = *Buffer;
+    Memory->Capacity = Memory->Fixed ? *Size : 0;
+    Memory->Len = 0;
+    Memory->Overflow = false;
+
+    Private = (GifFilePrivateType *)GifFile->Private;
+    Private->Memory = Memory;
+    Private->WriteBufSize = 0;    /* Memory is the buffer. */
+
+    return GifFile;
+}
+
+/* An overflowed memory buffer says more than the caller's generic error. */
+#define WRITE_ERROR(GifFile, Code) \
+    ((((GifFilePrivateType *)(GifFile)->Private)->Memory != NULL \
+      && ((GifFilePrivateType *)(GifFile)->Private)->Memory->Overflow) \
+     ? E_GIF_ERR_BUFFER_FULL : (Code))
+
+/******************************************************************************
+ Append len bytes to the memory output, growing it if it's ours.
+******************************************************************************/
+static int
+EGifWriteMemory(GifMemoryOutputType *Memory, const GifByteType *buf,
+		size_t len)
+{
+    if (Memory->Overflow)
+	return GIF_ERROR;
+
+    if (len > Memory->Capacity - Memory->Len) {
+	size_t Capacity = Memory->Capacity ? Memory->Capacity : 65536;
+	GifByteType *Data;
+
+	if (Memory->Fixed) {
+	    Memory->Overflow = true;
+	    return GIF_ERROR;
+	}
+	while (len > Capacity - Memory->Len) {
+	    if (Capacity > SIZE_MAX / 2)
+		return GIF_ERROR;
+	    Capacity *= 2;
+	}
+	if ((Data = (GifByteType *)realloc(Memory->Data, Capacity)) == NULL)
+	    return GIF_ERROR;
+	Memory->Data = Data;
+	Memory->Capacity = Capacity;
+    }
+
+    memcpy(Memory->Data + Memory->Len, buf, len);
+    Memory->Len += len;
+
+    return GIF_OK;
+}
+
 /******************************************************************************
  Routine to compute the GIF version that will be written on output.
 ******************************************************************************/
@@ -252,16 +378,181 @@ void EGifSetGifVersion(GifFileType *GifFile, const bool gif89)
 }
 
 /******************************************************************************
- All writes to the GIF should go through this.
+ Write out the coalesced output followed by len more bytes at buf, without
+ going through the write buffer.  A file handle gets both in one writev(2);
+ otherwise they go to the user write routine or the stream in turn.
+ Returns GIF_ERROR if anything could not be written.
+******************************************************************************/
+static int
+EGifWriteThrough(GifFileType *GifFile, const GifByteType *buf, size_t len)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+    const GifByteType *Head = Private->WriteBuf;
+    size_t HeadLen = Private->WriteBufLen;
+
+    Private->WriteBufLen = 0;
+    if (Private->Memory) {
+	if (HeadLen > 0
+	    && EGifWriteMemory(Private->Memory, Head, HeadLen) == GIF_ERROR)
+	    return GIF_ERROR;
+	if (len > 0
+	    && EGifWriteMemory(Private->Memory, buf, len) == GIF_ERROR)
+	    return GIF_ERROR;
+    } else if (Private->Write) {
+	if (HeadLen > 0
+	    && Private->Write(GifFile, Head, HeadLen) != (int)HeadLen)
+	    return GIF_ERROR;
+	if (len > 0 && Private->Write(GifFile, buf, len) != (int)len)
+	    return GIF_ERROR;
+    } else {
+#ifdef _WIN32
+	if (HeadLen > 0 && fwrite(Head, 1, HeadLen, Private->File) != HeadLen)
+	    return GIF_ERROR;
+	if (len > 0 && fwrite(buf, 1, len, Private->File) != len)
+	    return GIF_ERROR;
+#else
+	/* Nothing is ever written through Private->File, so it holds no
+	 * buffered data and we can go straight to the descriptor. */
+	while (HeadLen + len > 0) {
+	    struct iovec Vec[2];
+	    int Count = 0;
+	    ssize_t Written;
+
+	    if (HeadLen > 0) {
+		Vec[Count].iov_base = (void *)Head;
+		Vec[Count++].iov_len = HeadLen;
+	    }
+	    if (len > 0) {
+		Vec[Count].iov_base = (void *)buf;
+		Vec[Count++].iov_len = len;
+	    }
+	    if ((Written = writev(Private->FileHandle, Vec, Count)) < 0) {
+		if (errno == EINTR)
+		    continue;
+		return GIF_ERROR;
+	    }
+	    if ((size_t)Written < HeadLen) {
+		Head += Written;
+		HeadLen -= Written;
+	    } else {
+		Written -= HeadLen;
+		HeadLen = 0;
+		buf += Written;
+		len -= Written;
+	    }
+	}
+#endif /* _WIN32 */
+    }
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ All writes to the GIF should go through this.  Output to a file is
+ gathered in a write buffer (WRITE_BUF_SIZE bytes unless changed by
+ EGifSetWriteBufferSize()) so that small descriptor fields and 256-byte
+ data sub-blocks reach it in large writes; a user write routine gets
+ each write as it comes unless the caller asked for a buffer.
+ Returns len, or 0 if the output could not be written.
 ******************************************************************************/
 static int InternalWrite(GifFileType *GifFileOut, 
 		   const unsigned char *buf, size_t len)
 {
     GifFilePrivateType *Private = (GifFilePrivateType*)GifFileOut->Private;
-    if (Private->Write)
-	return Private->Write(GifFileOut,buf,len);
-    else
-	return fwrite(buf, 1, len, Private->File);
+
+    if (len == 0)
+	return 0;
+    if (Private->WriteBuf == NULL && Private->WriteBufSize > 0) {
+	/* If we can't get a buffer, just write unbuffered. */
+	if ((Private->WriteBuf = (GifByteType *)malloc(Private->WriteBufSize))
+	    == NULL)
+	    Private->WriteBufSize = 0;
+    }
+
+    if (Private->WriteBufLen + len <= Private->WriteBufSize) {
+	memcpy(Private->WriteBuf + Private->WriteBufLen, buf, len);
+	Private->WriteBufLen += len;
+    } else if (len < Private->WriteBufSize && Private->Write) {
+	/* The user routine gets the buffer and then a fresh one. */
+	if (EGifWriteThrough(GifFileOut, buf, 0) == GIF_ERROR)
+	    return 0;
+	memcpy(Private->WriteBuf, buf, len);
+	Private->WriteBufLen = len;
+    } else if (EGifWriteThrough(GifFileOut, buf, len) == GIF_ERROR)
+	return 0;
+
+    return len;
+}
+
+/******************************************************************************
+ Set the size of the buffer encoder output is coalesced in before it is
+ written, flushing whatever is buffered now.  A size of 0 makes every
+ write go straight to the file or user write routine.
+ Returns GIF_ERROR if the buffered output could not be written.
+******************************************************************************/
+int
+EGifSetWriteBufferSize(GifFileType *GifFile, size_t BufferSize)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+    if (!IS_WRITEABLE(Private)) {
+        /* This file was NOT open for writing: */
+        GifFile->Error = E_GIF_ERR_NOT_WRITEABLE;
+        return GIF_ERROR;
+    }
+
+    if (Private->WriteBufLen > 0
+	&& EGifWriteThrough(GifFile, NULL, 0) == GIF_ERROR) {
+	GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_WRITE_FAILED);
+	return GIF_ERROR;
+    }
+
+    /* The new buffer is allocated on the next write. */
+    free(Private->WriteBuf);
+    Private->WriteBuf = NULL;
+    Private->WriteBufSize = BufferSize;
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Fill in the encoder options every handle starts with.
+******************************************************************************/
+void
+EGifDefaultEncoderOptions(GifEncoderOptions *Options)
+{
+    memset(Options, '\0', sizeof(GifEncoderOptions));
+    Options->ClearPolicy = GIF_CLEAR_WHEN_FULL;
+    Options->StripHeight = 0;
+    Options->MaxCodeBits = 12;
+    Options->TrimColorMaps = false;
+    Options->LossyError = 0;
+    Options->LossyDiffuse = false;
+}
+
+/******************************************************************************
+ Change the encoder options; they take effect from the next code output.
+******************************************************************************/
+int
+EGifSetEncoderOptions(GifFileType *GifFile, const GifEncoderOptions *Options)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+    if (!IS_WRITEABLE(Private)) {
+        /* This file was NOT open for writing: */
+        GifFile->Error = E_GIF_ERR_NOT_WRITEABLE;
+        return GIF_ERROR;
+    }
+
+    Private->Options = *Options;
+    if (Private->Options.StripHeight < 0)
+	Private->Options.StripHeight = 0;
+    if (Private->Options.LossyError < 0)
+	Private->Options.LossyError = 0;
+    else if (Private->Options.LossyError > 255)
+	Private->Options.LossyError = 255;
+
+    return GIF_OK;
 }
 
 /******************************************************************************
@@ -297,7 +588,7 @@ EGifPutScreenDesc(GifFileType *GifFile,
     /* First write the version prefix into the file. */
     if (InternalWrite(GifFile, (unsigned char *)write_version,
               strlen(write_version)) != strlen(write_version)) {
-        GifFile->Error = E_GIF_ERR_WRITE_FAILED;
+        GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_WRITE_FAILED);
         return GIF_ERROR;
     }
 
@@ -346,7 +637,7 @@ EGifPutScreenDesc(GifFileType *GifFile,
             Buf[1] = ColorMap->Colors[i].Green;
             Buf[2] = ColorMap->Colors[i].Blue;
             if (InternalWrite(GifFile, Buf, 3) != 3) {
-                GifFile->Error = E_GIF_ERR_WRITE_FAILED;
+                GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_WRITE_FAILED);
                 return GIF_ERROR;
             }
         }
@@ -370,6 +661,31 @@ EGifPutImageDesc(GifFileType *GifFile,
                  const int Height,
                  const bool Interlace,
                  const ColorMapObject *ColorMap)
+{
+    if (EGifWriteImageDesc(GifFile,
+			   Left, Top, Width, Height,
+			   Interlace, ColorMap) == GIF_ERROR)
+	return GIF_ERROR;
+
+    /* Reset compress algorithm parameters. */
+    if (EGifSetupCompress(GifFile) == GIF_ERROR)
+        return GIF_ERROR;
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Write the image descriptor and local color map, leaving the compressor
+ alone.
+******************************************************************************/
+static int
+EGifWriteImageDesc(GifFileType *GifFile,
+		   const int Left,
+		   const int Top,
+		   const int Width,
+		   const int Height,
+		   const bool Interlace,
+		   const ColorMapObject *ColorMap)
 {
     GifByteType Buf[3];
     GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
@@ -428,7 +744,7 @@ EGifPutImageDesc(GifFileType *GifFile,
             Buf[1] = ColorMap->Colors[i].Green;
             Buf[2] = ColorMap->Colors[i].Blue;
             if (InternalWrite(GifFile, Buf, 3) != 3) {
-                GifFile->Error = E_GIF_ERR_WRITE_FAILED;
+                GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_WRITE_FAILED);
                 return GIF_ERROR;
             }
         }
@@ -442,9 +758,6 @@ EGifPutImageDesc(GifFileType *GifFile,
     Private->FileState |= FILE_STATE_IMAGE;
     Private->PixelCount = (long)Width *(long)Height;
 
-    /* Reset compress algorithm parameters. */
-    (void)EGifSetupCompress(GifFile);
-
     return GIF_OK;
 }
 
@@ -569,6 +882,7 @@ EGifPutExtensionLeader(GifFileType *GifFile, const int ExtCode)
     Buf[0] = EXTENSION_INTRODUCER;
     Buf[1] = ExtCode;
     InternalWrite(GifFile, Buf, 2);
+    Private->ExtCode = ExtCode;
 
     return GIF_OK;
 }
@@ -593,6 +907,7 @@ EGifPutExtensionBlock(GifFileType *GifFile,
     Buf = ExtLen;
     InternalWrite(GifFile, &Buf, 1);
     InternalWrite(GifFile, Extension, ExtLen);
+    EGifNoteExtension(GifFile, Private->ExtCode, ExtLen, Extension);
 
     return GIF_OK;
 }
@@ -651,10 +966,28 @@ EGifPutExtension(GifFileType *GifFile,
     InternalWrite(GifFile, Extension, ExtLen);
     Buf[0] = 0;
     InternalWrite(GifFile, Buf, 1);
+    EGifNoteExtension(GifFile, ExtCode, ExtLen, Extension);
 
     return GIF_OK;
 }
 
+/******************************************************************************
+ Remember the transparent color of a graphics control block on its way out,
+ so that lossy coding of the image after it can leave that color alone.
+******************************************************************************/
+static void
+EGifNoteExtension(GifFileType *GifFile, const int ExtCode, const int ExtLen,
+                  const void *Extension)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+    GraphicsControlBlock GCB;
+
+    if (ExtCode == GRAPHICS_EXT_FUNC_CODE
+        && DGifExtensionToGCB(ExtLen, (const GifByteType *)Extension,
+                              &GCB) == GIF_OK)
+        Private->Transparent = GCB.TransparentColor;
+}
+
 /******************************************************************************
  Render a Graphics Control Block as raw extension data
 ******************************************************************************/
@@ -749,13 +1082,13 @@ EGifPutCodeNext(GifFileType *GifFile, const GifByteType *CodeBlock)
     if (CodeBlock != NULL) {
         if (InternalWrite(GifFile, CodeBlock, CodeBlock[0] + 1)
                != (unsigned)(CodeBlock[0] + 1)) {
-            GifFile->Error = E_GIF_ERR_WRITE_FAILED;
+            GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_WRITE_FAILED);
             return GIF_ERROR;
         }
     } else {
         Buf = 0;
         if (InternalWrite(GifFile, &Buf, 1) != 1) {
-            GifFile->Error = E_GIF_ERR_WRITE_FAILED;
+            GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_WRITE_FAILED);
             return GIF_ERROR;
         }
         Private->PixelCount = 0;    /* And local info. indicate image read. */
@@ -764,6 +1097,56 @@ EGifPutCodeNext(GifFileType *GifFile, const GifByteType *CodeBlock)
     return GIF_OK;
 }
 
+/******************************************************************************
+ Put out a whole image that is already compressed: the image descriptor
+ from ImageDesc, then Data as it is.  Data is laid out as it is in a GIF
+ file and as DGifGetCompressedImage() returns it, the LZW minimum code size
+ byte followed by data sub-blocks ending with an empty one.  Unlike
+ EGifPutCode(), the code size goes out as given, so any image can be
+ copied this way.  Only the layout of Data is checked, not the codes.
+******************************************************************************/
+int
+EGifPutCompressedImage(GifFileType *GifFile, const GifImageDesc *ImageDesc,
+                       const GifByteType *Data, size_t Length)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+    size_t i;
+
+    if (!IS_WRITEABLE(Private)) {
+        /* This file was NOT open for writing: */
+        GifFile->Error = E_GIF_ERR_NOT_WRITEABLE;
+        return GIF_ERROR;
+    }
+
+    /* A code size the decoder takes, then blocks ending at the end. */
+    if (Length < 2 || Data[0] > 8) {
+        GifFile->Error = E_GIF_ERR_BAD_IMAGE_DATA;
+        return GIF_ERROR;
+    }
+    for (i = 1; i < Length - 1 && Data[i] != 0; i += Data[i] + 1)
+        continue;
+    if (i != Length - 1 || Data[i] != 0) {
+        GifFile->Error = E_GIF_ERR_BAD_IMAGE_DATA;
+        return GIF_ERROR;
+    }
+
+    if (EGifWriteImageDesc(GifFile,
+                           ImageDesc->Left, ImageDesc->Top,
+                           ImageDesc->Width, ImageDesc->Height,
+                           ImageDesc->Interlace,
+                           ImageDesc->ColorMap) == GIF_ERROR)
+        return GIF_ERROR;
+
+    if (InternalWrite(GifFile, Data, Length) != Length) {
+        GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_WRITE_FAILED);
+        return GIF_ERROR;
+    }
+    Private->PixelCount = 0;    /* The whole raster went out. */
+    Private->Transparent = NO_TRANSPARENT_COLOR;
+
+    return GIF_OK;
+}
+
 /******************************************************************************
  This routine should be called last, to close the GIF file.
 ******************************************************************************/
@@ -773,6 +1156,7 @@ EGifCloseFile(GifFileType *GifFile, int *ErrorCode)
     GifByteType Buf;
     GifFilePrivateType *Private;
     FILE *File;
+    int CloseError = E_GIF_SUCCEEDED;
 
     if (GifFile == NULL)
         return GIF_ERROR;
@@ -792,6 +1176,9 @@ EGifCloseFile(GifFileType *GifFile, int *ErrorCode)
 
 	Buf = TERMINATOR_INTRODUCER;
 	InternalWrite(GifFile, &Buf, 1);
+	if (Private->WriteBufLen > 0
+	    && EGifWriteThrough(GifFile, NULL, 0) == GIF_ERROR)
+	    CloseError = E_GIF_ERR_WRITE_FAILED;
 
 	if (GifFile->Image.ColorMap) {
 	    GifFreeMapObject(GifFile->Image.ColorMap);
@@ -802,8 +1189,25 @@ EGifCloseFile(GifFileType *GifFile, int *ErrorCode)
 	    GifFile->SColorMap = NULL;
 	}
 	if (Private) {
-	    if (Private->HashTable) {
-		free((char *) Private->HashTable);
+	    _FreeCodeTable(Private->CodeTable);
+	    free(Private->CodeBuf);
+	    free(Private->BlockBuf);
+	    free(Private->WriteBuf);
+	    free(Private->Lossy);
+	    if (Private->Memory) {
+		GifMemoryOutputType *Memory = Private->Memory;
+
+		if (Memory->Overflow)
+		    CloseError = E_GIF_ERR_BUFFER_FULL;
+		if (CloseError != E_GIF_SUCCEEDED && !Memory->Fixed) {
+		    free(Memory->Data);
+		    Memory->Data = NULL;
+		    Memory->Len = 0;
+		}
+		/* Hand the output over, without copying it. */
+		*Memory->BufferOut = Memory->Data;
+		*Memory->SizeOut = Memory->Len;
+		free(Memory);
 	    }
 	    free((char *) Private);
 	}
@@ -814,6 +1218,12 @@ EGifCloseFile(GifFileType *GifFile, int *ErrorCode)
 	    free(GifFile);
 	    return GIF_ERROR;
 	}
+	if (CloseError != E_GIF_SUCCEEDED) {
+	    if (ErrorCode != NULL)
+		*ErrorCode = CloseError;
+	    free(GifFile);
+	    return GIF_ERROR;
+	}
 
 	free(GifFile);
 	if (ErrorCode != NULL)
@@ -844,7 +1254,7 @@ EGifPutWord(int Word, GifFileType *GifFile)
 static int
 EGifSetupCompress(GifFileType *GifFile)
 {
-    int BitsPerPixel;
+    int BitsPerPixel, CodeBits;
     GifByteType Buf;
     GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
 
@@ -858,10 +1268,24 @@ EGifSetupCompress(GifFileType *GifFile)
         return GIF_ERROR;
     }
 
+    if (Private->CodeBuf == NULL) {
+        Private->CodeBuf = (GifByteType *)malloc(CODE_BUF_SIZE);
+        Private->BlockBuf = (GifByteType *)malloc(BLOCK_BUF_SIZE);
+        if (Private->CodeBuf == NULL || Private->BlockBuf == NULL) {
+            free(Private->CodeBuf);
+            free(Private->BlockBuf);
+            Private->CodeBuf = Private->BlockBuf = NULL;
+            GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+            return GIF_ERROR;
+        }
+    }
+
     Buf = BitsPerPixel = (BitsPerPixel < 2 ? 2 : BitsPerPixel);
-    InternalWrite(GifFile, &Buf, 1);    /* Write the Code size to file. */
+    if (!Private->RawCodes)
+        InternalWrite(GifFile, &Buf, 1);    /* Write the Code size to file. */
 
-    Private->Buf[0] = 0;    /* Nothing was output yet. */
+    Private->CodeBufLen = 0;    /* Nothing was output yet. */
+    Private->CodeBytes = 0;
     Private->BitsPerPixel = BitsPerPixel;
     Private->ClearCode = (1 << BitsPerPixel);
     Private->EOFCode = Private->ClearCode + 1;
@@ -872,11 +1296,37 @@ EGifSetupCompress(GifFileType *GifFile)
     Private->CrntShiftState = 0;    /* No information in CrntShiftDWord. */
     Private->CrntShiftDWord = 0;
 
-   /* Clear hash table and send Clear to make sure the decoder do the same. */
-    _ClearHashTable(Private->HashTable);
+    EGifMarkClear(Private, 0);
+
+    /* Bound the table if asked to.  Bounded at the starting width it has
+     * no room for strings at all, so then pixels go out one code each. */
+    CodeBits = Private->Options.MaxCodeBits;
+    if (CodeBits <= 0 || CodeBits > LZ_BITS)
+        CodeBits = LZ_BITS;
+    else if (CodeBits < Private->RunningBits)
+        CodeBits = Private->RunningBits;
+    Private->ClearAt = (1 << CodeBits) - 1;
+    Private->Literal = (CodeBits == Private->RunningBits);
+
+    /* Size the code table for this image; this also empties it. */
+    if (_ResetCodeTable(Private->CodeTable, BitsPerPixel, CodeBits)
+            == GIF_ERROR) {
+        GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+        return GIF_ERROR;
+    }
+
+    /* The graphics control block before the image applies to it alone. */
+    if (EGifSetupLossy(GifFile, GifFile->Image.ColorMap
+                                ? GifFile->Image.ColorMap
+                                : GifFile->SColorMap) == GIF_ERROR)
+        return GIF_ERROR;
+    Private->Transparent = NO_TRANSPARENT_COLOR;
+
+    /* Send Clear to make sure the decoder starts with an empty table too. */
 
-    if (EGifCompressOutput(GifFile, Private->ClearCode) == GIF_ERROR) {
-        GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+    if (!Private->RawCodes
+        && EGifCompressOutput(GifFile, Private->ClearCode) == GIF_ERROR) {
+        GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_DISK_IS_FULL);
         return GIF_ERROR;
     }
     return GIF_OK;
@@ -894,75 +1344,146 @@ EGifCompressLine(GifFileType *GifFile,
                  const int LineLen)
 {
     int i = 0, CrntCode;
-    GifHashTableType *HashTable;
+    GifCodeTableType *CodeTable;
     GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
 
-    HashTable = Private->HashTable;
+    CodeTable = Private->CodeTable;
 
     if (Private->CrntCode == FIRST_CODE)    /* Its first time! */
         CrntCode = Line[i++];
     else
         CrntCode = Private->CrntCode;    /* Get last code in compression. */
 
+    if (Private->Literal) {
+        /* No strings at all: each pixel goes out as its own code, with a
+         * Clear just before the decoder's table would outgrow the width.
+         * The code width never changes, so the bit writer is inlined here
+         * with its state in registers; this is the fast-encode path.
+         */
+        uint64_t ShiftDWord = Private->CrntShiftDWord;
+        int ShiftState = Private->CrntShiftState;
+        int RunningCode = Private->RunningCode;
+        const int Width = Private->RunningBits;
+        const int ClearAt = Private->ClearAt, ClearCode = Private->ClearCode;
+        const int FirstFree = Private->EOFCode + 1;
+        size_t CodeBufLen = Private->CodeBufLen;
+
+        while (i < LineLen) {
+            ShiftDWord |= (uint64_t)CrntCode << ShiftState;
+            ShiftState += Width;
+            CrntCode = Line[i++];
+            if (RunningCode >= ClearAt) {
+                ShiftDWord |= (uint64_t)ClearCode << ShiftState;
+                ShiftState += Width;
+                RunningCode = FirstFree;
+            } else
+                RunningCode++;
+            if (ShiftState >= 32) {
+                GifByteType *Word = Private->CodeBuf + CodeBufLen;
+
+                Word[0] = ShiftDWord & 0xff;
+                Word[1] = (ShiftDWord >> 8) & 0xff;
+                Word[2] = (ShiftDWord >> 16) & 0xff;
+                Word[3] = (ShiftDWord >> 24) & 0xff;
+                CodeBufLen += 4;
+                ShiftDWord >>= 32;
+                ShiftState -= 32;
+                if (CodeBufLen >= CODE_BUF_FLUSH) {
+                    Private->CodeBufLen = CodeBufLen;
+                    if (EGifFlushCodeBuf(GifFile, false) == GIF_ERROR)
+                        return GIF_ERROR;
+                    CodeBufLen = Private->CodeBufLen;
+                }
+            }
+        }
+
+        Private->CodeBufLen = CodeBufLen;
+        Private->CrntShiftDWord = ShiftDWord;
+        Private->CrntShiftState = ShiftState;
+        Private->RunningCode = RunningCode;
+    }
+
     while (i < LineLen) {   /* Decode LineLen items. */
+        int Depth;
+
+        /* Inside a run of one pixel value the strings are just longer and
+         * longer repeats of it, so rather than look each pixel up, jump
+         * straight to the code for as many of them as the table holds.
+         */
+        if (i > 0 && Line[i] == Line[i - 1] && Private->Lossy == NULL
+            && (Depth = _RunDepthCodeTable(CodeTable, CrntCode,
+                                           Line[i])) > 0) {
+            const int Pixel = Line[i];
+            int Run = 1, Reach;
+
+            while (i + Run < LineLen && Line[i + Run] == Pixel)
+                Run++;
+            for (;;) {
+                /* The longest repeat of Pixel with a code: */
+                Reach = CodeTable->RunCount[Pixel] + 1;
+                if (Depth + Run <= Reach) {
+                    CrntCode = CodeTable->Runs[Pixel][Depth + Run - 2];
+                    i += Run;
+                    break;
+                }
+                /* Take that, and the one more Pixel that misses. */
+                Run -= Reach - Depth + 1;
+                i += Reach - Depth + 1;
+                CrntCode = (Reach == 1) ? Pixel
+                                        : CodeTable->Runs[Pixel][Reach - 2];
+                if (EGifCompressMiss(GifFile, CrntCode, Pixel,
+                                     LineLen - i) == GIF_ERROR)
+                    return GIF_ERROR;
+                CrntCode = Pixel;
+                Depth = 1;
+                if (Run == 0 || CodeTable->RunCount[Pixel] < 0)
+                    break;
+            }
+            continue;
+        }
+
 	GifPixelType Pixel = Line[i++];  /* Get next pixel from stream. */
-        /* Form a new unique key to search hash table for the code combines 
-         * CrntCode as Prefix string with Pixel as postfix char.
+        /* Look up the string made of CrntCode as Prefix string with Pixel
+         * as postfix char; the code table is indexed by exactly that pair.
          */
-	int NewCode;
-	unsigned long NewKey = (((uint32_t) CrntCode) << 8) + Pixel;
-        if ((NewCode = _ExistsHashTable(HashTable, NewKey)) >= 0) {
+	int NewCode = _LookupCodeTable(CodeTable, CrntCode, Pixel);
+        if (NewCode >= 0) {
             /* This Key is already there, or the string is old one, so
              * simple take new code as our CrntCode:
              */
             CrntCode = NewCode;
+        } else if (Private->Lossy != NULL
+                   && (NewCode = EGifLossyLookup(Private, CrntCode,
+                                                 Pixel)) >= 0) {
+            /* A string with a close enough color instead will do. */
+            CrntCode = NewCode;
         } else {
-            /* Put it in hash table, output the prefix code, and make our
-             * CrntCode equal to Pixel.
-             */
-            if (EGifCompressOutput(GifFile, CrntCode) == GIF_ERROR) {
-                GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+            /* Output the prefix code, and make our CrntCode equal to Pixel. */
+            if (EGifCompressMiss(GifFile, CrntCode, Pixel,
+                                 LineLen - i) == GIF_ERROR)
                 return GIF_ERROR;
-            }
             CrntCode = Pixel;
-
-            /* If however the HashTable if full, we send a clear first and
-             * Clear the hash table.
-             */
-            if (Private->RunningCode >= LZ_MAX_CODE) {
-                /* Time to do some clearance: */
-                if (EGifCompressOutput(GifFile, Private->ClearCode)
-                        == GIF_ERROR) {
-                    GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
-                    return GIF_ERROR;
-                }
-                Private->RunningCode = Private->EOFCode + 1;
-                Private->RunningBits = Private->BitsPerPixel + 1;
-                Private->MaxCode1 = 1 << Private->RunningBits;
-                _ClearHashTable(HashTable);
-            } else {
-                /* Put this unique key with its relative Code in hash table: */
-                _InsertHashTable(HashTable, NewKey, Private->RunningCode++);
-            }
+            if (Private->Lossy != NULL && !Private->Options.LossyDiffuse)
+                memset(Private->Lossy->Carry, '\0',
+                       sizeof(Private->Lossy->Carry));
         }
-
     }
 
     /* Preserve the current state of the compression algorithm: */
     Private->CrntCode = CrntCode;
 
-    if (Private->PixelCount == 0) {
+    if (Private->PixelCount == 0 && !Private->RawCodes) {
         /* We are done - output last Code and flush output buffers: */
         if (EGifCompressOutput(GifFile, CrntCode) == GIF_ERROR) {
-            GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+            GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_DISK_IS_FULL);
             return GIF_ERROR;
         }
         if (EGifCompressOutput(GifFile, Private->EOFCode) == GIF_ERROR) {
-            GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+            GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_DISK_IS_FULL);
             return GIF_ERROR;
         }
         if (EGifCompressOutput(GifFile, FLUSH_OUTPUT) == GIF_ERROR) {
-            GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+            GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_DISK_IS_FULL);
             return GIF_ERROR;
         }
     }
@@ -970,10 +1491,211 @@ EGifCompressLine(GifFileType *GifFile,
     return GIF_OK;
 }
 
+/******************************************************************************
+ Deal with a string the code table has no code for, i.e. Prefix followed by
+ Pixel: output Prefix, and put the string in the table.  If however the
+ table is full, send a clear first and clear it - unless the policy says to
+ keep coding with the table as it is, which decoders must (and do) accept.
+ Pending is how many pixels of the line are still to come after Pixel.
+******************************************************************************/
+static int
+EGifCompressMiss(GifFileType *GifFile, const int Prefix, const int Pixel,
+                 const int Pending)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+
+    if (EGifCompressOutput(GifFile, Prefix) == GIF_ERROR) {
+        GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_DISK_IS_FULL);
+        return GIF_ERROR;
+    }
+
+    if (Private->RunningCode >= Private->ClearAt) {
+        if (EGifTimeToClear(GifFile, Pending)) {
+            /* Time to do some clearance: */
+            if (EGifCompressOutput(GifFile, Private->ClearCode)
+                    == GIF_ERROR) {
+                GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_DISK_IS_FULL);
+                return GIF_ERROR;
+            }
+            Private->RunningCode = Private->EOFCode + 1;
+            Private->RunningBits = Private->BitsPerPixel + 1;
+            Private->MaxCode1 = 1 << Private->RunningBits;
+            _ClearCodeTable(Private->CodeTable);
+            EGifMarkClear(Private, Pending);
+        }
+    } else {
+        /* Put this unique string with its relative Code in table: */
+        _InsertCodeTable(Private->CodeTable, Prefix, Pixel,
+                         Private->RunningCode++);
+    }
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Note where the last Clear went, for GIF_CLEAR_ADAPTIVE.  Pending is how
+ many pixels of the line being compressed are still to come.
+******************************************************************************/
+static void
+EGifMarkClear(GifFilePrivateType *Private, const int Pending)
+{
+    Private->ClearPixelsLeft = Private->PixelCount + Pending;
+    Private->ClearBits = (uint64_t)(Private->CodeBytes + Private->CodeBufLen) * 8
+        + Private->CrntShiftState;
+    Private->RatioPixels = 0;
+    Private->RatioBits = 0;
+    Private->CodesToCheck = ADAPTIVE_CHECK_CODES;
+}
+
+/******************************************************************************
+ How far apart two colors look: squared differences weighted for the eye's
+ sensitivity to each primary, scaled so that an error of n in all three
+ comes to 9 * n * n.
+******************************************************************************/
+static int
+EGifColorError(const int *Color1, const int *Color2)
+{
+    int Red = Color1[0] - Color2[0];
+    int Green = Color1[1] - Color2[1];
+    int Blue = Color1[2] - Color2[2];
+
+    return 3 * Red * Red + 4 * Green * Green + 2 * Blue * Blue;
+}
+
+/******************************************************************************
+ Get ready to code an image lossily, if the options say to: note the colors
+ of its map and, for each, the others that might take its place in a
+ string.  Those are within the allowed error of it in each primary, so no
+ pixel comes out further off than that whatever error is carried along.
+ The transparent color is never swapped, either way.
+******************************************************************************/
+static int
+EGifSetupLossy(GifFileType *GifFile, const ColorMapObject *Map)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+    GifLossyType *Lossy;
+    int Error = Private->Options.LossyError, Colors, p, q;
+
+    if (Error <= 0 || Private->Literal) {
+        free(Private->Lossy);
+        Private->Lossy = NULL;
+        return GIF_OK;
+    }
+    if (Private->Lossy == NULL) {
+        Private->Lossy = (GifLossyType *)malloc(sizeof(GifLossyType));
+        if (Private->Lossy == NULL) {
+            GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+            return GIF_ERROR;
+        }
+    }
+    Lossy = Private->Lossy;
+
+    Colors = Map->ColorCount < 256 ? Map->ColorCount : 256;
+    memset(Lossy->Colors, '\0', sizeof(Lossy->Colors));
+    for (p = 0; p < Colors; p++) {
+        Lossy->Colors[p][0] = Map->Colors[p].Red;
+        Lossy->Colors[p][1] = Map->Colors[p].Green;
+        Lossy->Colors[p][2] = Map->Colors[p].Blue;
+    }
+    Lossy->Limit = 9 * Error * Error;
+
+    for (p = 0; p < 256; p++) {
+        Lossy->NearCount[p] = 0;
+        if (p >= Colors || p == Private->Transparent)
+            continue;
+        for (q = 0; q < Colors; q++)
+            if (q != p && q != Private->Transparent
+                && abs(Lossy->Colors[p][0] - Lossy->Colors[q][0]) <= Error
+                && abs(Lossy->Colors[p][1] - Lossy->Colors[q][1]) <= Error
+                && abs(Lossy->Colors[p][2] - Lossy->Colors[q][2]) <= Error)
+                Lossy->Near[p][Lossy->NearCount[p]++] = q;
+    }
+    memset(Lossy->Carry, '\0', sizeof(Lossy->Carry));
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ The string Prefix followed by Pixel isn't in the table; look for Prefix
+ followed by a color that can pass for Pixel, i.e. within the allowed error
+ of Pixel's color plus the error carried from the pixels before.  Returns
+ the code of the closest such string, and carries its error on, or -1 if
+ there is none.
+******************************************************************************/
+static int
+EGifLossyLookup(GifFilePrivateType *Private, const int Prefix,
+                const int Pixel)
+{
+    GifLossyType *Lossy = Private->Lossy;
+    int Target[3], Best = -1, BestColor = 0, BestError = Lossy->Limit + 1;
+    int k, n;
+
+    for (k = 0; k < 3; k++)
+        Target[k] = Lossy->Colors[Pixel][k] + Lossy->Carry[k];
+    for (n = 0; n < Lossy->NearCount[Pixel]; n++) {
+        int Color = Lossy->Near[Pixel][n];
+        int Code = _LookupCodeTable(Private->CodeTable, Prefix, Color);
+
+        if (Code >= 0) {
+            int Error = EGifColorError(Target, Lossy->Colors[Color]);
+
+            if (Error < BestError) {
+                Best = Code;
+                BestColor = Color;
+                BestError = Error;
+            }
+        }
+    }
+    if (Best >= 0)
+        for (k = 0; k < 3; k++)
+            Lossy->Carry[k] = Target[k] - Lossy->Colors[BestColor][k];
+
+    return Best;
+}
+
+/******************************************************************************
+ Decide, with the code table full, whether to clear it now.  The adaptive
+ policy works like compress(1): every so often it works out the ratio of
+ pixels to code bits since the last Clear, and clears as soon as that
+ ratio drops, i.e. when the stale table has begun to cost more than it saves.
+******************************************************************************/
+static bool
+EGifTimeToClear(GifFileType *GifFile, const int Pending)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+    unsigned long Pixels;
+    uint64_t Bits;
+
+    /* Short of 12 bits the decoder would widen its codes past the table. */
+    if (Private->ClearAt < LZ_MAX_CODE)
+        return true;
+
+    switch (Private->Options.ClearPolicy) {
+    case GIF_CLEAR_DEFERRED:
+        return false;
+    case GIF_CLEAR_ADAPTIVE:
+        if (--Private->CodesToCheck > 0)
+            return false;
+        Private->CodesToCheck = ADAPTIVE_CHECK_CODES;
+        Pixels = Private->ClearPixelsLeft - (Private->PixelCount + Pending);
+        Bits = (uint64_t)(Private->CodeBytes + Private->CodeBufLen) * 8
+            + Private->CrntShiftState - Private->ClearBits;
+        if ((uint64_t)Pixels * Private->RatioBits
+                < (uint64_t)Private->RatioPixels * Bits)
+            return true;
+        Private->RatioPixels = Pixels;
+        Private->RatioBits = Bits;
+        return false;
+    default:
+        return true;
+    }
+}
+
 /******************************************************************************
  The LZ compression output routine:
  This routine is responsible for the compression of the bit stream into
- 8 bits (bytes) packets.
+ 8 bits (bytes) packets.  Codes are gathered in the 64-bit CrntShiftDWord
+ and moved to CodeBuf 32 bits at a time.
  Returns GIF_OK if written successfully.
 ******************************************************************************/
 static int
@@ -986,28 +1708,16 @@ EGifCompressOutput(GifFileType *GifFile,
     if (Code == FLUSH_OUTPUT) {
         while (Private->CrntShiftState > 0) {
             /* Get Rid of what is left in DWord, and flush it. */
-            if (EGifBufferedOutput(GifFile, Private->Buf,
-                                 Private->CrntShiftDWord & 0xff) == GIF_ERROR)
-                retval = GIF_ERROR;
+            Private->CodeBuf[Private->CodeBufLen++] =
+                Private->CrntShiftDWord & 0xff;
             Private->CrntShiftDWord >>= 8;
             Private->CrntShiftState -= 8;
         }
         Private->CrntShiftState = 0;    /* For next time. */
-        if (EGifBufferedOutput(GifFile, Private->Buf,
-                               FLUSH_OUTPUT) == GIF_ERROR)
+        if (EGifFlushCodeBuf(GifFile, true) == GIF_ERROR)
             retval = GIF_ERROR;
-    } else {
-        Private->CrntShiftDWord |= ((long)Code) << Private->CrntShiftState;
-        Private->CrntShiftState += Private->RunningBits;
-        while (Private->CrntShiftState >= 8) {
-            /* Dump out full bytes: */
-            if (EGifBufferedOutput(GifFile, Private->Buf,
-                                 Private->CrntShiftDWord & 0xff) == GIF_ERROR)
-                retval = GIF_ERROR;
-            Private->CrntShiftDWord >>= 8;
-            Private->CrntShiftState -= 8;
-        }
-    }
+    } else if (EGifPutBits(GifFile, Code, Private->RunningBits) == GIF_ERROR)
+        retval = GIF_ERROR;
 
     /* If code cannt fit into RunningBits bits, must raise its size. Note */
     /* however that codes above 4095 are used for special signaling.      */
@@ -1019,39 +1729,79 @@ EGifCompressOutput(GifFileType *GifFile,
 }
 
 /******************************************************************************
- This routines buffers the given characters until 255 characters are ready
- to be output. If Code is equal to -1 the buffer is flushed (EOF).
- The buffer is Dumped with first byte as its size, as GIF format requires.
- Returns GIF_OK if written successfully.
+ Append the low NBits (at most 32) bits of Bits to the output bit stream.
 ******************************************************************************/
 static int
-EGifBufferedOutput(GifFileType *GifFile,
-                   GifByteType *Buf,
-                   int c)
+EGifPutBits(GifFileType *GifFile, const uint32_t Bits, const int NBits)
 {
-    if (c == FLUSH_OUTPUT) {
-        /* Flush everything out. */
-        if (Buf[0] != 0
-            && InternalWrite(GifFile, Buf, Buf[0] + 1) != (unsigned)(Buf[0] + 1)) {
-            GifFile->Error = E_GIF_ERR_WRITE_FAILED;
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+
+    Private->CrntShiftDWord |= ((uint64_t)Bits) << Private->CrntShiftState;
+    Private->CrntShiftState += NBits;
+    if (Private->CrntShiftState >= 32) {
+        /* Dump out a full word, low byte first: */
+        GifByteType *Word = Private->CodeBuf + Private->CodeBufLen;
+
+        Word[0] = Private->CrntShiftDWord & 0xff;
+        Word[1] = (Private->CrntShiftDWord >> 8) & 0xff;
+        Word[2] = (Private->CrntShiftDWord >> 16) & 0xff;
+        Word[3] = (Private->CrntShiftDWord >> 24) & 0xff;
+        Private->CodeBufLen += 4;
+        Private->CrntShiftDWord >>= 32;
+        Private->CrntShiftState -= 32;
+        if (Private->CodeBufLen >= CODE_BUF_FLUSH
+            && EGifFlushCodeBuf(GifFile, false) == GIF_ERROR)
             return GIF_ERROR;
-        }
-        /* Mark end of compressed data, by an empty block (see GIF doc): */
-        Buf[0] = 0;
-        if (InternalWrite(GifFile, Buf, 1) != 1) {
-            GifFile->Error = E_GIF_ERR_WRITE_FAILED;
+    }
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ This routine cuts the bytes staged in CodeBuf into data sub-blocks, each
+ prefixed with its size as GIF format requires, and writes them out in one
+ go.  Only full 255-byte blocks are written unless Final is set, in which
+ case the short last block and the empty block ending the image follow.
+ Returns GIF_OK if written successfully.
+******************************************************************************/
+static int
+EGifFlushCodeBuf(GifFileType *GifFile, const bool Final)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+    GifByteType *Src = Private->CodeBuf, *Dst = Private->BlockBuf;
+    size_t Left = Private->CodeBufLen, Len;
+
+    if (Private->RawCodes) {
+        /* A strip for EGifSpewParallel(); the blocks come later. */
+        Private->CodeBytes += Left;
+        Private->CodeBufLen = 0;
+        if (Left > 0 && InternalWrite(GifFile, Src, Left) != Left) {
+            GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_WRITE_FAILED);
             return GIF_ERROR;
         }
-    } else {
-        if (Buf[0] == 255) {
-            /* Dump out this buffer - it is full: */
-            if (InternalWrite(GifFile, Buf, Buf[0] + 1) != (unsigned)(Buf[0] + 1)) {
-                GifFile->Error = E_GIF_ERR_WRITE_FAILED;
-                return GIF_ERROR;
-            }
-            Buf[0] = 0;
-        }
-        Buf[++Buf[0]] = c;
+        return GIF_OK;
+    }
+
+    while (Left >= 255 || (Final && Left > 0)) {
+        Len = (Left < 255) ? Left : 255;
+        *Dst++ = (GifByteType)Len;
+        memcpy(Dst, Src, Len);
+        Dst += Len;
+        Src += Len;
+        Left -= Len;
+    }
+    if (Final)
+        *Dst++ = 0;    /* Mark end of compressed data (see GIF doc). */
+
+    /* Keep the tail of a short block for next time. */
+    Private->CodeBytes += Private->CodeBufLen - Left;
+    memmove(Private->CodeBuf, Src, Left);
+    Private->CodeBufLen = Left;
+
+    Len = Dst - Private->BlockBuf;
+    if (Len > 0 && InternalWrite(GifFile, Private->BlockBuf, Len) != Len) {
+        GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_WRITE_FAILED);
+        return GIF_ERROR;
     }
 
     return GIF_OK;
@@ -1086,11 +1836,251 @@ EGifWriteExtensions(GifFileType *GifFileOut,
     return (GIF_OK);
 }
 
+/******************************************************************************
+ Bytes of compressed data a raster comes to when coded against Map, or 0
+ if that can't be found out.  Used to try encoding choices before
+ committing to one.
+******************************************************************************/
+size_t
+_GifEncodedSize(const GifByteType *Raster, int Width, int Height,
+		bool Interlace, const ColorMapObject *Map)
+{
+    static const int InterlacedOffset[] = { 0, 4, 2, 1 };
+    static const int InterlacedJumps[] = { 8, 8, 4, 2 };
+    GifFileType *GifFile;
+    GifByteType *Buffer = NULL, *Line;
+    size_t Size = 0, HeaderSize = 0;
+    int Error, Pass, y, Status;
+
+    if ((Line = (GifByteType *)malloc(Width > 0 ? Width : 1)) == NULL)
+	return 0;
+    if ((GifFile = EGifOpenMemory(&Buffer, &Size, &Error)) == NULL) {
+	free(Line);
+	return 0;
+    }
+    Status = EGifPutScreenDesc(GifFile, Width, Height, 8, 0, Map);
+    if (Status == GIF_OK)
+	Status = EGifPutImageDesc(GifFile, 0, 0, Width, Height, false, NULL);
+    if (Status == GIF_OK)
+	HeaderSize = ((GifFilePrivateType *)GifFile->Private)->Memory->Len;
+    for (Pass = Interlace ? 0 : 3; Status == GIF_OK && Pass < 4; Pass++)
+	for (y = Interlace ? InterlacedOffset[Pass] : 0;
+	     Status == GIF_OK && y < Height;
+	     y += Interlace ? InterlacedJumps[Pass] : 1) {
+	    /* EGifPutLine() masks the pixels in place */
+	    memcpy(Line, Raster + (size_t)y * Width, Width);
+	    Status = EGifPutLine(GifFile, Line, Width);
+	}
+    free(Line);
+    if (EGifCloseFile(GifFile, &Error) == GIF_ERROR || Status == GIF_ERROR)
+	return 0;
+    free(Buffer);
+    return Size - HeaderSize;
+}
+
+/******************************************************************************
+ Note the colors an image uses, counting its transparent color.  Returns
+ false if it uses one that isn't in a map of ColorCount entries.
+******************************************************************************/
+static bool
+EGifMarkUsedColors(GifFileType *GifFile, int ImageIndex, int ColorCount,
+		   bool Used[256])
+{
+    const SavedImage *sp = &GifFile->SavedImages[ImageIndex];
+    size_t Len = (size_t)sp->ImageDesc.Width * sp->ImageDesc.Height, i;
+    GraphicsControlBlock GCB;
+    bool Seen[256];
+
+    memset(Seen, '\0', sizeof(Seen));
+    for (i = 0; i < Len; i++)
+	Seen[sp->RasterBits[i]] = true;
+    if (DGifSavedExtensionToGCB(GifFile, ImageIndex, &GCB) == GIF_OK
+	&& GCB.TransparentColor != NO_TRANSPARENT_COLOR)
+	Seen[GCB.TransparentColor & 0xff] = true;
+    for (i = 0; i < 256; i++)
+	if (Seen[i]) {
+	    if ((int)i >= ColorCount)
+		return false;
+	    Used[i] = true;
+	}
+    return true;
+}
+
+/******************************************************************************
+ Build the smallest map holding just the Used colors of Map, and the
+ Translation into it.  *Compact is left NULL if that isn't any narrower.
+ Returns false if memory runs out.
+******************************************************************************/
+static bool
+EGifCompactColorMap(const ColorMapObject *Map, const bool Used[256],
+		    GifPixelType Translation[256], ColorMapObject **Compact)
+{
+    int i, Count = 0;
+
+    *Compact = NULL;
+    for (i = 0; i < Map->ColorCount && i < 256; i++)
+	if (Used[i])
+	    Translation[i] = (GifPixelType)Count++;
+    if (GifBitSize(Count) >= Map->BitsPerPixel)
+	return true;
+    if ((*Compact = GifMakeMapObject(1 << GifBitSize(Count), NULL)) == NULL)
+	return false;
+    for (i = 0; i < Map->ColorCount && i < 256; i++)
+	if (Used[i])
+	    (*Compact)->Colors[Translation[i]] = Map->Colors[i];
+    return true;
+}
+
+/******************************************************************************
+ Run an image, and its transparent color, through a color translation.
+******************************************************************************/
+static void
+EGifTranslateImage(GifFileType *GifFile, int ImageIndex,
+		   GifPixelType Translation[256])
+{
+    GraphicsControlBlock GCB;
+
+    GifApplyTranslation(&GifFile->SavedImages[ImageIndex], Translation);
+    if (DGifSavedExtensionToGCB(GifFile, ImageIndex, &GCB) == GIF_OK
+	&& GCB.TransparentColor != NO_TRANSPARENT_COLOR) {
+	GCB.TransparentColor = Translation[GCB.TransparentColor & 0xff];
+	/* the extension exists, so this rewrites it in place */
+	(void)EGifGCBToSavedExtension(&GCB, GifFile, ImageIndex);
+    }
+}
+
+/******************************************************************************
+ Whether an image can be written out as the compressed data DGifSlurp()
+ kept for it, i.e. it has some and its raster hasn't changed since: the
+ same pixels, in the same row order.
+******************************************************************************/
+static bool
+EGifKeptImage(const SavedImage *sp)
+{
+    size_t Pixels = (size_t)sp->ImageDesc.Width * sp->ImageDesc.Height;
+
+    return sp->CompressedBits != NULL && sp->CompressedRaster != NULL
+	&& sp->CompressedPixels == Pixels
+	&& sp->CompressedInterlace == sp->ImageDesc.Interlace
+	&& memcmp(sp->CompressedRaster, sp->RasterBits, Pixels) == 0;
+}
+
+/******************************************************************************
+ Cut color maps down to the colors actually used, so that LZW coding can
+ start with narrower codes.  The global map is trimmed to what the images
+ drawn with it use, local maps to what their image uses, and an image
+ drawn with the global map gets a trimmed local one of its own if that
+ comes out smaller, map included.
+******************************************************************************/
+static int
+EGifTrimColorMaps(GifFileType *GifFile)
+{
+    ColorMapObject *Compact;
+    GifPixelType Translation[256];
+    bool Used[256], Valid = true;
+    int i;
+
+    if (GifFile->SColorMap != NULL) {
+	memset(Used, '\0', sizeof(Used));
+	if (GifFile->SBackGroundColor < GifFile->SColorMap->ColorCount)
+	    Used[GifFile->SBackGroundColor & 0xff] = true;
+	for (i = 0; Valid && i < GifFile->ImageCount; i++)
+	    if (GifFile->SavedImages[i].RasterBits != NULL
+		&& GifFile->SavedImages[i].ImageDesc.ColorMap == NULL)
+		Valid = EGifMarkUsedColors(GifFile, i,
+					   GifFile->SColorMap->ColorCount,
+					   Used);
+	if (Valid) {
+	    if (!EGifCompactColorMap(GifFile->SColorMap, Used, Translation,
+				     &Compact)) {
+		GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	    }
+	    if (Compact != NULL) {
+		for (i = 0; i < GifFile->ImageCount; i++)
+		    if (GifFile->SavedImages[i].RasterBits != NULL
+			&& GifFile->SavedImages[i].ImageDesc.ColorMap == NULL)
+			EGifTranslateImage(GifFile, i, Translation);
+		if (GifFile->SBackGroundColor
+		    < GifFile->SColorMap->ColorCount)
+		    GifFile->SBackGroundColor =
+			Translation[GifFile->SBackGroundColor & 0xff];
+		GifFreeMapObject(GifFile->SColorMap);
+		GifFile->SColorMap = Compact;
+	    }
+	}
+    }
+
+    for (i = 0; i < GifFile->ImageCount; i++) {
+	SavedImage *sp = &GifFile->SavedImages[i];
+	const ColorMapObject *Map = sp->ImageDesc.ColorMap
+				    ? sp->ImageDesc.ColorMap
+				    : GifFile->SColorMap;
+
+	if (sp->RasterBits == NULL || Map == NULL)
+	    continue;
+	memset(Used, '\0', sizeof(Used));
+	if (!EGifMarkUsedColors(GifFile, i, Map->ColorCount, Used))
+	    continue;
+	if (!EGifCompactColorMap(Map, Used, Translation, &Compact)) {
+	    GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+	    return GIF_ERROR;
+	}
+	if (Compact == NULL)
+	    continue;
+
+	/*
+	 * Narrower codes only pay for a new local map if they save more
+	 * than its size, which takes a trial compression to know.
+	 */
+	if (sp->ImageDesc.ColorMap == NULL) {
+	    size_t Len = (size_t)sp->ImageDesc.Width * sp->ImageDesc.Height;
+	    size_t Before, After, j;
+	    GifByteType *Trial;
+
+	    /* LZW codes never start narrower than 3 bits */
+	    if (Map->BitsPerPixel <= 2) {
+		GifFreeMapObject(Compact);
+		continue;
+	    }
+	    if ((Trial = (GifByteType *)malloc(Len ? Len : 1)) == NULL) {
+		GifFreeMapObject(Compact);
+		GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	    }
+	    for (j = 0; j < Len; j++)
+		Trial[j] = Translation[sp->RasterBits[j]];
+	    Before = _GifEncodedSize(sp->RasterBits, sp->ImageDesc.Width,
+				     sp->ImageDesc.Height,
+				     sp->ImageDesc.Interlace, Map);
+	    After = _GifEncodedSize(Trial, sp->ImageDesc.Width,
+				    sp->ImageDesc.Height,
+				    sp->ImageDesc.Interlace, Compact);
+	    free(Trial);
+	    if (Before == 0 || After == 0
+		|| After + 3 * (size_t)Compact->ColorCount >= Before) {
+		GifFreeMapObject(Compact);
+		continue;
+	    }
+	} else
+	    GifFreeMapObject(sp->ImageDesc.ColorMap);
+	sp->ImageDesc.ColorMap = Compact;
+	EGifTranslateImage(GifFile, i, Translation);
+    }
+
+    return GIF_OK;
+}
+
 int
 EGifSpew(GifFileType *GifFileOut) 
 {
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFileOut->Private;
     int i, j; 
 
+    if (Private->Options.TrimColorMaps
+	&& EGifTrimColorMaps(GifFileOut) == GIF_ERROR)
+	return (GIF_ERROR);
+
     if (EGifPutScreenDesc(GifFileOut,
                           GifFileOut->SWidth,
                           GifFileOut->SHeight,
@@ -1114,6 +2104,15 @@ EGifSpew(GifFileType *GifFileOut)
 				sp->ExtensionBlockCount) == GIF_ERROR)
 	    return (GIF_ERROR);
 
+        /* Untouched since DGifSlurp()?  Then it needn't be compressed. */
+        if (EGifKeptImage(sp)) {
+            if (EGifPutCompressedImage(GifFileOut, &sp->ImageDesc,
+                                       sp->CompressedBits,
+                                       sp->CompressedLength) == GIF_ERROR)
+                return (GIF_ERROR);
+            continue;
+        }
+
         if (EGifPutImageDesc(GifFileOut,
                              sp->ImageDesc.Left,
                              sp->ImageDesc.Top,
@@ -1162,4 +2161,458 @@ EGifSpew(GifFileType *GifFileOut)
     return (GIF_OK);
 }
 
+#ifndef _WIN32
+/*
+ * One unit of work for EGifSpewParallel(): a whole image, or a strip of
+ * one.  Strips are compressed as bare LZW bits, which the writer stitches
+ * together with a Clear code in front of each.
+ */
+typedef struct GifSpewJobType {
+    int Image;            /* Index into SavedImages */
+    int FirstRow, Rows;   /* In the order rows are written */
+    bool Strip;
+    bool Kept;            /* Goes out as the image's CompressedBits */
+    GifByteType *Data;    /* Compressed image, or a strip's bits */
+    size_t Len;
+    size_t Bits;          /* Strip only: bits in Data */
+    int EndBits;          /* Strip only: code width at its end */
+    int Error;            /* E_GIF_SUCCEEDED or why compression failed */
+    bool Done;
+} GifSpewJobType;
+
+typedef struct GifSpewPoolType {
+    GifFileType *GifFileOut;
+    GifSpewJobType *Jobs;
+    int JobCount;
+    int NextJob;          /* Jobs before this are taken */
+    pthread_mutex_t Lock;
+    pthread_cond_t JobDone;
+} GifSpewPoolType;
+
+/******************************************************************************
+ Map the n'th row written to its row in the raster.
+******************************************************************************/
+static int
+EGifWrittenRow(const GifImageDesc *ImageDesc, int n)
+{
+    static const int InterlacedOffset[] = { 0, 4, 2, 1 };
+    static const int InterlacedJumps[] = { 8, 8, 4, 2 };
+    int k;
+
+    if (!ImageDesc->Interlace)
+	return n;
+    for (k = 0; k < 4; k++) {
+	int PassRows = (ImageDesc->Height - InterlacedOffset[k]
+			+ InterlacedJumps[k] - 1) / InterlacedJumps[k];
+	if (PassRows < 0)
+	    PassRows = 0;
+	if (n < PassRows)
+	    return InterlacedOffset[k] + n * InterlacedJumps[k];
+	n -= PassRows;
+    }
+    return n;    /* Not reached for n < Height. */
+}
+
+/******************************************************************************
+ Compress a job's rows into memory on a private encoder state, with its own
+ code table, so any number of these can run at once.  A whole image comes
+ out exactly as EGifSpew() would write it after the image descriptor.
+ Rows are masked in a scratch line, leaving RasterBits untouched.
+******************************************************************************/
+static void
+EGifCompressJob(const GifFileType *GifFileOut, GifSpewJobType *Job)
+{
+    const SavedImage *sp = &GifFileOut->SavedImages[Job->Image];
+    GifFileType GifFile;
+    GifFilePrivateType Private;
+    GifMemoryOutputType Memory;
+    GraphicsControlBlock GCB;
+    GifPixelType *Line;
+    int Width = sp->ImageDesc.Width;
+
+    memset(&GifFile, '\0', sizeof(GifFileType));
+    memset(&Private, '\0', sizeof(GifFilePrivateType));
+    memset(&Memory, '\0', sizeof(GifMemoryOutputType));
+
+    /* The color maps are borrowed; this handle is never closed. */
+    GifFile.SColorMap = GifFileOut->SColorMap;
+    GifFile.Image = sp->ImageDesc;
+    GifFile.Private = (void *)&Private;
+    Private.FileState = FILE_STATE_WRITE | FILE_STATE_IMAGE;
+    Private.PixelCount = (long)Width * (long)Job->Rows;
+    Private.Memory = &Memory;
+    Private.RawCodes = Job->Strip;
+    Private.Options = ((GifFilePrivateType *)GifFileOut->Private)->Options;
+    Private.Transparent = NO_TRANSPARENT_COLOR;
+    if (DGifSavedExtensionToGCB((GifFileType *)GifFileOut, Job->Image,
+                                &GCB) == GIF_OK)
+        Private.Transparent = GCB.TransparentColor;
+
+    Private.CodeTable = _InitCodeTable();
+    Line = (GifPixelType *)calloc((size_t)Width + 1, sizeof(GifPixelType));
+    if (Private.CodeTable == NULL || Line == NULL)
+	GifFile.Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+    else if (EGifSetupCompress(&GifFile) == GIF_OK) {
+	int n;
+
+	for (n = Job->FirstRow;
+	     n < Job->FirstRow + Job->Rows && GifFile.Error == E_GIF_SUCCEEDED;
+	     n++) {
+	    memcpy(Line,
+		   sp->RasterBits
+		   + (long)EGifWrittenRow(&sp->ImageDesc, n) * Width,
+		   Width);
+	    (void)EGifPutLine(&GifFile, Line, Width);
+	}
+
+	/*
+	 * A strip ends with its last code, leaving the EOF code or the
+	 * next strip's Clear to the writer, which has to know the width
+	 * the decoder will read it at.
+	 */
+	if (Job->Strip && GifFile.Error == E_GIF_SUCCEEDED) {
+	    if (EGifCompressOutput(&GifFile, Private.CrntCode) == GIF_ERROR)
+		GifFile.Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+	    else {
+		Job->EndBits = Private.RunningBits;
+		Job->Bits = (Memory.Len + Private.CodeBufLen) * 8
+		    + Private.CrntShiftState;
+		if (EGifCompressOutput(&GifFile, FLUSH_OUTPUT) == GIF_ERROR)
+		    GifFile.Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+	    }
+	}
+    }
+
+    Job->Error = GifFile.Error;
+    if (Job->Error == E_GIF_SUCCEEDED) {
+	Job->Data = Memory.Data;
+	Job->Len = Memory.Len;
+    } else
+	free(Memory.Data);
+
+    free(Line);
+    _FreeCodeTable(Private.CodeTable);
+    free(Private.CodeBuf);
+    free(Private.BlockBuf);
+    free(Private.WriteBuf);
+    free(Private.Lossy);
+}
+
+/******************************************************************************
+ Worker thread: take jobs in order until none are left.
+******************************************************************************/
+static void *
+EGifSpewWorker(void *Arg)
+{
+    GifSpewPoolType *Pool = (GifSpewPoolType *)Arg;
+
+    for (;;) {
+	int i;
+
+	pthread_mutex_lock(&Pool->Lock);
+	i = Pool->NextJob < Pool->JobCount ? Pool->NextJob++ : -1;
+	pthread_mutex_unlock(&Pool->Lock);
+	if (i < 0)
+	    break;
+
+	if (!Pool->Jobs[i].Kept)
+	    EGifCompressJob(Pool->GifFileOut, &Pool->Jobs[i]);
+
+	pthread_mutex_lock(&Pool->Lock);
+	Pool->Jobs[i].Done = true;
+	pthread_cond_broadcast(&Pool->JobDone);
+	pthread_mutex_unlock(&Pool->Lock);
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+ Append a strip's bits to the image being written.
+******************************************************************************/
+static int
+EGifPutStripBits(GifFileType *GifFile, const GifSpewJobType *Job)
+{
+    const GifByteType *Src = Job->Data;
+    size_t Left = Job->Bits;
+
+    while (Left >= 32) {
+	if (EGifPutBits(GifFile,
+			(uint32_t)Src[0] | (uint32_t)Src[1] << 8
+			| (uint32_t)Src[2] << 16 | (uint32_t)Src[3] << 24,
+			32) == GIF_ERROR)
+	    return GIF_ERROR;
+	Src += 4;
+	Left -= 32;
+    }
+    if (Left > 0) {
+	uint32_t Word = 0;
+	size_t i;
+
+	for (i = 0; i * 8 < Left; i++)
+	    Word |= (uint32_t)Src[i] << (8 * i);
+	if (EGifPutBits(GifFile, Word & ((1UL << Left) - 1),
+			(int)Left) == GIF_ERROR)
+	    return GIF_ERROR;
+    }
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Write the compressed data of an image split into strips: one LZW stream
+ with a Clear code ahead of each strip, at the width the decoder will be
+ using by then.
+******************************************************************************/
+static int
+EGifPutStrips(GifFileType *GifFile, const GifSpewJobType *Jobs, int Count)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+    int i;
+
+    /* Code size and the opening Clear, as for any image. */
+    if (EGifSetupCompress(GifFile) == GIF_ERROR)
+	return GIF_ERROR;
+
+    for (i = 0; i < Count; i++) {
+	if ((i > 0 && EGifPutBits(GifFile, Private->ClearCode,
+				  Jobs[i - 1].EndBits) == GIF_ERROR)
+	    || EGifPutStripBits(GifFile, &Jobs[i]) == GIF_ERROR) {
+	    GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_DISK_IS_FULL);
+	    return GIF_ERROR;
+	}
+    }
+
+    if (EGifPutBits(GifFile, Private->EOFCode,
+		    Jobs[Count - 1].EndBits) == GIF_ERROR
+	|| EGifCompressOutput(GifFile, FLUSH_OUTPUT) == GIF_ERROR) {
+	GifFile->Error = WRITE_ERROR(GifFile, E_GIF_ERR_DISK_IS_FULL);
+	return GIF_ERROR;
+    }
+
+    return GIF_OK;
+}
+#endif /* _WIN32 */
+
+/******************************************************************************
+ Set how many rows EGifSpewParallel() puts in each strip when it splits
+ an image so the strips can be compressed at once; 0, the default, never
+ splits.  Each strip starts over with an empty code table, so this trades
+ compression for speed on big images.
+******************************************************************************/
+int
+EGifSetStripHeight(GifFileType *GifFile, int StripHeight)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+    if (!IS_WRITEABLE(Private)) {
+        /* This file was NOT open for writing: */
+        GifFile->Error = E_GIF_ERR_NOT_WRITEABLE;
+        return GIF_ERROR;
+    }
+
+    Private->Options.StripHeight = StripHeight > 0 ? StripHeight : 0;
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Like EGifSpew(), but the images are compressed on up to Threads worker
+ threads (one per online CPU if Threads <= 0) while this thread writes
+ the finished ones out in order.  Output is byte-identical to EGifSpew()
+ unless EGifSetStripHeight() has asked for images to be split.
+******************************************************************************/
+int
+EGifSpewParallel(GifFileType *GifFileOut, int Threads)
+{
+#ifdef _WIN32
+    (void)Threads;
+    return EGifSpew(GifFileOut);
+#else
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFileOut->Private;
+    GifSpewPoolType Pool;
+    pthread_t *Workers;
+    int i, j, Started = 0, Status = GIF_OK;
+
+    if (Threads <= 0) {
+	long CPUs = sysconf(_SC_NPROCESSORS_ONLN);
+	Threads = CPUs > 0 ? (int)CPUs : 1;
+    }
+
+    /* Cut the work up: an image at a time, or a strip at a time. */
+    Pool.JobCount = 0;
+    for (i = 0; i < GifFileOut->ImageCount; i++) {
+	const SavedImage *sp = &GifFileOut->SavedImages[i];
+
+	/* this allows us to delete images by nuking their rasters */
+	if (sp->RasterBits == NULL)
+	    continue;
+	if (Private->Options.StripHeight > 0 && sp->ImageDesc.Width > 0
+	    && sp->ImageDesc.Height > Private->Options.StripHeight)
+	    Pool.JobCount += (sp->ImageDesc.Height + Private->Options.StripHeight - 1)
+		/ Private->Options.StripHeight;
+	else
+	    Pool.JobCount++;
+    }
+    if (Threads > Pool.JobCount)
+	Threads = Pool.JobCount;
+    if (Threads <= 1 && Private->Options.StripHeight == 0)
+	return EGifSpew(GifFileOut);
+    if (Private->Options.TrimColorMaps
+	&& EGifTrimColorMaps(GifFileOut) == GIF_ERROR)
+	return GIF_ERROR;
+    if (Threads < 1)
+	Threads = 1;
+
+    /* This replaces SColorMap, so it must happen before the workers look. */
+    if (EGifPutScreenDesc(GifFileOut,
+                          GifFileOut->SWidth,
+                          GifFileOut->SHeight,
+                          GifFileOut->SColorResolution,
+                          GifFileOut->SBackGroundColor,
+                          GifFileOut->SColorMap) == GIF_ERROR)
+        return (GIF_ERROR);
+
+    Pool.GifFileOut = GifFileOut;
+    Pool.NextJob = 0;
+    Pool.Jobs = (GifSpewJobType *)calloc(Pool.JobCount + 1,
+					 sizeof(GifSpewJobType));
+    Workers = (pthread_t *)malloc(Threads * sizeof(pthread_t));
+    if (Pool.Jobs == NULL || Workers == NULL) {
+	free(Pool.Jobs);
+	free(Workers);
+	GifFileOut->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+	return GIF_ERROR;
+    }
+    for (i = 0, j = 0; i < GifFileOut->ImageCount; i++) {
+	const SavedImage *sp = &GifFileOut->SavedImages[i];
+	int Height = sp->ImageDesc.Height, Row;
+
+	if (sp->RasterBits == NULL)
+	    continue;
+	if (EGifKeptImage(sp)) {
+	    Pool.Jobs[j].Image = i;
+	    Pool.Jobs[j].Kept = true;
+	    j++;
+	} else if (Private->Options.StripHeight > 0 && sp->ImageDesc.Width > 0
+	    && Height > Private->Options.StripHeight) {
+	    for (Row = 0; Row < Height; Row += Private->Options.StripHeight, j++) {
+		Pool.Jobs[j].Image = i;
+		Pool.Jobs[j].FirstRow = Row;
+		Pool.Jobs[j].Rows = (Height - Row < Private->Options.StripHeight)
+		    ? Height - Row : Private->Options.StripHeight;
+		Pool.Jobs[j].Strip = true;
+	    }
+	} else {
+	    Pool.Jobs[j].Image = i;
+	    Pool.Jobs[j].FirstRow = 0;
+	    Pool.Jobs[j].Rows = Height;
+	    j++;
+	}
+    }
+    Pool.JobCount = j;    /* Kept images take one job however tall */
+    pthread_mutex_init(&Pool.Lock, NULL);
+    pthread_cond_init(&Pool.JobDone, NULL);
+
+    for (i = 0; i < Threads; i++) {
+	if (pthread_create(&Workers[i], NULL, EGifSpewWorker, &Pool) != 0)
+	    break;
+	Started++;
+    }
+    if (Started == 0)    /* No threads to be had; do the work ourselves. */
+	(void)EGifSpewWorker(&Pool);
+
+    for (j = 0; Status == GIF_OK && j < Pool.JobCount; ) {
+	GifSpewJobType *Job = &Pool.Jobs[j];
+        SavedImage *sp = &GifFileOut->SavedImages[Job->Image];
+	int Count, k;
+
+	for (Count = 1;
+	     j + Count < Pool.JobCount && Pool.Jobs[j + Count].Image == Job->Image;
+	     Count++)
+	    continue;
+
+	if (Job->Kept) {
+	    if (EGifWriteExtensions(GifFileOut,
+				    sp->ExtensionBlocks,
+				    sp->ExtensionBlockCount) == GIF_ERROR
+		|| EGifPutCompressedImage(GifFileOut, &sp->ImageDesc,
+					  sp->CompressedBits,
+					  sp->CompressedLength) == GIF_ERROR)
+		Status = GIF_ERROR;
+	    j++;
+	    continue;
+	}
+
+	if (EGifWriteExtensions(GifFileOut,
+				sp->ExtensionBlocks,
+				sp->ExtensionBlockCount) == GIF_ERROR
+	    || EGifWriteImageDesc(GifFileOut,
+				  sp->ImageDesc.Left,
+				  sp->ImageDesc.Top,
+				  sp->ImageDesc.Width,
+				  sp->ImageDesc.Height,
+				  sp->ImageDesc.Interlace,
+				  sp->ImageDesc.ColorMap) == GIF_ERROR) {
+	    Status = GIF_ERROR;
+	    break;
+	}
+
+	pthread_mutex_lock(&Pool.Lock);
+	for (k = 0; k < Count; k++)
+	    while (!Job[k].Done)
+		pthread_cond_wait(&Pool.JobDone, &Pool.Lock);
+	pthread_mutex_unlock(&Pool.Lock);
+
+	for (k = 0; k < Count; k++)
+	    if (Job[k].Error != E_GIF_SUCCEEDED) {
+		GifFileOut->Error = Job[k].Error;
+		Status = GIF_ERROR;
+	    }
+	if (Status == GIF_ERROR)
+	    break;
+	if (Job->Strip) {
+	    if (EGifPutStrips(GifFileOut, Job, Count) == GIF_ERROR)
+		Status = GIF_ERROR;
+	} else if (InternalWrite(GifFileOut, Job->Data, Job->Len) != Job->Len) {
+	    GifFileOut->Error = WRITE_ERROR(GifFileOut, E_GIF_ERR_WRITE_FAILED);
+	    Status = GIF_ERROR;
+	}
+	Private->PixelCount = 0;    /* The whole raster went out. */
+
+	for (k = 0; k < Count; k++) {
+	    free(Job[k].Data);
+	    Job[k].Data = NULL;
+	}
+	j += Count;
+    }
+
+    /* Stop handing out jobs, in case we bailed out early. */
+    pthread_mutex_lock(&Pool.Lock);
+    Pool.NextJob = Pool.JobCount;
+    pthread_mutex_unlock(&Pool.Lock);
+    for (i = 0; i < Started; i++)
+	pthread_join(Workers[i], NULL);
+
+    for (j = 0; j < Pool.JobCount; j++)
+	free(Pool.Jobs[j].Data);
+    pthread_cond_destroy(&Pool.JobDone);
+    pthread_mutex_destroy(&Pool.Lock);
+    free(Pool.Jobs);
+    free(Workers);
+
+    if (Status == GIF_ERROR)
+	return GIF_ERROR;
+
+    if (EGifWriteExtensions(GifFileOut,
+			    GifFileOut->ExtensionBlocks,
+			    GifFileOut->ExtensionBlockCount) == GIF_ERROR)
+	return (GIF_ERROR);
+
+    if (EGifCloseFile(GifFileOut, NULL) == GIF_ERROR)
+        return (GIF_ERROR);
+
+    return (GIF_OK);
+#endif /* _WIN32 */
+}
+
 /* end */
@@ -37,11 +37,89 @@ extern void PrintGifError(int ErrorCode);
 /******************************************************************************
  Color table quantization
 ******************************************************************************/
+typedef struct GifQuantizeOptions {
+    int BitsPerPrimary;      /* Color precision, 1 to 8 bits per primary */
+    int Dither;              /* GIF_DITHER_* from gif_lib.h */
+    int Threads;             /* For the pixel passes; <= 0 for one per CPU */
+    int AlphaThreshold;      /* Less alpha is transparent; 128 by default */
+} GifQuantizeOptions;
+
 int GifQuantizeBuffer(unsigned int Width, unsigned int Height,
                    int *ColorMapSize, GifByteType * RedInput,
                    GifByteType * GreenInput, GifByteType * BlueInput,
                    GifByteType * OutputBuffer,
                    GifColorType * OutputColorMap);
+void GifDefaultQuantizeOptions(GifQuantizeOptions *Options);
+int GifQuantizeBufferWithOptions(unsigned int Width, unsigned int Height,
+                   int *ColorMapSize, GifByteType * RedInput,
+                   GifByteType * GreenInput, GifByteType * BlueInput,
+                   GifByteType * OutputBuffer,
+                   GifColorType * OutputColorMap,
+                   const GifQuantizeOptions *Options);
+int GifQuantizePixels(unsigned int Width, unsigned int Height,
+                   int *ColorMapSize, const GifByteType *Pixels,
+                   int Format, size_t Stride,
+                   GifByteType * OutputBuffer,
+                   GifColorType * OutputColorMap,
+                   int *TransparentIndex,
+                   const GifQuantizeOptions *Options);
+SavedImage *GifQuantizeSavedImage(GifFileType *GifFile, int Left, int Top,
+                   unsigned int Width, unsigned int Height,
+                   const GifByteType *Pixels, int Format, size_t Stride,
+                   int ColorMapSize, const GifQuantizeOptions *Options);
+
+/* One color map for many images, from quantize.c */
+typedef struct GifPaletteBuilderType GifPaletteBuilderType;
+
+GifPaletteBuilderType *GifMakePaletteBuilder(const GifQuantizeOptions *Options);
+int GifSamplePaletteBuffer(GifPaletteBuilderType *Builder,
+                   unsigned int Width, unsigned int Height,
+                   const GifByteType *RedInput, const GifByteType *GreenInput,
+                   const GifByteType *BlueInput);
+int GifSamplePalettePixels(GifPaletteBuilderType *Builder,
+                   unsigned int Width, unsigned int Height,
+                   const GifByteType *Pixels, int Format, size_t Stride);
+ColorMapObject *GifBuildPaletteColorMap(GifPaletteBuilderType *Builder,
+                   int ColorMapSize, int *TransparentIndex);
+int GifQuantizeFrameBuffer(const GifPaletteBuilderType *Builder,
+                   unsigned int Width, unsigned int Height,
+                   const GifByteType *RedInput, const GifByteType *GreenInput,
+                   const GifByteType *BlueInput, GifByteType *OutputBuffer);
+int GifQuantizeFramePixels(const GifPaletteBuilderType *Builder,
+                   unsigned int Width, unsigned int Height,
+                   const GifByteType *Pixels, int Format, size_t Stride,
+                   GifByteType *OutputBuffer);
+/* Reads row Row of an image into Pixels; returns GIF_OK or GIF_ERROR. */
+typedef int (*GifReadRowFunc)(void *UserData, unsigned int Row,
+                              GifByteType *Pixels);
+
+int GifSamplePaletteRows(GifPaletteBuilderType *Builder,
+                   unsigned int Width, unsigned int Height, int Format,
+                   GifReadRowFunc ReadRow, void *UserData);
+int GifPutQuantizedRows(const GifPaletteBuilderType *Builder,
+                   GifFileType *GifFile,
+                   unsigned int Width, unsigned int Height, int Format,
+                   GifReadRowFunc ReadRow, void *UserData);
+void GifFreePaletteBuilder(GifPaletteBuilderType *Builder);
+
+/* Frame after frame, keeping a color map while it fits, from quantize.c */
+typedef struct GifFrameQuantizerType GifFrameQuantizerType;
+
+GifFrameQuantizerType *GifMakeFrameQuantizer(const GifQuantizeOptions *Options,
+                   int ColorMapSize, int MaxDrift);
+int GifQuantizeNextFrameBuffer(GifFrameQuantizerType *Quantizer,
+                   unsigned int Width, unsigned int Height,
+                   const GifByteType *RedInput, const GifByteType *GreenInput,
+                   const GifByteType *BlueInput, GifByteType *OutputBuffer,
+                   const ColorMapObject **ColorMap, bool *Local,
+                   int *TransparentIndex);
+int GifQuantizeNextFramePixels(GifFrameQuantizerType *Quantizer,
+                   unsigned int Width, unsigned int Height,
+                   const GifByteType *Pixels, int Format, size_t Stride,
+                   GifByteType *OutputBuffer,
+                   const ColorMapObject **ColorMap, bool *Local,
+                   int *TransparentIndex);
+void GifFreeFrameQuantizer(GifFrameQuantizerType *Quantizer);
 
 /* These used to live in the library header */
 #define GIF_MESSAGE(Msg) fprintf(stderr, "\n%s: %s\n", PROGRAM_NAME, Msg)
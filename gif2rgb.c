@@ -48,44 +48,37 @@ static char
 static char
     *CtrlStr =
 	PROGRAM_NAME
-	" v%- c%-#Colors!d s%-Width|Height!d!d 1%- o%-OutFileName!s h%- GifFile!*s";
+	" v%- c%-#Colors!d p%-BitsPerPrimary!d d%-Dither!s t%-Threads!d m%-MapFile!s f%-Frames!d r%-MaxDrift!d s%-Width|Height!d!d 1%- a%- o%-OutFileName!s h%- GifFile!*s";
+
+/* Bytes in each pixel of a single input file. */
+#define PIXEL_SIZE(Format)	((Format) == GIF_PIXELS_RGB24 ? 3 : 4)
 
 static void LoadRGB(char *FileName,
-		    int OneFileFlag,
-		    GifByteType **RedBuffer,
-		    GifByteType **GreenBuffer,
-		    GifByteType **BlueBuffer,
+		    int OneFileFlag, int PixelSize,
+		    GifByteType *Buffers[3],
 		    int Width, int Height);
 static void SaveGif(GifByteType *OutputBuffer,
 		    int Width, int Height, 
-		    int ExpColorMapSize, ColorMapObject *OutputColorMap);
+		    int ExpColorMapSize, ColorMapObject *OutputColorMap,
+		    int TransparentIndex);
 
 /******************************************************************************
- Load RGB file into internal frame buffer.
+ Load RGB file into internal frame buffer.  A single file of RGB triplets
+ (or RGBA quadruplets, if PixelSize is 4) is loaded as it is into
+ Buffers[0], leaving Buffers[1] and Buffers[2] NULL; three files each go
+ into a buffer of their own.
 ******************************************************************************/
 static void LoadRGB(char *FileName,
-		    int OneFileFlag,
-		    GifByteType **RedBuffer,
-		    GifByteType **GreenBuffer,
-		    GifByteType **BlueBuffer,
+		    int OneFileFlag, int PixelSize,
+		    GifByteType *Buffers[3],
 		    int Width, int Height)
 {
     int i;
     unsigned long Size;
-    GifByteType *RedP, *GreenP, *BlueP;
     FILE *rgbfp[3];
 
     Size = ((long) Width) * Height * sizeof(GifByteType);
 
-    if ((*RedBuffer = (GifByteType *) malloc((unsigned int) Size)) == NULL ||
-	(*GreenBuffer = (GifByteType *) malloc((unsigned int) Size)) == NULL ||
-	(*BlueBuffer = (GifByteType *) malloc((unsigned int) Size)) == NULL)
-	GIF_EXIT("Failed to allocate memory required, aborted.");
-
-    RedP = *RedBuffer;
-    GreenP = *GreenBuffer;
-    BlueP = *BlueBuffer;
-
     if (FileName != NULL) {
 	if (OneFileFlag) {
 	    if ((rgbfp[0] = fopen(FileName, "rb")) == NULL)
@@ -118,27 +111,32 @@ static void LoadRGB(char *FileName,
     GifQprintf("\n%s: RGB image:     ", PROGRAM_NAME);
 
     if (OneFileFlag) {
-	GifByteType *Buffer, *BufferP;
+	GifByteType *BufferP;
 
-	if ((Buffer = (GifByteType *) malloc(Width * 3)) == NULL)
+	if ((Buffers[0] = (GifByteType *) malloc(PixelSize * Size)) == NULL)
 	    GIF_EXIT("Failed to allocate memory required, aborted.");
+	Buffers[1] = Buffers[2] = NULL;
 
-	for (i = 0; i < Height; i++) {
-	    int j;
+	for (i = 0, BufferP = Buffers[0]; i < Height; i++) {
 	    GifQprintf("\b\b\b\b%-4d", i);
-	    if (fread(Buffer, Width * 3, 1, rgbfp[0]) != 1)
+	    if (fread(BufferP, Width * PixelSize, 1, rgbfp[0]) != 1)
 		GIF_EXIT("Input file(s) terminated prematurly.");
-	    for (j = 0, BufferP = Buffer; j < Width; j++) {
-		*RedP++ = *BufferP++;
-		*GreenP++ = *BufferP++;
-		*BlueP++ = *BufferP++;
-	    }
+	    BufferP += Width * PixelSize;
 	}
 
-	free((char *) Buffer);
 	fclose(rgbfp[0]);
     }
     else {
+	GifByteType *RedP, *GreenP, *BlueP;
+
+	for (i = 0; i < 3; i++)
+	    if ((Buffers[i] = (GifByteType *) malloc(Size)) == NULL)
+		GIF_EXIT("Failed to allocate memory required, aborted.");
+
+	RedP = Buffers[0];
+	GreenP = Buffers[1];
+	BlueP = Buffers[2];
+
 	for (i = 0; i < Height; i++) {
 	    GifQprintf("\b\b\b\b%-4d", i);
 	    if (fread(RedP, Width, 1, rgbfp[0]) != 1 ||
@@ -156,12 +154,36 @@ static void LoadRGB(char *FileName,
     }
 }
 
+/******************************************************************************
+ Put a graphics control block making TransparentIndex the transparent
+ color of the next image, unless it is NO_TRANSPARENT_COLOR.
+******************************************************************************/
+static void PutTransparency(GifFileType *GifFile, int TransparentIndex)
+{
+    GraphicsControlBlock GCB;
+    GifByteType Extension[4];
+
+    if (TransparentIndex == NO_TRANSPARENT_COLOR)
+	return;
+    GCB.DisposalMode = DISPOSAL_UNSPECIFIED;
+    GCB.UserInputFlag = false;
+    GCB.DelayTime = 0;
+    GCB.TransparentColor = TransparentIndex;
+    if (EGifPutExtension(GifFile, GRAPHICS_EXT_FUNC_CODE,
+			 (int)EGifGCBToExtension(&GCB, Extension),
+			 Extension) == GIF_ERROR) {
+	PrintGifError(GifFile->Error);
+	exit(EXIT_FAILURE);
+    }
+}
+
 /******************************************************************************
  Save the GIF resulting image.
 ******************************************************************************/
 static void SaveGif(GifByteType *OutputBuffer,
 		    int Width, int Height,
-		    int ExpColorMapSize, ColorMapObject *OutputColorMap)
+		    int ExpColorMapSize, ColorMapObject *OutputColorMap,
+		    int TransparentIndex)
 {
     int i, Error;
     GifFileType *GifFile;
@@ -175,8 +197,12 @@ static void SaveGif(GifByteType *OutputBuffer,
 
     if (EGifPutScreenDesc(GifFile,
 			  Width, Height, ExpColorMapSize, 0,
-			  OutputColorMap) == GIF_ERROR ||
-	EGifPutImageDesc(GifFile,
+			  OutputColorMap) == GIF_ERROR) {
+	PrintGifError(Error);
+	exit(EXIT_FAILURE);
+    }
+    PutTransparency(GifFile, TransparentIndex);
+    if (EGifPutImageDesc(GifFile,
 			 0, 0, Width, Height, false, NULL) == GIF_ERROR) {
 	PrintGifError(Error);
 	exit(EXIT_FAILURE);
@@ -200,43 +226,399 @@ static void SaveGif(GifByteType *OutputBuffer,
     }
 }
 
+/******************************************************************************
+ Quantize a single image of pixels with alpha and save it as a GIF, its
+ transparent color named by the control block the library made for it.
+******************************************************************************/
+static void SaveQuantizedGif(GifByteType *Pixels, int Format,
+			     int Width, int Height, int ExpColorMapSize,
+			     const GifQuantizeOptions *QuantizeOptions)
+{
+    int Error;
+    GifFileType *GifFile;
+
+    if ((GifFile = EGifOpenFileHandle(1, &Error)) == NULL) {
+	PrintGifError(Error);
+	exit(EXIT_FAILURE);
+    }
+    GifFile->SWidth = Width;
+    GifFile->SHeight = Height;
+    GifFile->SColorResolution = ExpColorMapSize;
+    GifFile->SBackGroundColor = 0;
+    if (GifQuantizeSavedImage(GifFile, 0, 0, Width, Height, Pixels, Format,
+			      (size_t)Width * PIXEL_SIZE(Format),
+			      1 << ExpColorMapSize,
+			      QuantizeOptions) == NULL)
+	GIF_EXIT("Failed to allocate memory required, aborted.");
+
+    if (EGifSpew(GifFile) == GIF_ERROR) {
+	PrintGifError(GifFile->Error);
+	exit(EXIT_FAILURE);
+    }
+}
+
+/******************************************************************************
+ Read the global color map of a GIF file, or its first image's if it has
+ none.
+******************************************************************************/
+static ColorMapObject *LoadColorMap(char *FileName)
+{
+    int Error;
+    GifFileType *GifFile;
+    ColorMapObject *ColorMap = NULL;
+
+    if ((GifFile = DGifOpenFileName(FileName, &Error)) == NULL) {
+	PrintGifError(Error);
+	exit(EXIT_FAILURE);
+    }
+    if (DGifSlurp(GifFile) == GIF_ERROR) {
+	PrintGifError(GifFile->Error);
+	exit(EXIT_FAILURE);
+    }
+    if (GifFile->SColorMap != NULL)
+	ColorMap = GifFile->SColorMap;
+    else if (GifFile->ImageCount > 0)
+	ColorMap = GifFile->SavedImages[0].ImageDesc.ColorMap;
+    if (ColorMap == NULL)
+	GIF_EXIT("Color map file has no color map.");
+    if ((ColorMap = GifMakeMapObject(ColorMap->ColorCount,
+				     ColorMap->Colors)) == NULL)
+	GIF_EXIT("Failed to allocate memory required, aborted.");
+    (void)DGifCloseFile(GifFile, &Error);
+
+    return ColorMap;
+}
+
 /******************************************************************************
  Close output file (if open), and exit.
 ******************************************************************************/
 static void RGB2GIF(bool OneFileFlag, int NumFiles, char *FileName,
-		    int ExpNumOfColors, int Width, int Height)
+		    int Format, int ExpNumOfColors,
+		    const GifQuantizeOptions *QuantizeOptions,
+		    char *MapFileName, int Width, int Height)
 {
-    int ColorMapSize;
+    int i, ColorMapSize, Error, TransparentIndex = NO_TRANSPARENT_COLOR;
 
-    GifByteType *RedBuffer = NULL, *GreenBuffer = NULL, *BlueBuffer = NULL,
-	*OutputBuffer = NULL;
+    GifByteType *Buffers[3], *OutputBuffer = NULL;
     ColorMapObject *OutputColorMap = NULL;
 
     ColorMapSize = 1 << ExpNumOfColors;
 
     if (NumFiles == 1) {
-	LoadRGB(FileName, OneFileFlag,
-		&RedBuffer, &GreenBuffer, &BlueBuffer, Width, Height);
+	LoadRGB(FileName, OneFileFlag, PIXEL_SIZE(Format), Buffers,
+		Width, Height);
     }
     else {
-	LoadRGB(NULL, OneFileFlag,
-		&RedBuffer, &GreenBuffer, &BlueBuffer, Width, Height);
+	LoadRGB(NULL, OneFileFlag, PIXEL_SIZE(Format), Buffers,
+		Width, Height);
     }
 
-    if ((OutputColorMap = GifMakeMapObject(ColorMapSize, NULL)) == NULL ||
+    if (MapFileName == NULL && Buffers[1] == NULL
+	&& Format != GIF_PIXELS_RGB24) {
+	SaveQuantizedGif(Buffers[0], Format, Width, Height, ExpNumOfColors,
+			 QuantizeOptions);
+	free((char *) Buffers[0]);
+	return;
+    }
+
+    if (MapFileName != NULL) {
+	OutputColorMap = LoadColorMap(MapFileName);
+	ExpNumOfColors = OutputColorMap->BitsPerPixel;
+    } else
+	OutputColorMap = GifMakeMapObject(ColorMapSize, NULL);
+    if (OutputColorMap == NULL ||
 	(OutputBuffer = (GifByteType *) malloc(Width * Height *
 					    sizeof(GifByteType))) == NULL)
 	GIF_EXIT("Failed to allocate memory required, aborted.");
 
-    if (GifQuantizeBuffer(Width, Height, &ColorMapSize,
-		       RedBuffer, GreenBuffer, BlueBuffer,
-		       OutputBuffer, OutputColorMap->Colors) == GIF_ERROR)
+    if (MapFileName != NULL) {
+	/* Just find the nearest color of the given map for each pixel: */
+	GifPaletteMapType *PaletteMap = GifMakePaletteMap(OutputColorMap);
+
+	if (PaletteMap == NULL)
+	    GIF_EXIT("Failed to allocate memory required, aborted.");
+	if (Buffers[1] == NULL)
+	    Error = GifDitherPalettePixels(PaletteMap, QuantizeOptions->Dither,
+					   Width, Height,
+					   Buffers[0], Format,
+					   (size_t)Width * PIXEL_SIZE(Format),
+					   0, 0, OutputBuffer);
+	else
+	    Error = GifDitherPaletteBuffer(PaletteMap, QuantizeOptions->Dither,
+					   Width, Height,
+					   Buffers[0], Buffers[1], Buffers[2],
+					   OutputBuffer);
+	if (Error == GIF_ERROR)
+	    GIF_EXIT("Failed to allocate memory required, aborted.");
+	GifFreePaletteMap(PaletteMap);
+    } else {
+	/* A single file of pixels is quantized as it was read. */
+	if (Buffers[1] == NULL)
+	    Error = GifQuantizePixels(Width, Height, &ColorMapSize,
+				      Buffers[0], Format,
+				      (size_t)Width * PIXEL_SIZE(Format),
+				      OutputBuffer, OutputColorMap->Colors,
+				      &TransparentIndex, QuantizeOptions);
+	else
+	    Error = GifQuantizeBufferWithOptions(Width, Height, &ColorMapSize,
+			   Buffers[0], Buffers[1], Buffers[2],
+			   OutputBuffer, OutputColorMap->Colors,
+			   QuantizeOptions);
+	if (Error == GIF_ERROR)
+	    exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < 3; i++)
+	free((char *) Buffers[i]);
+
+    SaveGif(OutputBuffer, Width, Height, ExpNumOfColors, OutputColorMap,
+	    TransparentIndex);
+}
+
+/******************************************************************************
+ Read the next Width by Height frame of pixels PixelSize bytes each, and
+ keep a copy of it in Spool if that is not NULL.
+******************************************************************************/
+static void ReadFrame(FILE *RGBFile, FILE *Spool, GifByteType *Buffer,
+		      int Width, int Height, int PixelSize)
+{
+    size_t Size = (size_t)Width * Height * PixelSize;
+
+    if (fread(Buffer, Size, 1, RGBFile) != 1)
+	GIF_EXIT("Input file(s) terminated prematurly.");
+    if (Spool != NULL && fwrite(Buffer, Size, 1, Spool) != 1)
+	GIF_EXIT("Can't write temporary file.");
+}
+
+/* Where ReadRow() gets rows of pixels from. */
+typedef struct RowInputType {
+    FILE *File;
+    FILE *Spool;		/* Copy of what is read, if not NULL */
+    int Width, PixelSize;
+} RowInputType;
+
+/******************************************************************************
+ Read the next row of pixels for the quantizer, as ReadFrame() does
+ frames.
+******************************************************************************/
+static int ReadRow(void *UserData, unsigned int Row, GifByteType *Pixels)
+{
+    RowInputType *Input = (RowInputType *)UserData;
+
+    (void)Row;
+    ReadFrame(Input->File, Input->Spool, Pixels, Input->Width, 1,
+	      Input->PixelSize);
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Convert Frames frames of RGB triplets, one after another in a single file
+ (or standard input), into the images of an animation sharing a global
+ color map.  The input is read twice, a few rows at a time: once to choose
+ the colors, and once to map each frame onto them and write it out, so
+ however big the frames only a band of rows is ever in memory (a whole
+ frame, when mapping to a given color map).  Standard input is copied to
+ a temporary file the first time through to be read again.
+******************************************************************************/
+static void RGBFrames2GIF(char *FileName, int Frames, int Format,
+			  int ExpNumOfColors,
+			  const GifQuantizeOptions *QuantizeOptions,
+			  char *MapFileName, int Width, int Height)
+{
+    int i, Error, TransparentIndex = NO_TRANSPARENT_COLOR;
+    FILE *RGBFile, *Spool = NULL;
+    GifByteType *Buffer = NULL, *OutputBuffer = NULL;
+    RowInputType Input;
+    GifPaletteBuilderType *Builder = NULL;
+    GifPaletteMapType *PaletteMap = NULL;
+    ColorMapObject *OutputColorMap;
+    GifFileType *GifFile;
+
+    if (FileName != NULL) {
+	if ((RGBFile = fopen(FileName, "rb")) == NULL)
+	    GIF_EXIT("Can't open input file name.");
+    } else {
+#ifdef _WIN32
+	_setmode(0, O_BINARY);
+#endif /* _WIN32 */
+	RGBFile = stdin;
+	if (MapFileName == NULL && (Spool = tmpfile()) == NULL)
+	    GIF_EXIT("Can't open temporary file.");
+    }
+    Input.File = RGBFile;
+    Input.Spool = Spool;
+    Input.Width = Width;
+    Input.PixelSize = PIXEL_SIZE(Format);
+
+    if (MapFileName != NULL) {
+	if ((Buffer = (GifByteType *) malloc((size_t)Width * Height *
+					     PIXEL_SIZE(Format))) == NULL ||
+	    (OutputBuffer = (GifByteType *) malloc((size_t)Width * Height)) == NULL)
+	    GIF_EXIT("Failed to allocate memory required, aborted.");
+	OutputColorMap = LoadColorMap(MapFileName);
+	if ((PaletteMap = GifMakePaletteMap(OutputColorMap)) == NULL)
+	    GIF_EXIT("Failed to allocate memory required, aborted.");
+    } else {
+	if ((Builder = GifMakePaletteBuilder(QuantizeOptions)) == NULL)
+	    GIF_EXIT("Failed to allocate memory required, aborted.");
+	GifQprintf("\n%s: Sampling frame:     ", PROGRAM_NAME);
+	for (i = 0; i < Frames; i++) {
+	    GifQprintf("\b\b\b\b%-4d", i);
+	    if (GifSamplePaletteRows(Builder, Width, Height, Format,
+				     ReadRow, &Input) == GIF_ERROR)
+		GIF_EXIT("Failed to allocate memory required, aborted.");
+	}
+	OutputColorMap = GifBuildPaletteColorMap(Builder, 1 << ExpNumOfColors,
+						 &TransparentIndex);
+	if (OutputColorMap == NULL)
+	    GIF_EXIT("Failed to allocate memory required, aborted.");
+	if (Spool != NULL) {
+	    if (RGBFile != stdin)
+		fclose(RGBFile);
+	    RGBFile = Spool;
+	}
+	rewind(RGBFile);
+	Input.File = RGBFile;
+	Input.Spool = NULL;
+    }
+
+    if ((GifFile = EGifOpenFileHandle(1, &Error)) == NULL) {
+	PrintGifError(Error);
+	exit(EXIT_FAILURE);
+    }
+    if (EGifPutScreenDesc(GifFile, Width, Height,
+			  OutputColorMap->BitsPerPixel, 0,
+			  OutputColorMap) == GIF_ERROR) {
+	PrintGifError(GifFile->Error);
+	exit(EXIT_FAILURE);
+    }
+    GifQprintf("\n%s: Mapping frame:     ", PROGRAM_NAME);
+    for (i = 0; i < Frames; i++) {
+	GifQprintf("\b\b\b\b%-4d", i);
+	PutTransparency(GifFile, TransparentIndex);
+	if (EGifPutImageDesc(GifFile, 0, 0, Width, Height,
+			     false, NULL) == GIF_ERROR) {
+	    PrintGifError(GifFile->Error);
+	    exit(EXIT_FAILURE);
+	}
+	if (Builder != NULL) {
+	    /* Rows go straight from the input to the output: */
+	    if (GifPutQuantizedRows(Builder, GifFile, Width, Height, Format,
+				    ReadRow, &Input) == GIF_ERROR) {
+		PrintGifError(GifFile->Error);
+		exit(EXIT_FAILURE);
+	    }
+	    continue;
+	}
+	ReadFrame(RGBFile, NULL, Buffer, Width, Height, PIXEL_SIZE(Format));
+	if (GifDitherPalettePixels(PaletteMap, QuantizeOptions->Dither,
+				   Width, Height, Buffer, Format,
+				   (size_t)Width * PIXEL_SIZE(Format), 0, 0,
+				   OutputBuffer) == GIF_ERROR)
+	    GIF_EXIT("Failed to allocate memory required, aborted.");
+	if (EGifPutLine(GifFile, OutputBuffer, Width * Height) == GIF_ERROR) {
+	    PrintGifError(GifFile->Error);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    if (EGifCloseFile(GifFile, &Error) == GIF_ERROR) {
+	PrintGifError(Error);
+	exit(EXIT_FAILURE);
+    }
+
+    if (RGBFile != stdin)
+	fclose(RGBFile);
+    GifFreePaletteBuilder(Builder);
+    GifFreePaletteMap(PaletteMap);
+    GifFreeMapObject(OutputColorMap);
+    free((char *) Buffer);
+    free((char *) OutputBuffer);
+}
+
+/******************************************************************************
+ Convert Frames frames of RGB triplets, like RGBFrames2GIF(), but in one
+ pass: each frame is mapped onto the colors chosen for an earlier one as
+ long as they fit it to within MaxDrift levels, and only otherwise are
+ new colors chosen.  The first frame's colors are the global color map,
+ and frames drawn with them have none of their own; any chosen later are
+ written as the local color map of each frame drawn with them.
+******************************************************************************/
+static void RGBDriftFrames2GIF(char *FileName, int Frames, int Format,
+			       int ExpNumOfColors,
+			       const GifQuantizeOptions *QuantizeOptions,
+			       int MaxDrift, int Width, int Height)
+{
+    int i, Error, LocalFrames = 0, TransparentIndex;
+    bool Local;
+    FILE *RGBFile;
+    GifByteType *Buffer, *OutputBuffer;
+    GifFrameQuantizerType *Quantizer;
+    const ColorMapObject *ColorMap;
+    GifFileType *GifFile = NULL;
+
+    if (FileName != NULL) {
+	if ((RGBFile = fopen(FileName, "rb")) == NULL)
+	    GIF_EXIT("Can't open input file name.");
+    } else {
+#ifdef _WIN32
+	_setmode(0, O_BINARY);
+#endif /* _WIN32 */
+	RGBFile = stdin;
+    }
+    if ((Buffer = (GifByteType *) malloc((size_t)Width * Height *
+					 PIXEL_SIZE(Format))) == NULL ||
+	(OutputBuffer = (GifByteType *) malloc((size_t)Width * Height)) == NULL ||
+	(Quantizer = GifMakeFrameQuantizer(QuantizeOptions,
+					   1 << ExpNumOfColors,
+					   MaxDrift)) == NULL)
+	GIF_EXIT("Failed to allocate memory required, aborted.");
+
+    GifQprintf("\n%s: Quantizing frame:     ", PROGRAM_NAME);
+    for (i = 0; i < Frames; i++) {
+	GifQprintf("\b\b\b\b%-4d", i);
+	ReadFrame(RGBFile, NULL, Buffer, Width, Height, PIXEL_SIZE(Format));
+	if (GifQuantizeNextFramePixels(Quantizer, Width, Height,
+				       Buffer, Format,
+				       (size_t)Width * PIXEL_SIZE(Format),
+				       OutputBuffer, &ColorMap, &Local,
+				       &TransparentIndex) == GIF_ERROR)
+	    GIF_EXIT("Failed to allocate memory required, aborted.");
+
+	/* The first frame's colors are the global color map: */
+	if (GifFile == NULL) {
+	    if ((GifFile = EGifOpenFileHandle(1, &Error)) == NULL) {
+		PrintGifError(Error);
+		exit(EXIT_FAILURE);
+	    }
+	    if (EGifPutScreenDesc(GifFile, Width, Height,
+				  ColorMap->BitsPerPixel, 0,
+				  ColorMap) == GIF_ERROR) {
+		PrintGifError(GifFile->Error);
+		exit(EXIT_FAILURE);
+	    }
+	}
+	/* ...and any later ones local, to every frame drawn with them: */
+	if (Local)
+	    LocalFrames++;
+	PutTransparency(GifFile, TransparentIndex);
+	if (EGifPutImageDesc(GifFile, 0, 0, Width, Height,
+			     false, Local ? ColorMap : NULL) == GIF_ERROR ||
+	    EGifPutLine(GifFile, OutputBuffer, Width * Height) == GIF_ERROR) {
+	    PrintGifError(GifFile->Error);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    GifQprintf("\n%s: %d frames with a local color map.",
+	       PROGRAM_NAME, LocalFrames);
+    if (EGifCloseFile(GifFile, &Error) == GIF_ERROR) {
+	PrintGifError(Error);
 	exit(EXIT_FAILURE);
-    free((char *) RedBuffer);
-    free((char *) GreenBuffer);
-    free((char *) BlueBuffer);
+    }
 
-    SaveGif(OutputBuffer, Width, Height, ExpNumOfColors, OutputColorMap);
+    if (RGBFile != stdin)
+	fclose(RGBFile);
+    GifFreeFrameQuantizer(Quantizer);
+    free((char *) Buffer);
+    free((char *) OutputBuffer);
 }
 
 /******************************************************************************
@@ -499,16 +881,27 @@ static void GIF2RGB(int NumFiles, char *FileName,
 int main(int argc, char **argv)
 {
     bool Error, OutFileFlag = false, ColorFlag = false, SizeFlag = false;
+    bool PrecisionFlag = false, DitherFlag = false, MapFlag = false;
+    bool ThreadsFlag = false, FramesFlag = false, DriftFlag = false;
+    bool AlphaFlag = false;
     int NumFiles, Width = 0, Height = 0, ExpNumOfColors = 8;
-    char *OutFileName,
+    int BitsPerPrimary = 0, Threads = 1, Frames = 1, MaxDrift = 0;
+    int Format;
+    char *OutFileName, *MapFileName = NULL, *DitherName = NULL,
 	**FileName = NULL;
+    GifQuantizeOptions QuantizeOptions;
     static bool
 	OneFileFlag = false,
 	HelpFlag = false;
 
     if ((Error = GAGetArgs(argc, argv, CtrlStr, &GifNoisyPrint,
-		&ColorFlag, &ExpNumOfColors, &SizeFlag, &Width, &Height, 
-		&OneFileFlag, &OutFileFlag, &OutFileName,
+		&ColorFlag, &ExpNumOfColors,
+		&PrecisionFlag, &BitsPerPrimary, &DitherFlag, &DitherName,
+		&ThreadsFlag, &Threads,
+		&MapFlag, &MapFileName, &FramesFlag, &Frames,
+		&DriftFlag, &MaxDrift,
+		&SizeFlag, &Width, &Height, 
+		&OneFileFlag, &AlphaFlag, &OutFileFlag, &OutFileName,
 		&HelpFlag, &NumFiles, &FileName)) != false ||
 		(NumFiles > 1 && !HelpFlag)) {
 	if (Error)
@@ -525,10 +918,46 @@ int main(int argc, char **argv)
 	exit(EXIT_SUCCESS);
     }
     if (!OutFileFlag) OutFileName = NULL;
+    if (!MapFlag) MapFileName = NULL;
+
+    GifDefaultQuantizeOptions(&QuantizeOptions);
+    if (PrecisionFlag)
+	QuantizeOptions.BitsPerPrimary = BitsPerPrimary;
+    if (ThreadsFlag)
+	QuantizeOptions.Threads = Threads;
+    if (!DitherFlag || strcmp(DitherName, "none") == 0)
+	QuantizeOptions.Dither = GIF_DITHER_NONE;
+    else if (strcmp(DitherName, "floyd-steinberg") == 0)
+	QuantizeOptions.Dither = GIF_DITHER_FLOYD_STEINBERG;
+    else if (strcmp(DitherName, "bayer") == 0)
+	QuantizeOptions.Dither = GIF_DITHER_BAYER;
+    else if (strcmp(DitherName, "blue-noise") == 0)
+	QuantizeOptions.Dither = GIF_DITHER_BLUE_NOISE;
+    else {
+	GIF_MESSAGE("Dither must be none, floyd-steinberg, bayer or blue-noise.");
+	exit(EXIT_FAILURE);
+    }
 
-    if (SizeFlag && Width > 0 && Height > 0)
+    Format = AlphaFlag ? GIF_PIXELS_RGBA32 : GIF_PIXELS_RGB24;
+    if (AlphaFlag && NumFiles == 1 && !OneFileFlag)
+	GIF_EXIT("-a needs the pixels in one file (-1).");
+
+    if (FramesFlag && Frames > 0) {
+	if (!(SizeFlag && Width > 0 && Height > 0))
+	    GIF_EXIT("-f needs the size of the frames (-s).");
+	if (NumFiles == 1 && !OneFileFlag)
+	    GIF_EXIT("-f needs the frames in one file (-1).");
+	if (DriftFlag && MapFileName == NULL)
+	    RGBDriftFrames2GIF(NumFiles == 1 ? *FileName : NULL, Frames,
+			       Format, ExpNumOfColors, &QuantizeOptions, MaxDrift,
+			       Width, Height);
+	else
+	    RGBFrames2GIF(NumFiles == 1 ? *FileName : NULL, Frames,
+			  Format, ExpNumOfColors, &QuantizeOptions, MapFileName,
+			  Width, Height);
+    } else if (SizeFlag && Width > 0 && Height > 0)
 	RGB2GIF(OneFileFlag, NumFiles, *FileName, 
-		ExpNumOfColors, Width, Height);
+		Format, ExpNumOfColors, &QuantizeOptions, MapFileName, Width, Height);
     else
 	GIF2RGB(NumFiles, *FileName, OneFileFlag, OutFileName);
 
@@ -50,6 +50,12 @@ GifErrorString(int ErrorCode)
       case E_GIF_ERR_NOT_WRITEABLE:
         Err = "Given file was not opened for write";
         break;
+      case E_GIF_ERR_BUFFER_FULL:
+        Err = "Output does not fit in the given buffer";
+        break;
+      case E_GIF_ERR_BAD_IMAGE_DATA:
+        Err = "Compressed image data is malformed";
+        break;
       case D_GIF_ERR_OPEN_FAILED:
         Err = "Failed to open given file";
         break;
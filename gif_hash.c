@@ -9,6 +9,11 @@ gif_hash.c -- module to support the following operations:
 
 This module is used to hash the GIF codes during encoding.
 
+It also provides the direct-indexed code table the encoder actually uses:
+_InitCodeTable, _ResetCodeTable, _ClearCodeTable, _AppendRunCodeTable and
+_FreeCodeTable here, with the per-pixel lookup and insert inlined from
+gif_hash.h.
+
 SPDX-License-Identifier: MIT
 
 *****************************************************************************/
@@ -117,6 +122,113 @@ static int KeyItem(uint32_t Item)
     return ((Item >> 12) ^ Item) & HT_KEY_MASK;
 }
 
+/******************************************************************************
+ Allocate an empty code table.  The slots are sized on the first reset,
+ when the code size of the image is known.
+******************************************************************************/
+GifCodeTableType *_InitCodeTable(void)
+{
+    GifCodeTableType *CodeTable;
+
+    if ((CodeTable = (GifCodeTableType *) malloc(sizeof(GifCodeTableType)))
+	== NULL)
+	return NULL;
+
+    CodeTable->BitsPerPixel = 0;
+    CodeTable->AllocSlots = 0;
+    CodeTable->Generation = 0;
+    CodeTable->Slots = NULL;
+    memset(CodeTable->Runs, '\0', sizeof(CodeTable->Runs));
+    memset(CodeTable->RunCount, '\0', sizeof(CodeTable->RunCount));
+    memset(CodeTable->RunAlloc, '\0', sizeof(CodeTable->RunAlloc));
+
+    return CodeTable;
+}
+
+/******************************************************************************
+ Prepare the code table for an image whose pixels have BitsPerPixel bits
+ and whose codes stay below 1 << CodeBits.  The slot array is only
+ reallocated when it has to grow, so a stream of images with the same
+ color map depth reuses it; either way the table comes back empty.
+ Returns GIF_ERROR if memory is exhausted.
+******************************************************************************/
+int _ResetCodeTable(GifCodeTableType *CodeTable, int BitsPerPixel,
+		    int CodeBits)
+{
+    size_t Slots = ((size_t)1 << CodeBits) << BitsPerPixel;
+
+    if (Slots > CodeTable->AllocSlots) {
+	free(CodeTable->Slots);
+	/* calloc() gives generation 0 everywhere, which is never live. */
+	CodeTable->Slots = (uint32_t *)calloc(Slots, sizeof(uint32_t));
+	if (CodeTable->Slots == NULL) {
+	    CodeTable->AllocSlots = 0;
+	    return GIF_ERROR;
+	}
+	CodeTable->AllocSlots = Slots;
+	CodeTable->Generation = 0;
+    }
+    CodeTable->BitsPerPixel = BitsPerPixel;
+    _ClearCodeTable(CodeTable);
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Routine to clear the code table to an empty state.  Normally this just
+ retires the current generation, and forgets the runs; the slots are only
+ wiped when the generation tag is about to wrap around.
+******************************************************************************/
+void _ClearCodeTable(GifCodeTableType *CodeTable)
+{
+    if (++CodeTable->Generation > CT_MAX_GENERATION) {
+	memset(CodeTable->Slots, '\0',
+	       CodeTable->AllocSlots * sizeof(uint32_t));
+	CodeTable->Generation = 1;
+    }
+    memset(CodeTable->RunCount, '\0', sizeof(CodeTable->RunCount));
+}
+
+/******************************************************************************
+ Note Code as the next longer run of Pixel.  If there is no memory for it,
+ runs of Pixel stop being tracked until the next clear, which only costs
+ speed.
+******************************************************************************/
+void _AppendRunCodeTable(GifCodeTableType *CodeTable, int Pixel, int Code)
+{
+    int Count = CodeTable->RunCount[Pixel];
+
+    if (Count >= CodeTable->RunAlloc[Pixel]) {
+	int Alloc = Count > 0 ? 2 * Count : 64;
+	uint16_t *Runs = (uint16_t *)realloc(CodeTable->Runs[Pixel],
+					     Alloc * sizeof(uint16_t));
+
+	if (Runs == NULL) {
+	    CodeTable->RunCount[Pixel] = -1;
+	    return;
+	}
+	CodeTable->Runs[Pixel] = Runs;
+	CodeTable->RunAlloc[Pixel] = Alloc;
+    }
+    CodeTable->Runs[Pixel][Count] = (uint16_t)Code;
+    CodeTable->RunCount[Pixel] = Count + 1;
+}
+
+/******************************************************************************
+ Release a code table and its slots.
+******************************************************************************/
+void _FreeCodeTable(GifCodeTableType *CodeTable)
+{
+    int i;
+
+    if (CodeTable != NULL) {
+	free(CodeTable->Slots);
+	for (i = 0; i < CT_MAX_PIXELS; i++)
+	    free(CodeTable->Runs[i]);
+	free(CodeTable);
+    }
+}
+
 #ifdef	DEBUG_HIT_RATE
 /******************************************************************************
  Debugging routine to print the hit ratio - number of times the hash table   *
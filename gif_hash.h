@@ -36,6 +36,77 @@ void _ClearHashTable(GifHashTableType *HashTable);
 void _InsertHashTable(GifHashTableType *HashTable, uint32_t Key, int Code);
 int _ExistsHashTable(GifHashTableType *HashTable, uint32_t Key);
 
+/* The direct-indexed code table used by the encoder has one slot for every */
+/* (prefix code, pixel) pair, so a lookup touches exactly one word.  Each    */
+/* slot holds a 20 bit generation tag above the 12 bit code; slots whose tag */
+/* is not the current generation are empty, so a clear is just an increment. */
+#define CT_CODE_BITS		12
+#define CT_CODE_MASK		0x0FFF
+#define CT_MAX_GENERATION	0xFFFFF	/* 20 bits of generation tag */
+#define CT_MAX_PIXELS		256	/* Pixel values are at most 8 bits */
+#define CT_GET_GEN(s)	((s) >> CT_CODE_BITS)
+#define CT_GET_CODE(s)	((s) & CT_CODE_MASK)
+#define CT_PUT_SLOT(g, c)	(((g) << CT_CODE_BITS) | ((c) & CT_CODE_MASK))
+
+typedef struct GifCodeTableType {
+    int BitsPerPixel;		/* log2 of the number of children per code */
+    size_t AllocSlots;		/* How many Slots there are */
+    uint32_t Generation;	/* Tag of the live entries */
+    uint32_t *Slots;		/* (1 << code bits) << BitsPerPixel, or more */
+    /* Strings of one pixel value repeated, so runs can skip the lookups.  */
+    uint16_t RunDepth[HT_MAX_CODE + 1];	/* Repeats a code stands for, or 0 */
+    uint16_t *Runs[CT_MAX_PIXELS];	/* Runs[P][n - 2]: code for n P's */
+    int RunCount[CT_MAX_PIXELS];	/* Live entries, -1 if not kept up */
+    int RunAlloc[CT_MAX_PIXELS];
+} GifCodeTableType;
+
+GifCodeTableType *_InitCodeTable(void);
+int _ResetCodeTable(GifCodeTableType *CodeTable, int BitsPerPixel,
+		    int CodeBits);
+void _ClearCodeTable(GifCodeTableType *CodeTable);
+void _FreeCodeTable(GifCodeTableType *CodeTable);
+void _AppendRunCodeTable(GifCodeTableType *CodeTable, int Pixel, int Code);
+
+/* Return the code for Prefix followed by Pixel, or -1 if there is none. */
+static inline int _LookupCodeTable(const GifCodeTableType *CodeTable,
+				   int Prefix, int Pixel)
+{
+    uint32_t Slot = CodeTable->Slots[((uint32_t)Prefix
+				      << CodeTable->BitsPerPixel) | Pixel];
+
+    return CT_GET_GEN(Slot) == CodeTable->Generation ? (int)CT_GET_CODE(Slot)
+						     : -1;
+}
+
+/* If Code is the string of n copies of Pixel, return n, else 0.  Also 0  */
+/* when the runs of Pixel aren't being kept track of.			    */
+static inline int _RunDepthCodeTable(const GifCodeTableType *CodeTable,
+				     int Code, int Pixel)
+{
+    int Depth;
+
+    if (CodeTable->RunCount[Pixel] < 0)
+	return 0;
+    if (Code < (1 << CodeTable->BitsPerPixel))
+	return Code == Pixel;
+    Depth = CodeTable->RunDepth[Code];
+    return (Depth >= 2 && Depth - 2 < CodeTable->RunCount[Pixel]
+	    && CodeTable->Runs[Pixel][Depth - 2] == Code) ? Depth : 0;
+}
+
+/* Record Code as the string Prefix followed by Pixel. */
+static inline void _InsertCodeTable(GifCodeTableType *CodeTable,
+				    int Prefix, int Pixel, int Code)
+{
+    int Depth = _RunDepthCodeTable(CodeTable, Prefix, Pixel);
+
+    CodeTable->Slots[((uint32_t)Prefix << CodeTable->BitsPerPixel) | Pixel] =
+	CT_PUT_SLOT(CodeTable->Generation, (uint32_t)Code);
+    CodeTable->RunDepth[Code] = Depth ? Depth + 1 : 0;
+    if (Depth && Depth - 1 == CodeTable->RunCount[Pixel])
+	_AppendRunCodeTable(CodeTable, Pixel, Code);
+}
+
 #endif /* _GIF_HASH_H_ */
 
 /* end */
@@ -68,6 +68,11 @@ typedef struct SavedImage {
     GifByteType *RasterBits;         /* on malloc(3) heap */
     int ExtensionBlockCount;         /* Count of extensions before image */    
     ExtensionBlock *ExtensionBlocks; /* Extensions before image */    
+    GifByteType *CompressedBits;     /* LZW data as read, or NULL; on heap */
+    size_t CompressedLength;
+    GifByteType *CompressedRaster;   /* RasterBits as read, to check; on heap */
+    size_t CompressedPixels;         /* ...and how many there were */
+    bool CompressedInterlace;        /* ImageDesc.Interlace when read */
 } SavedImage;
 
 typedef struct GifFileType {
@@ -124,14 +129,36 @@ typedef struct GraphicsControlBlock {
  GIF encoding routines
 ******************************************************************************/
 
+/* LZW code table clear policies, for GifEncoderOptions.ClearPolicy */
+#define GIF_CLEAR_WHEN_FULL       0       /* At once, as always */
+#define GIF_CLEAR_DEFERRED        1       /* Never; keep coding with it */
+#define GIF_CLEAR_ADAPTIVE        2       /* Once compression falls off */
+
+/* Encoder tuning; start from EGifDefaultEncoderOptions() */
+typedef struct GifEncoderOptions {
+    int ClearPolicy;         /* When to empty a full LZW code table */
+    int StripHeight;         /* EGifSpewParallel() strip rows, 0 for none */
+    int MaxCodeBits;         /* Clear before codes get wider; 12 for none */
+    bool TrimColorMaps;      /* EGifSpew() drops unused colors from maps */
+    int LossyError;          /* Color error allowed in strings, 0 for none */
+    bool LossyDiffuse;       /* Carry that error on past the string */
+} GifEncoderOptions;
+
 /* Main entry points */
 GifFileType *EGifOpenFileName(const char *GifFileName,
                               const bool GifTestExistence, int *Error);
 GifFileType *EGifOpenFileHandle(const int GifFileHandle, int *Error);
 GifFileType *EGifOpen(void *userPtr, OutputFunc writeFunc, int *Error);
+GifFileType *EGifOpenMemory(GifByteType **Buffer, size_t *Size, int *Error);
 int EGifSpew(GifFileType * GifFile);
+int EGifSpewParallel(GifFileType * GifFile, int Threads);
+int EGifSetStripHeight(GifFileType *GifFile, int StripHeight);
 const char *EGifGetGifVersion(GifFileType *GifFile); /* new in 5.x */
 int EGifCloseFile(GifFileType *GifFile, int *ErrorCode);
+int EGifSetWriteBufferSize(GifFileType *GifFile, size_t BufferSize);
+void EGifDefaultEncoderOptions(GifEncoderOptions *Options);
+int EGifSetEncoderOptions(GifFileType *GifFile,
+                          const GifEncoderOptions *Options);
 
 #define E_GIF_SUCCEEDED          0
 #define E_GIF_ERR_OPEN_FAILED    1    /* And EGif possible errors. */
@@ -144,6 +171,8 @@ int EGifCloseFile(GifFileType *GifFile, int *ErrorCode);
 #define E_GIF_ERR_DISK_IS_FULL   8
 #define E_GIF_ERR_CLOSE_FAILED   9
 #define E_GIF_ERR_NOT_WRITEABLE  10
+#define E_GIF_ERR_BUFFER_FULL    11
+#define E_GIF_ERR_BAD_IMAGE_DATA 12
 
 /* These are legacy.  You probably do not want to call them directly */
 int EGifPutScreenDesc(GifFileType *GifFile,
@@ -172,6 +201,9 @@ int EGifPutCode(GifFileType *GifFile, int GifCodeSize,
                 const GifByteType *GifCodeBlock);
 int EGifPutCodeNext(GifFileType *GifFile,
                     const GifByteType *GifCodeBlock);
+int EGifPutCompressedImage(GifFileType *GifFile,
+                           const GifImageDesc *GifImageDesc,
+                           const GifByteType *GifData, size_t GifDataLen);
 
 /******************************************************************************
  GIF decoding routines
@@ -181,6 +213,7 @@ int EGifPutCodeNext(GifFileType *GifFile,
 GifFileType *DGifOpenFileName(const char *GifFileName, int *Error);
 GifFileType *DGifOpenFileHandle(int GifFileHandle, int *Error);
 int DGifSlurp(GifFileType * GifFile);
+int DGifSetKeepCompressed(GifFileType *GifFile, const bool Keep);
 GifFileType *DGifOpen(void *userPtr, InputFunc readFunc, int *Error);    /* new one (TVT) */
     int DGifCloseFile(GifFileType * GifFile, int *ErrorCode);
 
@@ -212,6 +245,8 @@ int DGifGetExtensionNext(GifFileType *GifFile, GifByteType **GifExtension);
 int DGifGetCode(GifFileType *GifFile, int *GifCodeSize,
                 GifByteType **GifCodeBlock);
 int DGifGetCodeNext(GifFileType *GifFile, GifByteType **GifCodeBlock);
+int DGifGetCompressedImage(GifFileType *GifFile, GifByteType **GifData,
+                           size_t *GifDataLen);
 int DGifGetLZCodes(GifFileType *GifFile, int *GifCode);
 const char *DGifGetGifVersion(GifFileType *GifFile);
 
@@ -238,6 +273,42 @@ extern ColorMapObject *GifUnionColorMap(const ColorMapObject *ColorIn1,
                                      GifPixelType ColorTransIn2[]);
 extern int GifBitSize(int n);
 
+/******************************************************************************
+ Mapping true color onto a color map, from gif_palette.c
+******************************************************************************/
+
+typedef struct GifPaletteMapType GifPaletteMapType;
+
+extern GifPaletteMapType *GifMakePaletteMap(const ColorMapObject *ColorMap);
+extern void GifFreePaletteMap(GifPaletteMapType *Map);
+extern int GifMapPaletteColor(const GifPaletteMapType *Map,
+                              int Red, int Green, int Blue);
+extern void GifMapPaletteBuffer(const GifPaletteMapType *Map,
+                                unsigned long Pixels,
+                                const GifByteType *RedInput,
+                                const GifByteType *GreenInput,
+                                const GifByteType *BlueInput,
+                                GifByteType *OutputBuffer);
+#define GIF_DITHER_NONE            0    /* Nearest color only */
+#define GIF_DITHER_FLOYD_STEINBERG 1    /* Error diffusion, serpentine */
+#define GIF_DITHER_BAYER           2    /* Ordered, 8x8 Bayer matrix */
+#define GIF_DITHER_BLUE_NOISE      3    /* Ordered, blue-noise map */
+extern int GifDitherPaletteBuffer(const GifPaletteMapType *Map, int Dither,
+                                  unsigned int Width, unsigned int Height,
+                                  const GifByteType *RedInput,
+                                  const GifByteType *GreenInput,
+                                  const GifByteType *BlueInput,
+                                  GifByteType *OutputBuffer);
+#define GIF_PIXELS_RGB24           0    /* Red, green, blue */
+#define GIF_PIXELS_RGBA32          1    /* Red, green, blue, alpha */
+#define GIF_PIXELS_BGRA32          2    /* Blue, green, red, alpha */
+extern int GifDitherPalettePixels(const GifPaletteMapType *Map, int Dither,
+                                  unsigned int Width, unsigned int Height,
+                                  const GifByteType *Pixels, int Format,
+                                  size_t Stride, int AlphaThreshold,
+                                  int TransparentIndex,
+                                  GifByteType *OutputBuffer);
+
 /******************************************************************************
  Support for the in-core structures allocation (slurp mode).              
 ******************************************************************************/
@@ -270,6 +341,12 @@ int EGifGCBToSavedExtension(const GraphicsControlBlock *GCB,
 			    GifFileType *GifFile, 
 			    int ImageIndex);
 
+/******************************************************************************
+ Animation optimization from gif_optimize.c
+******************************************************************************/
+
+extern int GifOptimizeAnimation(GifFileType *GifFile);
+
 /******************************************************************************
  The library's internal utility font                          
 ******************************************************************************/
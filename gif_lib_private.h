@@ -35,6 +35,25 @@ SPDX-License-Identifier: MIT
 #define IS_READABLE(Private)    (Private->FileState & FILE_STATE_READ)
 #define IS_WRITEABLE(Private)   (Private->FileState & FILE_STATE_WRITE)
 
+/* Where EGifOpenMemory() output goes. */
+typedef struct GifMemoryOutputType {
+    GifByteType **BufferOut;    /* Caller's pointer, set on close */
+    size_t *SizeOut;            /* Caller's size, set on close */
+    GifByteType *Data;
+    size_t Len, Capacity;
+    bool Fixed;                 /* Data belongs to the caller and can't grow */
+    bool Overflow;              /* A write didn't fit in a fixed buffer */
+} GifMemoryOutputType;
+
+/* What the lossy encoder needs to know about the image being coded. */
+typedef struct GifLossyType {
+    int Limit;                    /* Largest weighted squared color error */
+    int Colors[256][3];           /* The image's color map */
+    GifByteType Near[256][256];   /* Colors that may stand in for each one */
+    int NearCount[256];
+    int Carry[3];                 /* Color error carried to the next pixel */
+} GifLossyType;
+
 typedef struct GifFilePrivateType {
     GifWord FileState, FileHandle,  /* Where all this data goes to! */
       BitsPerPixel,     /* Bits per pixel (Codes uses at least this + 1). */
@@ -47,7 +66,7 @@ typedef struct GifFilePrivateType {
       CrntCode,    /* Current algorithm code. */
       StackPtr,    /* For character stack (see below). */
       CrntShiftState;    /* Number of bits in CrntShiftDWord. */
-    unsigned long CrntShiftDWord;   /* For bytes decomposition into codes. */
+    uint64_t CrntShiftDWord;   /* For bytes decomposition into codes. */
     unsigned long PixelCount;   /* Number of pixels in image. */
     FILE *File;    /* File as stream. */
     InputFunc Read;     /* function to read gif input (TVT) */
@@ -56,10 +75,123 @@ typedef struct GifFilePrivateType {
     GifByteType Stack[LZ_MAX_CODE]; /* Decoded pixels are stacked here. */
     GifByteType Suffix[LZ_MAX_CODE + 1];    /* So we can trace the codes. */
     GifPrefixType Prefix[LZ_MAX_CODE + 1];
-    GifHashTableType *HashTable;
+    GifCodeTableType *CodeTable;    /* LZW dictionary of the encoder. */
+    GifByteType *CodeBuf;   /* Encoder output not yet cut into sub-blocks. */
+    size_t CodeBufLen;      /* Bytes staged in CodeBuf. */
+    GifByteType *BlockBuf;  /* CodeBuf contents with sub-block headers. */
+    GifByteType *WriteBuf;  /* Encoder output coalesced into big writes. */
+    size_t WriteBufLen, WriteBufSize;
+    GifMemoryOutputType *Memory;    /* Non-NULL for EGifOpenMemory(). */
+    bool RawCodes;      /* Bare LZW bits: no code size, Clear, EOF or blocks */
+    GifEncoderOptions Options;
+    size_t CodeBytes;   /* Code bytes moved out of CodeBuf for this image */
+    unsigned long ClearPixelsLeft;  /* Pixels still to come at last Clear */
+    uint64_t ClearBits;             /* Code bits written by then */
+    unsigned long RatioPixels;      /* Compression since that Clear, */
+    uint64_t RatioBits;             /* ... at the last check */
+    int CodesToCheck;   /* Codes output with a full table until next check */
+    int ClearAt;        /* The code table is full when RunningCode gets here */
+    bool Literal;       /* No table at all: each pixel is sent as its code */
+    GifLossyType *Lossy;    /* Non-NULL while coding an image lossily */
+    int Transparent;    /* Of the last graphics control block written */
+    int ExtCode;        /* Of the extension being written in blocks */
+    bool KeepCompressed;    /* DGifSlurp() keeps images' LZW data */
+    const GifByteType *Replay;  /* Input comes from here while non-NULL */
+    size_t ReplayLeft;
     bool gif89;
 } GifFilePrivateType;
 
+/*
+ * True-color pixels as the palette mapper and the quantizer read them,
+ * whether in separate planes or interleaved: where the first pixel's
+ * primaries and alpha are, and how many bytes on the next pixel and the
+ * next row are.
+ */
+typedef struct GifPixelSourceType {
+    const GifByteType *Red, *Green, *Blue;
+    const GifByteType *Alpha;   /* NULL if the pixels are all opaque */
+    size_t Step, Stride;
+} GifPixelSourceType;
+
+/* Read Width-pixel rows from separate red, green and blue planes. */
+static inline void _GifPlanarSource(GifPixelSourceType *Source,
+				    const GifByteType *Red,
+				    const GifByteType *Green,
+				    const GifByteType *Blue,
+				    unsigned int Width)
+{
+    Source->Red = Red;
+    Source->Green = Green;
+    Source->Blue = Blue;
+    Source->Alpha = NULL;
+    Source->Step = 1;
+    Source->Stride = Width;
+}
+
+/* Read rows Stride bytes apart of GIF_PIXELS_* Format pixels; returns
+ * GIF_ERROR if Format is unknown. */
+static inline int _GifInterleavedSource(GifPixelSourceType *Source,
+					const GifByteType *Pixels,
+					int Format, size_t Stride)
+{
+    switch (Format) {
+    case GIF_PIXELS_RGB24:
+	Source->Red = Pixels;
+	Source->Blue = Pixels + 2;
+	Source->Alpha = NULL;
+	Source->Step = 3;
+	break;
+    case GIF_PIXELS_RGBA32:
+	Source->Red = Pixels;
+	Source->Blue = Pixels + 2;
+	Source->Alpha = Pixels + 3;
+	Source->Step = 4;
+	break;
+    case GIF_PIXELS_BGRA32:
+	Source->Red = Pixels + 2;
+	Source->Blue = Pixels;
+	Source->Alpha = Pixels + 3;
+	Source->Step = 4;
+	break;
+    default:
+	return GIF_ERROR;
+    }
+    Source->Green = Pixels + 1;
+    Source->Stride = Stride;
+
+    return GIF_OK;
+}
+
+/* The same pixels, starting Rows rows down. */
+static inline void _GifSkipSourceRows(GifPixelSourceType *Source,
+				      size_t Rows)
+{
+    Source->Red += Rows * Source->Stride;
+    Source->Green += Rows * Source->Stride;
+    Source->Blue += Rows * Source->Stride;
+    if (Source->Alpha != NULL)
+	Source->Alpha += Rows * Source->Stride;
+}
+
+/* Ints of error _GifDitherPaletteRows() carries between bands. */
+#define _GIF_DITHER_ERRORS(Width)	(6 * ((size_t)(Width) + 2))
+
+extern int _GifDitherPaletteRows(const GifPaletteMapType *Map, int Dither,
+				 unsigned int Width, unsigned int Top,
+				 unsigned int Rows,
+				 const GifPixelSourceType *Source,
+				 int AlphaThreshold, int TransparentIndex,
+				 int *Errors, GifByteType *OutputBuffer);
+extern int _GifDitherPaletteSource(const GifPaletteMapType *Map, int Dither,
+				   unsigned int Width, unsigned int Height,
+				   const GifPixelSourceType *Source,
+				   int AlphaThreshold, int TransparentIndex,
+				   GifByteType *OutputBuffer);
+
+extern size_t _GifEncodedSize(const GifByteType *Raster, int Width,
+			      int Height, bool Interlace,
+			      const ColorMapObject *Map);
+
 #ifndef HAVE_REALLOCARRAY
 extern void *openbsd_reallocarray(void *optr, size_t nmemb, size_t size);
 #define reallocarray openbsd_reallocarray
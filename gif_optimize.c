@@ -0,0 +1,604 @@
+/*****************************************************************************
+
+gif_optimize.c - shrink an in-core animation by sending only what changes
+
+An animation whose frames each repeat the whole picture wastes most of
+its bytes on pixels that are already on screen.  GifOptimizeAnimation()
+replays the frames the way a viewer does, then rewrites each one as the
+smallest rectangle covering the pixels that differ from what the
+previous frame left behind, with the unchanged pixels inside it made
+transparent.  The disposal mode of each frame is chosen to make the
+next rectangle as small as possible.  What is shown is not changed.
+
+SPDX-License-Identifier: MIT
+
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gif_lib.h"
+#include "gif_lib_private.h"
+
+typedef struct OptBoxType {
+    int Left, Top, Width, Height;	/* Width == 0 means empty */
+} OptBoxType;
+
+typedef struct OptFrameType {
+    OptBoxType Box;
+    GifByteType *Raster;
+    int Transparent;
+    int Disposal;
+} OptFrameType;
+
+/******************************************************************************
+ Grow Box to take in the Width x Height area at (Left, Top).
+******************************************************************************/
+static void
+BoxUnion(OptBoxType *Box, int Left, int Top, int Width, int Height)
+{
+    int Right, Bottom;
+
+    if (Width <= 0 || Height <= 0)
+	return;
+    if (Box->Width == 0) {
+	Box->Left = Left;
+	Box->Top = Top;
+	Box->Width = Width;
+	Box->Height = Height;
+	return;
+    }
+    Right = Box->Left + Box->Width;
+    Bottom = Box->Top + Box->Height;
+    if (Left < Box->Left)
+	Box->Left = Left;
+    if (Top < Box->Top)
+	Box->Top = Top;
+    if (Left + Width > Right)
+	Right = Left + Width;
+    if (Top + Height > Bottom)
+	Bottom = Top + Height;
+    Box->Width = Right - Box->Left;
+    Box->Height = Bottom - Box->Top;
+}
+
+/******************************************************************************
+ Offsets of the first and last bytes that differ between two rows known
+ to differ somewhere.  Whole 64-bit words are compared until one has a
+ difference in it, which is then narrowed down a byte at a time.
+******************************************************************************/
+static int
+FirstDifference(const GifByteType *A, const GifByteType *B, int Len)
+{
+    int i = 0;
+
+    for (; i + 8 <= Len; i += 8) {
+	uint64_t WordA, WordB;
+
+	memcpy(&WordA, A + i, 8);
+	memcpy(&WordB, B + i, 8);
+	if (WordA != WordB)
+	    break;
+    }
+    while (A[i] == B[i])
+	i++;
+    return i;
+}
+
+static int
+LastDifference(const GifByteType *A, const GifByteType *B, int Len)
+{
+    int i = Len;
+
+    for (; i >= 8; i -= 8) {
+	uint64_t WordA, WordB;
+
+	memcpy(&WordA, A + i - 8, 8);
+	memcpy(&WordB, B + i - 8, 8);
+	if (WordA != WordB)
+	    break;
+    }
+    while (A[i - 1] == B[i - 1])
+	i--;
+    return i - 1;
+}
+
+/******************************************************************************
+ Bounding box of the pixels that differ between two canvases.  Equal rows,
+ the common case, are skipped with memcmp().
+******************************************************************************/
+static void
+ChangedBox(const GifByteType *A, const GifByteType *B,
+	   int Width, int Height, OptBoxType *Box)
+{
+    int y;
+
+    Box->Width = 0;
+    for (y = 0; y < Height; y++) {
+	const GifByteType *RowA = A + (size_t)y * Width;
+	const GifByteType *RowB = B + (size_t)y * Width;
+	int First, Last;
+
+	if (memcmp(RowA, RowB, Width) == 0)
+	    continue;
+	First = FirstDifference(RowA, RowB, Width);
+	Last = LastDifference(RowA, RowB, Width);
+	BoxUnion(Box, First, y, Last - First + 1, 1);
+    }
+}
+
+/******************************************************************************
+ Bounding box of the pixels that are clear in Canvas but not in Base, that
+ is, those no frame drawn over Base could produce.
+******************************************************************************/
+static void
+UncoveredBox(const GifByteType *Base, const GifByteType *Canvas,
+	     int Width, int Height, GifByteType Clear, OptBoxType *Box)
+{
+    int x, y;
+
+    Box->Width = 0;
+    for (y = 0; y < Height; y++) {
+	const GifByteType *RowBase = Base + (size_t)y * Width;
+	const GifByteType *RowCanvas = Canvas + (size_t)y * Width;
+
+	if (memchr(RowCanvas, Clear, Width) == NULL)
+	    continue;
+	for (x = 0; x < Width; x++)
+	    if (RowCanvas[x] == Clear && RowBase[x] != Clear)
+		BoxUnion(Box, x, y, 1, 1);
+    }
+}
+
+static void
+FillBox(GifByteType *Canvas, int Width, const OptBoxType *Box,
+	GifByteType Color)
+{
+    int y;
+
+    for (y = Box->Top; y < Box->Top + Box->Height; y++)
+	memset(Canvas + (size_t)y * Width + Box->Left, Color, Box->Width);
+}
+
+static void
+CopyBox(GifByteType *To, const GifByteType *From, int Width,
+	const OptBoxType *Box)
+{
+    int y;
+
+    for (y = Box->Top; y < Box->Top + Box->Height; y++) {
+	size_t Offset = (size_t)y * Width + Box->Left;
+
+	memcpy(To + Offset, From + Offset, Box->Width);
+    }
+}
+
+/******************************************************************************
+ The part of an image that lies on the screen.
+******************************************************************************/
+static void
+ClipBox(const GifFileType *GifFile, const GifImageDesc *Desc, OptBoxType *Box)
+{
+    int Right = Desc->Left + Desc->Width, Bottom = Desc->Top + Desc->Height;
+
+    Box->Left = Desc->Left < 0 ? 0 : Desc->Left;
+    Box->Top = Desc->Top < 0 ? 0 : Desc->Top;
+    if (Right > GifFile->SWidth)
+	Right = GifFile->SWidth;
+    if (Bottom > GifFile->SHeight)
+	Bottom = GifFile->SHeight;
+    Box->Width = Right - Box->Left;
+    Box->Height = Bottom - Box->Top;
+    if (Box->Width <= 0 || Box->Height <= 0)
+	Box->Width = Box->Height = 0;
+}
+
+/******************************************************************************
+ Draw an image onto the canvas as a viewer would, skipping its transparent
+ pixels.
+******************************************************************************/
+static void
+DrawImage(const GifFileType *GifFile, GifByteType *Canvas,
+	  const SavedImage *Image, int Transparent)
+{
+    const GifImageDesc *Desc = &Image->ImageDesc;
+    OptBoxType Box;
+    int x, y;
+
+    ClipBox(GifFile, Desc, &Box);
+    for (y = Box.Top; y < Box.Top + Box.Height; y++) {
+	const GifByteType *From = Image->RasterBits
+	    + (size_t)(y - Desc->Top) * Desc->Width + (Box.Left - Desc->Left);
+	GifByteType *To = Canvas + (size_t)y * GifFile->SWidth + Box.Left;
+
+	if (Transparent == NO_TRANSPARENT_COLOR)
+	    memcpy(To, From, Box.Width);
+	else
+	    for (x = 0; x < Box.Width; x++)
+		To[x] = (From[x] == Transparent) ? To[x] : From[x];
+    }
+}
+
+static const ColorMapObject *
+ImageColorMap(const GifFileType *GifFile, const SavedImage *Image)
+{
+    return Image->ImageDesc.ColorMap ? Image->ImageDesc.ColorMap
+				     : GifFile->SColorMap;
+}
+
+/******************************************************************************
+ Cut the frame that turns Base into Canvas out of the changed Box.  Pixels
+ already right are sent as Transparent when there is one, unless sending
+ them as they are compresses better.  Returns false if the frame would
+ have to draw a clear pixel.
+******************************************************************************/
+static bool
+MakeFrame(OptFrameType *Frame, const GifByteType *Base,
+	  const GifByteType *Canvas, int Width, int Clear,
+	  bool Interlace, const ColorMapObject *Map)
+{
+    const OptBoxType *Box = &Frame->Box;
+    size_t Len = (size_t)Box->Width * Box->Height, Kept = 0;
+    size_t WithSize, WithoutSize;
+    GifByteType *To, *Opaque;
+    bool HasClear = false;
+    int x, y;
+
+    Frame->Raster = (GifByteType *)malloc(Len);
+    if (Frame->Raster == NULL)
+	return false;
+    To = Frame->Raster;
+    for (y = Box->Top; y < Box->Top + Box->Height; y++) {
+	size_t Offset = (size_t)y * Width + Box->Left;
+	const GifByteType *RowBase = Base + Offset;
+	const GifByteType *RowCanvas = Canvas + Offset;
+
+	if (Clear >= 0 && memchr(RowCanvas, Clear, Box->Width) != NULL)
+	    HasClear = true;
+	if (Frame->Transparent != NO_TRANSPARENT_COLOR) {
+	    GifByteType Transparent = (GifByteType)Frame->Transparent;
+
+	    for (x = 0; x < Box->Width; x++) {
+		Kept += (RowBase[x] == RowCanvas[x]);
+		To[x] = (RowBase[x] == RowCanvas[x]) ? Transparent
+						     : RowCanvas[x];
+	    }
+	} else {
+	    if (HasClear)
+		return false;
+	    memcpy(To, RowCanvas, Box->Width);
+	}
+	To += Box->Width;
+    }
+
+    /*
+     * Transparency breaks up runs, so on busy frames it can cost more
+     * than it saves.  Try the frame without it.
+     */
+    if (Kept == 0 || HasClear)
+	return true;
+    if ((Opaque = (GifByteType *)malloc(Len)) == NULL)
+	return true;
+    for (y = 0; y < Box->Height; y++)
+	memcpy(Opaque + (size_t)y * Box->Width,
+	       Canvas + (size_t)(Box->Top + y) * Width + Box->Left,
+	       Box->Width);
+    WithSize = _GifEncodedSize(Frame->Raster, Box->Width, Box->Height,
+			       Interlace, Map);
+    WithoutSize = _GifEncodedSize(Opaque, Box->Width, Box->Height,
+				  Interlace, Map);
+    if (WithSize != 0 && WithoutSize != 0 && WithoutSize < WithSize) {
+	free(Frame->Raster);
+	Frame->Raster = Opaque;
+	Frame->Transparent = NO_TRANSPARENT_COLOR;
+    } else
+	free(Opaque);
+    return true;
+}
+
+/******************************************************************************
+ Pick the transparent index for a frame: the spare color if there is one,
+ else the lowest color the frame doesn't draw.
+******************************************************************************/
+static int
+ChooseTransparent(const GifByteType *Base, const GifByteType *Canvas,
+		  int Width, const OptBoxType *Box, int Spare, int ColorCount)
+{
+    bool Drawn[256];
+    int i, x, y;
+
+    if (Spare >= 0 && Spare < ColorCount)
+	return Spare;
+    memset(Drawn, '\0', sizeof(Drawn));
+    for (y = Box->Top; y < Box->Top + Box->Height; y++) {
+	size_t Offset = (size_t)y * Width + Box->Left;
+
+	for (x = 0; x < Box->Width; x++)
+	    if (Base[Offset + x] != Canvas[Offset + x])
+		Drawn[Canvas[Offset + x]] = true;
+    }
+    for (i = 0; i < ColorCount && i < 256; i++)
+	if (!Drawn[i])
+	    return i;
+    return NO_TRANSPARENT_COLOR;
+}
+
+/******************************************************************************
+ Widen a finished frame to Box, padding it with its transparent color.
+******************************************************************************/
+static bool
+WidenFrame(OptFrameType *Frame, const OptBoxType *Box)
+{
+    GifByteType *Raster;
+    int y;
+
+    Raster = (GifByteType *)malloc((size_t)Box->Width * Box->Height);
+    if (Raster == NULL)
+	return false;
+    memset(Raster, Frame->Transparent, (size_t)Box->Width * Box->Height);
+    for (y = 0; y < Frame->Box.Height; y++)
+	memcpy(Raster + (size_t)(Frame->Box.Top - Box->Top + y) * Box->Width
+		      + (Frame->Box.Left - Box->Left),
+	       Frame->Raster + (size_t)y * Frame->Box.Width,
+	       Frame->Box.Width);
+    free(Frame->Raster);
+    Frame->Raster = Raster;
+    Frame->Box = *Box;
+    return true;
+}
+
+/* how a pass over the frames came out */
+#define OPT_DONE	0	/* new frames ready to commit */
+#define OPT_SKIP	1	/* animation is left as it is */
+#define OPT_NO_MEMORY	2
+
+/******************************************************************************
+ Replay the animation on In, and work out the frames that reproduce each
+ step of it on Out.  Canvases holds six screen-sized work areas.
+******************************************************************************/
+static int
+OptimizeFrames(GifFileType *GifFile, const GraphicsControlBlock *GCBs,
+	       OptFrameType *Frames, GifByteType *Canvases,
+	       const ColorMapObject *Map)
+{
+    size_t Pixels = (size_t)GifFile->SWidth * GifFile->SHeight;
+    GifByteType *In = Canvases, *InSaved = In + Pixels;
+    GifByteType *Out = InSaved + Pixels, *OutBase = Out + Pixels, *Trial[3];
+    OptBoxType InBox;
+    bool Used[256], MayClear = false;
+    int Spare, Clear, i, c;
+
+    Trial[0] = Out;
+    Trial[1] = OutBase + Pixels;
+    Trial[2] = Trial[1] + Pixels;
+
+    /*
+     * Find a color no frame draws, to stand for pixels that show the
+     * background, and note whether any can.
+     */
+    memset(Used, '\0', sizeof(Used));
+    for (i = 0; i < GifFile->ImageCount; i++) {
+	const SavedImage *sp = &GifFile->SavedImages[i];
+	size_t Len = (size_t)sp->ImageDesc.Width * sp->ImageDesc.Height;
+	size_t j;
+
+	for (j = 0; j < Len; j++)
+	    if (sp->RasterBits[j] != GCBs[i].TransparentColor)
+		Used[sp->RasterBits[j]] = true;
+	if (i < GifFile->ImageCount - 1
+	    && (GCBs[i].DisposalMode == DISPOSE_BACKGROUND
+		|| (i == 0 && GCBs[i].DisposalMode == DISPOSE_PREVIOUS)))
+	    MayClear = true;
+    }
+    ClipBox(GifFile, &GifFile->SavedImages[0].ImageDesc, &InBox);
+    if (InBox.Width != GifFile->SWidth || InBox.Height != GifFile->SHeight
+	|| GCBs[0].TransparentColor != NO_TRANSPARENT_COLOR)
+	MayClear = true;
+    for (Spare = 0; Spare < 256 && Used[Spare]; Spare++)
+	continue;
+    if (Spare == 256) {
+	if (MayClear)
+	    return OPT_SKIP;
+	Spare = -1;
+    }
+    Clear = MayClear ? Spare : -1;
+
+    memset(In, Spare < 0 ? 0 : Spare, Pixels);
+    memcpy(Out, In, Pixels);
+    for (i = 0; i < GifFile->ImageCount; i++) {
+	const SavedImage *sp = &GifFile->SavedImages[i];
+	OptFrameType *Frame = &Frames[i], *Prev = Frame - 1;
+	const GifByteType *Base = Out;
+
+	/* replay the original frame */
+	if (i > 0) {
+	    if (GCBs[i - 1].DisposalMode == DISPOSE_BACKGROUND)
+		FillBox(In, GifFile->SWidth, &InBox, (GifByteType)Spare);
+	    else if (GCBs[i - 1].DisposalMode == DISPOSE_PREVIOUS)
+		CopyBox(In, InSaved, GifFile->SWidth, &InBox);
+	}
+	ClipBox(GifFile, &sp->ImageDesc, &InBox);
+	if (GCBs[i].DisposalMode == DISPOSE_PREVIOUS)
+	    CopyBox(InSaved, In, GifFile->SWidth, &InBox);
+	DrawImage(GifFile, In, sp, GCBs[i].TransparentColor);
+
+	if (i == 0) {
+	    if (Spare < 0) {
+		Frame->Box.Left = Frame->Box.Top = 0;
+		Frame->Box.Width = GifFile->SWidth;
+		Frame->Box.Height = GifFile->SHeight;
+	    } else
+		ChangedBox(Out, In, GifFile->SWidth, GifFile->SHeight,
+			   &Frame->Box);
+	} else {
+	    /*
+	     * Try leaving the previous frame in place, clearing it (widened
+	     * to take in any pixels that must go back to the background),
+	     * and restoring what was under it.  Keep whichever leaves the
+	     * least to redraw.
+	     */
+	    OptBoxType Boxes[3], Cleared = Prev->Box, Uncovered;
+	    long Best = -1;
+	    int Choice = 0;
+
+	    memcpy(Trial[1], Out, Pixels);
+	    memcpy(Trial[2], Out, Pixels);
+	    CopyBox(Trial[2], OutBase, GifFile->SWidth, &Prev->Box);
+	    if (Clear >= 0) {
+		UncoveredBox(Out, In, GifFile->SWidth, GifFile->SHeight,
+			     (GifByteType)Clear, &Uncovered);
+		BoxUnion(&Cleared, Uncovered.Left, Uncovered.Top,
+			 Uncovered.Width, Uncovered.Height);
+		FillBox(Trial[1], GifFile->SWidth, &Cleared,
+			(GifByteType)Clear);
+	    }
+	    for (c = 0; c < 3; c++) {
+		long Area;
+
+		if (c == 1 && (Clear < 0
+			       || (Prev->Transparent == NO_TRANSPARENT_COLOR
+				   && memcmp(&Cleared, &Prev->Box,
+					     sizeof(OptBoxType)) != 0)))
+		    continue;
+		if (Clear >= 0 && c != 1) {
+		    UncoveredBox(Trial[c], In, GifFile->SWidth,
+				 GifFile->SHeight, (GifByteType)Clear,
+				 &Uncovered);
+		    if (Uncovered.Width != 0)
+			continue;
+		}
+		ChangedBox(Trial[c], In, GifFile->SWidth, GifFile->SHeight,
+			   &Boxes[c]);
+		Area = (long)Boxes[c].Width * Boxes[c].Height;
+		if (Best < 0 || Area < Best) {
+		    Best = Area;
+		    Choice = c;
+		}
+	    }
+	    if (Best < 0)
+		return OPT_SKIP;
+	    if (Choice == 1) {
+		Prev->Disposal = DISPOSE_BACKGROUND;
+		if (memcmp(&Cleared, &Prev->Box, sizeof(OptBoxType)) != 0
+		    && !WidenFrame(Prev, &Cleared))
+		    return OPT_NO_MEMORY;
+	    } else
+		Prev->Disposal = (Choice == 2) ? DISPOSE_PREVIOUS
+					       : DISPOSE_DO_NOT;
+	    Base = Trial[Choice];
+	    Frame->Box = Boxes[Choice];
+	}
+
+	/* a frame that changes nothing still has to carry its delay */
+	if (Frame->Box.Width == 0) {
+	    Frame->Box.Left = Frame->Box.Top = 0;
+	    Frame->Box.Width = Frame->Box.Height = 1;
+	}
+	if (i == 0 && Spare < 0)
+	    /* nothing is drawn under the first frame to show through */
+	    Frame->Transparent = NO_TRANSPARENT_COLOR;
+	else
+	    Frame->Transparent = ChooseTransparent(Base, In, GifFile->SWidth,
+						   &Frame->Box, Spare,
+						   Map->ColorCount);
+	Frame->Disposal = DISPOSE_DO_NOT;
+	if (!MakeFrame(Frame, Base, In, GifFile->SWidth, Clear,
+		       sp->ImageDesc.Interlace, Map))
+	    return (Frame->Raster == NULL) ? OPT_NO_MEMORY : OPT_SKIP;
+
+	if (Base != OutBase)
+	    memcpy(OutBase, Base, Pixels);
+	memcpy(Out, In, Pixels);
+    }
+
+    return OPT_DONE;
+}
+
+/******************************************************************************
+ Rewrite the frames of an in-core animation as the smallest rectangles that
+ reproduce what a viewer shows, with unchanged pixels made transparent and
+ disposal modes chosen to keep the rectangles small.
+
+ The frames must all be drawn with the same colors: animations that
+ switch color maps are left alone, as are the few that both use all 256
+ colors and show through to the background.  Returns GIF_ERROR, leaving
+ the images untouched, only if memory runs out.
+******************************************************************************/
+int
+GifOptimizeAnimation(GifFileType *GifFile)
+{
+    const ColorMapObject *Map;
+    GraphicsControlBlock *GCBs;
+    OptFrameType *Frames;
+    GifByteType *Canvases;
+    int i, Status = OPT_NO_MEMORY;
+
+    if (GifFile->ImageCount < 2 || GifFile->SWidth <= 0
+	|| GifFile->SHeight <= 0)
+	return GIF_OK;
+    Map = ImageColorMap(GifFile, &GifFile->SavedImages[0]);
+    if (Map == NULL)
+	return GIF_OK;
+    for (i = 0; i < GifFile->ImageCount; i++) {
+	const SavedImage *sp = &GifFile->SavedImages[i];
+	const ColorMapObject *ImageMap = ImageColorMap(GifFile, sp);
+
+	if (sp->RasterBits == NULL || ImageMap == NULL
+	    || ImageMap->ColorCount != Map->ColorCount
+	    || memcmp(ImageMap->Colors, Map->Colors,
+		      Map->ColorCount * sizeof(GifColorType)) != 0)
+	    return GIF_OK;
+    }
+
+    GCBs = (GraphicsControlBlock *)calloc(GifFile->ImageCount,
+					  sizeof(GraphicsControlBlock));
+    Frames = (OptFrameType *)calloc(GifFile->ImageCount,
+				    sizeof(OptFrameType));
+    Canvases = (GifByteType *)reallocarray(NULL,
+				(size_t)GifFile->SWidth * GifFile->SHeight, 6);
+    if (GCBs != NULL && Frames != NULL && Canvases != NULL) {
+	for (i = 0; i < GifFile->ImageCount; i++)
+	    (void)DGifSavedExtensionToGCB(GifFile, i, &GCBs[i]);
+	Status = OptimizeFrames(GifFile, GCBs, Frames, Canvases, Map);
+    }
+
+    /*
+     * Every image gets a graphics control block first, so that nothing
+     * can fail once the rasters start being replaced.
+     */
+    for (i = 0; Status == OPT_DONE && i < GifFile->ImageCount; i++)
+	if (EGifGCBToSavedExtension(&GCBs[i], GifFile, i) == GIF_ERROR)
+	    Status = OPT_NO_MEMORY;
+    for (i = 0; Status == OPT_DONE && i < GifFile->ImageCount; i++) {
+	SavedImage *sp = &GifFile->SavedImages[i];
+	OptFrameType *Frame = &Frames[i];
+
+	free(sp->RasterBits);
+	sp->RasterBits = Frame->Raster;
+	Frame->Raster = NULL;
+	sp->ImageDesc.Left = Frame->Box.Left;
+	sp->ImageDesc.Top = Frame->Box.Top;
+	sp->ImageDesc.Width = Frame->Box.Width;
+	sp->ImageDesc.Height = Frame->Box.Height;
+	GCBs[i].DisposalMode = Frame->Disposal;
+	GCBs[i].TransparentColor = Frame->Transparent;
+	(void)EGifGCBToSavedExtension(&GCBs[i], GifFile, i);
+    }
+
+    if (Frames != NULL)
+	for (i = 0; i < GifFile->ImageCount; i++)
+	    free(Frames[i].Raster);
+    free(Frames);
+    free(GCBs);
+    free(Canvases);
+    if (Status == OPT_NO_MEMORY) {
+	GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+	return GIF_ERROR;
+    }
+    return GIF_OK;
+}
+
+/* end */
@@ -0,0 +1,772 @@
+/*****************************************************************************
+
+gif_palette.c - map RGB pixels onto the nearest colors of a given color map
+
+Finding the nearest of up to 256 colors for every pixel of a true-color
+image the obvious way costs a distance per color per pixel.  Instead,
+GifMakePaletteMap() divides the RGB cube into cells once per color map,
+and for each cell lists the only colors that can be nearest to some
+point in it: those no farther from the cell than the color whose far
+corner of the cell is nearest.  A pixel then need only be measured
+against the short list of its cell, and the answer is still exactly the
+nearest color (the first of them, on a tie).
+
+GifDitherPaletteBuffer() maps through the same lists, but first moves
+each pixel by an ordered threshold, or by the error left over from its
+neighbors, so that areas between the colors of the map come out as
+mixtures of them rather than flat bands.  GifDitherPalettePixels() does
+the same for interleaved pixels, with or without alpha.
+
+SPDX-License-Identifier: MIT
+
+*****************************************************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gif_lib.h"
+#include "gif_lib_private.h"
+
+#define CELL_BITS   5                   /* Per primary color */
+#define CELL_COUNT  (1 << (3 * CELL_BITS))
+
+#define CELL_INDEX(Red, Green, Blue) \
+    ((((Red) >> (8 - CELL_BITS)) << (2 * CELL_BITS)) | \
+     (((Green) >> (8 - CELL_BITS)) << CELL_BITS) | \
+     ((Blue) >> (8 - CELL_BITS)))
+
+struct GifPaletteMapType {
+    int ColorCount;
+    int Red[256], Green[256], Blue[256];
+    int Spread;                 /* Typical distance between the colors */
+    uint32_t First[CELL_COUNT + 1];     /* Each cell's run of Candidates */
+    GifByteType *Candidates;
+};
+
+/* Ordered dither thresholds, 0 to 255. */
+static const GifByteType Bayer[8 * 8] = {
+      0, 128,  32, 160,   8, 136,  40, 168,
+    192,  64, 224,  96, 200,  72, 232, 104,
+     48, 176,  16, 144,  56, 184,  24, 152,
+    240, 112, 208,  80, 248, 120, 216,  88,
+     12, 140,  44, 172,   4, 132,  36, 164,
+    204,  76, 236, 108, 196,  68, 228, 100,
+     60, 188,  28, 156,  52, 180,  20, 148,
+    252, 124, 220,  92, 244, 116, 212,  84
+};
+
+/* A blue-noise threshold map, made by Ulichney's void-and-cluster
+ * method; it tiles without seams. */
+static const GifByteType BlueNoise[32 * 32] = {
+    118, 138,   6, 158, 208,  20, 180,  56,
+    217,  30, 231,  61, 125, 223,   3, 118,
+     73,  18, 183,  53, 166, 249,   7, 151,
+    190,  62, 119, 199,  72, 248, 172,  87,
+     25, 204, 251,  43,  71, 129,  87,   2,
+    121, 144, 192, 164,  97,  76, 205, 168,
+    253, 155, 232, 126,  75,  97,  44, 234,
+     78, 139, 239,  28, 100, 132,  52, 220,
+    156,  57, 174, 102, 230, 189, 241, 167,
+    205,  86,  46,  13, 244,  33, 139,  57,
+    103,  37,  88,  10, 208, 146, 175, 116,
+     23, 215,  45, 150, 211,  12, 191, 105,
+    240,  85, 125,  16, 147,  31, 108,  64,
+     25, 255, 114, 212, 128, 184, 230,  15,
+    197, 217, 142, 186,  32, 226,  60, 201,
+     88, 169, 104, 180,  82, 237, 145,  38,
+      2, 218, 187,  67, 200,  50, 159, 217,
+    139, 176,  72, 154,  54,  84, 110, 152,
+     74, 119,  49, 248, 104, 130,  13, 243,
+    134,   1, 250,  56,  22, 117,  65, 176,
+    133,  46, 157, 245, 115, 224,  83,  15,
+     94,  39, 203,   5, 236, 168,  24, 188,
+    241,   4, 161,  67, 172,  82, 155,  42,
+    191,  72, 122, 222, 194, 160, 215,  91,
+    197, 107,  27,  91,   9, 134, 180, 238,
+    195, 109, 225, 135,  99,  38, 209,  59,
+    130,  87, 196, 229,  18, 220, 184,  96,
+    233, 161,  28, 141,  95,  42,  17, 254,
+    148,  58, 228, 204, 171,  37,  68, 124,
+     53, 163,  22,  60, 190, 251, 142, 105,
+    217,  26, 140, 103,  40, 124,  63,  21,
+    111,  50, 206,  77, 242, 185, 123,  73,
+     11, 183, 119,  76, 144, 252, 214,   0,
+    147, 246,  88, 170, 120,  75,  19, 177,
+     43, 166, 247,  60, 205, 148, 254, 197,
+    139, 220, 178,   6, 114,  55, 158, 223,
+     38, 245, 163,  24,  49, 110,  94, 191,
+     79,  33, 200, 234,   8, 154, 227,  92,
+    237,  75, 120,  15, 179,  85,   4, 167,
+     71,  35,  91, 149, 228,  24, 204, 101,
+    140,  66,  92, 231, 209, 177,  20, 158,
+    220, 112, 138,  46, 106, 204,  56, 137,
+      2, 192, 153, 216, 111, 228,  48, 102,
+    233, 130, 247,  62, 173, 131,  79, 176,
+    219, 193, 133,   9, 151,  61, 126, 236,
+     54,  11, 179,  69, 221,  29, 181, 113,
+    210,  52,  97,  36,  68, 160, 136, 209,
+     26, 181,  13, 106, 213,  44, 241,   1,
+     55,  28, 113, 198,  81, 243,  31,  77,
+    188, 152, 248,  90, 161, 127,  78, 253,
+     26, 143, 232, 173, 249,  22, 185,  81,
+    118,  55, 202, 165,  30,  96, 154, 121,
+     90, 160, 251,  45, 103, 184, 138, 212,
+    102, 123,  36, 195,  10, 238,  47, 166,
+    101, 188,  81,   6, 120,  95,  42, 244,
+    156, 225, 141,  76, 252, 194,  64, 233,
+    210, 181,  69, 145, 224,   3, 168,  49,
+     17, 223,  61, 141, 109, 201, 148,  14,
+    215,  61, 133, 205, 150, 222, 195,  64,
+      0,  95,  39, 116,   8, 133, 178,  18,
+     40, 127,  12, 203,  35, 118,  89, 255,
+    199,  80, 163, 235,  31,  84,  60, 231,
+    125,  29, 240,  43,  71,  17, 135, 114,
+    214, 177, 237, 162, 219,  48, 105, 147,
+    246, 102, 221,  84, 159, 233,  65, 149,
+    128, 181,   7,  96, 208, 172, 115, 189,
+     77, 175, 157, 111, 182, 243, 165,  32,
+     79, 137,  22,  68,  90, 200, 229,  80,
+    171,  59, 186, 136,  53, 196, 174,  23,
+     41, 108, 246,  52, 131, 225,   1,  41,
+    250,  98,   8, 211,  86,  54,  97, 186,
+    255,  54, 207, 182, 121,  30, 157,   6,
+    122,  20, 236,  30, 112,  10,  99, 239,
+    218,  71, 145, 193,  26,  74, 158, 137,
+    207,  58, 130, 230,  21, 146, 227,   7,
+    125, 153, 107,  11, 248, 136,  65, 196,
+    218, 150,  91, 164, 247, 206, 141,  55,
+    121, 203,  19, 170, 104, 244, 187,  89,
+     19, 152, 191,  39, 171, 116, 198,  72,
+    213,  40,  86, 221, 163,  49, 236,  98,
+     75,  46, 210, 129,  73,  36,  85, 185,
+      4, 160,  82, 229,  62, 124,  47, 219,
+    116, 237,  74,  93, 250,  51,  27, 104,
+    164, 240, 187,  32,  77, 112, 174,  24,
+    253, 178,   5,  57, 173, 229, 155, 216,
+    101, 252,  44, 135, 212,  14, 165,  70,
+     35, 170,  13, 128, 154, 214, 179, 138,
+     58,  10, 120, 144, 211,   3, 202, 143,
+    119, 100, 226, 198, 107,  14, 124,  29,
+     65, 146, 196,  93,  33, 189, 142, 253,
+    193,  99, 222, 199,  63,   2,  84, 246,
+    201,  94, 228,  45, 169, 232,  86,  35,
+    162,  66,  23, 148,  83, 249,  53, 183,
+    235, 114,  11, 173, 242, 108,  79,   3,
+    123,  58, 147,  37, 112, 226, 126,  34,
+    152,  23, 178,  68, 101, 129,  56, 194,
+    216, 131, 244,  39, 192, 132, 214,  92,
+    169,  41, 223,  70, 128,  50, 211, 159,
+    232,  29, 186, 242,  89, 159, 194,  69,
+    109, 218, 132, 251,  16, 155, 241,  14,
+     45, 184, 110, 167,  67,  25, 153,   1,
+     73, 134, 207,  28, 162, 235,  21,  90,
+    202,  69, 134,   9, 176,  50,  16, 234,
+    167,  51,  83, 198,  38, 182, 107,  80,
+    227,  88,   7, 212,  98, 238, 115, 202,
+    245, 105, 151,  87, 190, 103, 145,  44,
+    117, 170,  98, 213,  74, 254, 135,  99,
+    203,   5, 150, 117, 224,  64, 209, 140,
+     32, 157, 235,  51, 144, 179,  37,  59,
+    187,  20,  51, 254,   5,  66, 208, 182,
+    250,  18, 231,  42, 151, 109, 188,  34,
+     78, 242, 175,  27,  92, 131,   0, 175,
+    115,  70, 129, 199,  15,  80, 222, 137,
+     93, 171, 215, 122, 169, 226,  33, 132,
+     81,  59, 162, 127, 207,  21,  62, 224,
+    140, 111,  47, 193, 239, 164,  52, 255,
+    206,  17, 168,  95, 247, 123, 165,   8,
+    234,  67, 142,  40,  85, 110, 156,  12,
+    221, 113, 190,   0,  89, 238, 180, 161,
+     16, 206,  66, 143,  19,  76, 189,  96,
+    149, 239,  47, 183,  31,  63, 201,  41,
+    117, 195,  12, 240, 200,  57, 245,  94,
+    172,  34, 243,  70, 149, 122,  48,  82,
+    127, 252,  93, 225, 108, 213, 126,  36,
+     63, 192,  83, 113, 227, 146, 100, 249,
+    156,  78, 106, 174,  25, 143, 185,  48,
+    210, 136, 100, 216,  27, 197, 106, 219,
+     34, 166,   4, 177,  43, 153,   9, 230
+};
+
+/* Squared distances from a color to the nearest and farthest points of
+ * a span of an axis; kept for each axis, span and color in turn. */
+typedef struct SpanDistanceType {
+    int Near, Far;
+} SpanDistanceType;
+
+#define SPAN(Spans, Axis, Span, Color) \
+    ((Spans)[(((Axis) << CELL_BITS) + (Span)) * 256 + (Color)])
+
+/* The cells of one level of subdivision, and their candidate colors. */
+typedef struct CellListType {
+    uint32_t *First;
+    GifByteType *Candidates;
+    uint32_t Alloc;
+} CellListType;
+
+/******************************************************************************
+ Squared distances from Value to the nearest and farthest points of the
+ span Low..Low+Side-1 along one axis.
+******************************************************************************/
+static void
+SpanDistance(int Value, int Low, int Side, int *Near, int *Far)
+{
+    int High = Low + Side - 1;
+
+    if (Value < Low) {
+        *Near = (Low - Value) * (Low - Value);
+        *Far = (High - Value) * (High - Value);
+    } else if (Value > High) {
+        *Near = (Value - High) * (Value - High);
+        *Far = (Value - Low) * (Value - Low);
+    } else {
+        *Near = 0;
+        *Far = Value - Low > High - Value
+            ? (Value - Low) * (Value - Low) : (High - Value) * (High - Value);
+    }
+}
+
+/******************************************************************************
+ The median over the colors of Map of the distance to the nearest other
+ color; how far apart its colors typically are, and so how far ordered
+ dithering should move pixels.  0 if there is only one distinct color.
+******************************************************************************/
+static int
+ColorSpread(const GifPaletteMapType *Map)
+{
+    int i, j, k, Distance, Spread, Nearest[256], Count = 0;
+
+    for (i = 0; i < Map->ColorCount; i++) {
+        int Best = INT32_MAX;
+
+        for (j = 0; j < Map->ColorCount; j++) {
+            int dr = Map->Red[i] - Map->Red[j];
+            int dg = Map->Green[i] - Map->Green[j];
+            int db = Map->Blue[i] - Map->Blue[j];
+
+            Distance = dr * dr + dg * dg + db * db;
+            if (Distance > 0 && Distance < Best)
+                Best = Distance;
+        }
+        if (Best == INT32_MAX)
+            continue;
+        /* Insertion sort; there are at most 256. */
+        for (k = Count++; k > 0 && Nearest[k - 1] > Best; k--)
+            Nearest[k] = Nearest[k - 1];
+        Nearest[k] = Best;
+    }
+    if (Count == 0)
+        return 0;
+
+    Distance = Nearest[Count / 2];
+    for (Spread = 0; (Spread + 1) * (Spread + 1) <= Distance; Spread++)
+        continue;
+    return Spread;
+}
+
+/******************************************************************************
+ List the candidates of each cell of the level with Bits bits per
+ primary, into Cells.  Whichever color is nearest to a point of a cell
+ is no farther from the cell than the color whose farthest point of it
+ is nearest, and is among the candidates of the cell's parent in
+ Parent, a level with one bit less.  Spans is room for the distances
+ along each axis from each color to each span of the level, nearest and
+ farthest.  Returns GIF_ERROR if memory is exhausted.
+******************************************************************************/
+static int
+ListCandidates(const GifPaletteMapType *Map, int Bits,
+               const CellListType *Parent, CellListType *Cells,
+               SpanDistanceType *Spans)
+{
+    int Cell, Side = 256 >> Bits, Mask = (1 << Bits) - 1;
+    int i, Span, Near[256], Nearest, Far;
+    const SpanDistanceType *Red, *Green, *Blue;
+    uint32_t j, Used = 0;
+
+    for (Span = 0; Span <= Mask; Span++)
+        for (i = 0; i < Map->ColorCount; i++) {
+            SpanDistance(Map->Red[i], Span * Side, Side,
+                         &SPAN(Spans, 0, Span, i).Near,
+                         &SPAN(Spans, 0, Span, i).Far);
+            SpanDistance(Map->Green[i], Span * Side, Side,
+                         &SPAN(Spans, 1, Span, i).Near,
+                         &SPAN(Spans, 1, Span, i).Far);
+            SpanDistance(Map->Blue[i], Span * Side, Side,
+                         &SPAN(Spans, 2, Span, i).Near,
+                         &SPAN(Spans, 2, Span, i).Far);
+        }
+
+    for (Cell = 0; Cell < 1 << (3 * Bits); Cell++) {
+        int Up = (((Cell >> (2 * Bits)) >> 1) << (2 * (Bits - 1)))
+            | ((((Cell >> Bits) & Mask) >> 1) << (Bits - 1))
+            | ((Cell & Mask) >> 1);
+        const GifByteType *Candidate = Parent->Candidates + Parent->First[Up];
+        uint32_t Count = Parent->First[Up + 1] - Parent->First[Up];
+
+        Red = &SPAN(Spans, 0, Cell >> (2 * Bits), 0);
+        Green = &SPAN(Spans, 1, (Cell >> Bits) & Mask, 0);
+        Blue = &SPAN(Spans, 2, Cell & Mask, 0);
+        Nearest = INT32_MAX;
+        for (j = 0; j < Count; j++) {
+            i = Candidate[j];
+            Near[j] = Red[i].Near + Green[i].Near + Blue[i].Near;
+            Far = Red[i].Far + Green[i].Far + Blue[i].Far;
+            if (Far < Nearest)
+                Nearest = Far;
+        }
+
+        if (Used + Count > Cells->Alloc) {
+            GifByteType *Candidates;
+            uint32_t Alloc = 2 * (Used + Count);
+
+            Candidates = (GifByteType *)realloc(Cells->Candidates, Alloc);
+            if (Candidates == NULL)
+                return GIF_ERROR;
+            Cells->Candidates = Candidates;
+            Cells->Alloc = Alloc;
+        }
+        Cells->First[Cell] = Used;
+        for (j = 0; j < Count; j++)
+            if (Near[j] <= Nearest)
+                Cells->Candidates[Used++] = Candidate[j];
+    }
+    Cells->First[1 << (3 * Bits)] = Used;
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Make a palette map for ColorMap, which is copied, so it may be changed
+ or freed afterwards.  The cells are refined a level at a time from the
+ whole cube, so each looks only at the few colors its parent kept.
+ Returns NULL if memory is exhausted or ColorMap is empty.
+******************************************************************************/
+GifPaletteMapType *
+GifMakePaletteMap(const ColorMapObject *ColorMap)
+{
+    GifPaletteMapType *Map;
+    CellListType Whole, Work[2], Last, *Parent, *Cells;
+    SpanDistanceType *Spans;
+    uint32_t WholeFirst[2];
+    GifByteType All[256];
+    int Bits, i, Count = ColorMap->ColorCount;
+
+    if (Count <= 0)
+        return NULL;
+    if (Count > 256)
+        Count = 256;
+    Map = (GifPaletteMapType *)malloc(sizeof(GifPaletteMapType));
+    if (Map == NULL)
+        return NULL;
+    Map->ColorCount = Count;
+    for (i = 0; i < Count; i++) {
+        Map->Red[i] = ColorMap->Colors[i].Red;
+        Map->Green[i] = ColorMap->Colors[i].Green;
+        Map->Blue[i] = ColorMap->Colors[i].Blue;
+        All[i] = (GifByteType)i;
+    }
+    Map->Spread = ColorSpread(Map);
+
+    /* The whole cube, where every color is a candidate, then levels that
+     * take turns in two work lists, the last going straight in the map: */
+    WholeFirst[0] = 0;
+    WholeFirst[1] = Count;
+    Whole.First = WholeFirst;
+    Whole.Candidates = All;
+    for (i = 0; i < 2; i++) {
+        Work[i].First = (uint32_t *)malloc(
+            sizeof(uint32_t) * ((CELL_COUNT >> 3) + 1));
+        Work[i].Candidates = NULL;
+        Work[i].Alloc = 0;
+    }
+    Last.First = Map->First;
+    Last.Candidates = NULL;
+    Last.Alloc = 0;
+    Spans = (SpanDistanceType *)malloc(
+        sizeof(SpanDistanceType) * 3 * (1 << CELL_BITS) * 256);
+    if (Work[0].First == NULL || Work[1].First == NULL || Spans == NULL)
+        goto fail;
+
+    Parent = &Whole;
+    for (Bits = 1; Bits <= CELL_BITS; Bits++) {
+        Cells = Bits == CELL_BITS ? &Last : &Work[Bits & 1];
+        if (ListCandidates(Map, Bits, Parent, Cells, Spans) == GIF_ERROR)
+            goto fail;
+        Parent = Cells;
+    }
+    Map->Candidates = Last.Candidates;
+    for (i = 0; i < 2; i++) {
+        free(Work[i].First);
+        free(Work[i].Candidates);
+    }
+    free(Spans);
+
+    return Map;
+
+fail:
+    for (i = 0; i < 2; i++) {
+        free(Work[i].First);
+        free(Work[i].Candidates);
+    }
+    free(Spans);
+    free(Last.Candidates);
+    free(Map);
+    return NULL;
+}
+
+/******************************************************************************
+ Release a palette map.
+******************************************************************************/
+void
+GifFreePaletteMap(GifPaletteMapType *Map)
+{
+    if (Map != NULL) {
+        free(Map->Candidates);
+        free(Map);
+    }
+}
+
+/******************************************************************************
+ The nearest to the given color of the candidates of its cell; most cells
+ have only one.
+******************************************************************************/
+static inline int
+NearestCandidate(const GifPaletteMapType *Map, int Red, int Green, int Blue)
+{
+    int Cell = CELL_INDEX(Red, Green, Blue);
+    const GifByteType *Candidate = Map->Candidates + Map->First[Cell];
+    const GifByteType *End = Map->Candidates + Map->First[Cell + 1];
+    int Best = *Candidate, BestDistance = INT32_MAX;
+
+    if (End - Candidate == 1)
+        return Best;
+    for (; Candidate < End; Candidate++) {
+        int i = *Candidate;
+        int dr = Red - Map->Red[i];
+        int dg = Green - Map->Green[i];
+        int db = Blue - Map->Blue[i];
+        int Distance = dr * dr + dg * dg + db * db;
+
+        if (Distance < BestDistance) {
+            BestDistance = Distance;
+            Best = i;
+        }
+    }
+
+    return Best;
+}
+
+/******************************************************************************
+ The index of the color in Map nearest to the given one.
+******************************************************************************/
+int
+GifMapPaletteColor(const GifPaletteMapType *Map,
+                   int Red, int Green, int Blue)
+{
+    return NearestCandidate(Map, Red, Green, Blue);
+}
+
+/******************************************************************************
+ Map Pixels pixels given as separate red, green and blue arrays onto
+ Map, putting the color indexes in OutputBuffer.  Runs of one color are
+ only looked up once.
+******************************************************************************/
+void
+GifMapPaletteBuffer(const GifPaletteMapType *Map,
+                    unsigned long Pixels,
+                    const GifByteType *RedInput,
+                    const GifByteType *GreenInput,
+                    const GifByteType *BlueInput,
+                    GifByteType *OutputBuffer)
+{
+    unsigned long k;
+    int Red = -1, Green = -1, Blue = -1, Index = 0;
+
+    for (k = 0; k < Pixels; k++) {
+        if (RedInput[k] != Red || GreenInput[k] != Green
+            || BlueInput[k] != Blue) {
+            Red = RedInput[k];
+            Green = GreenInput[k];
+            Blue = BlueInput[k];
+            Index = NearestCandidate(Map, Red, Green, Blue);
+        }
+        OutputBuffer[k] = (GifByteType)Index;
+    }
+}
+
+/******************************************************************************
+ Clamp a dithered primary color to 0..255.
+******************************************************************************/
+static inline int
+ClampPrimary(int Value)
+{
+    return Value < 0 ? 0 : Value > 255 ? 255 : Value;
+}
+
+/******************************************************************************
+ Map rows First to Last - 1 of Source without dithering, but for giving
+ pixels with less alpha than AlphaThreshold TransparentIndex.  Runs of one
+ color are only looked up once.
+******************************************************************************/
+static void
+MapSource(const GifPaletteMapType *Map,
+          unsigned int Width, unsigned int First, unsigned int Last,
+          const GifPixelSourceType *Source,
+          int AlphaThreshold, int TransparentIndex,
+          GifByteType *OutputBuffer)
+{
+    const GifByteType *RedInput = Source->Red, *GreenInput = Source->Green,
+        *BlueInput = Source->Blue, *AlphaInput = Source->Alpha;
+    size_t Step = Source->Step;
+    int Red = -1, Green = -1, Blue = -1, Index = 0;
+    unsigned int x, y;
+
+    for (y = First; y < Last; y++) {
+        size_t i = y * Source->Stride;
+        GifByteType *Output = OutputBuffer + (size_t)y * Width;
+
+        for (x = 0; x < Width; x++, i += Step) {
+            if (AlphaInput != NULL && AlphaInput[i] < AlphaThreshold) {
+                Output[x] = (GifByteType)TransparentIndex;
+                continue;
+            }
+            if (RedInput[i] != Red || GreenInput[i] != Green
+                || BlueInput[i] != Blue) {
+                Red = RedInput[i];
+                Green = GreenInput[i];
+                Blue = BlueInput[i];
+                Index = NearestCandidate(Map, Red, Green, Blue);
+            }
+            Output[x] = (GifByteType)Index;
+        }
+    }
+}
+
+/******************************************************************************
+ Ordered dithering of rows First to Last - 1 with the square threshold
+ map Thresholds, Side by Side: each pixel moves along the gray axis by up
+ to half the Spread of Map either way, then is mapped.  Row 0 of Source
+ is row Top of the image, which places it in the map.
+******************************************************************************/
+static void
+DitherOrdered(const GifPaletteMapType *Map,
+              const GifByteType *Thresholds, int Side, unsigned int Top,
+              unsigned int Width, unsigned int First, unsigned int Last,
+              const GifPixelSourceType *Source,
+              int AlphaThreshold, int TransparentIndex,
+              GifByteType *OutputBuffer)
+{
+    const GifByteType *RedInput = Source->Red, *GreenInput = Source->Green,
+        *BlueInput = Source->Blue, *AlphaInput = Source->Alpha;
+    size_t Step = Source->Step;
+    int Offset[256], t;
+    unsigned int x, y;
+
+    for (t = 0; t < 256; t++)
+        Offset[t] = ((2 * t + 1 - 256) * Map->Spread) / 512;
+
+    for (y = First; y < Last; y++) {
+        const GifByteType *Row = Thresholds + ((Top + y) % Side) * Side;
+        size_t i = y * Source->Stride;
+        GifByteType *Output = OutputBuffer + (size_t)y * Width;
+
+        for (x = 0; x < Width; x++, i += Step) {
+            int Shift = Offset[Row[x % Side]];
+
+            if (AlphaInput != NULL && AlphaInput[i] < AlphaThreshold)
+                Output[x] = (GifByteType)TransparentIndex;
+            else
+                Output[x] = (GifByteType)NearestCandidate(Map,
+                    ClampPrimary(RedInput[i] + Shift),
+                    ClampPrimary(GreenInput[i] + Shift),
+                    ClampPrimary(BlueInput[i] + Shift));
+        }
+    }
+}
+
+/******************************************************************************
+ Floyd-Steinberg error diffusion, serpentine: rows are scanned left to
+ right and right to left by turns, which keeps the error from drifting
+ one way.  Transparent pixels take no error and pass none on.  Row 0 of
+ Source is row Top of the image, and Errors, _GIF_DITHER_ERRORS(Width)
+ ints, holds the error carried down to it (all 0 at the top), and is
+ left holding that carried below the last row.
+******************************************************************************/
+static void
+DitherFloydSteinberg(const GifPaletteMapType *Map, unsigned int Top,
+                     unsigned int Width, unsigned int Height,
+                     const GifPixelSourceType *Source,
+                     int AlphaThreshold, int TransparentIndex,
+                     int *Errors, GifByteType *OutputBuffer)
+{
+    /* Errors in sixteenths, for the row being done and the one below,
+     * with a spare pixel at each end so the edges need no tests. */
+    const GifByteType *RedInput = Source->Red, *GreenInput = Source->Green,
+        *BlueInput = Source->Blue, *AlphaInput = Source->Alpha;
+    int *This, *Next, *Swap;
+    size_t RowSize = 3 * ((size_t)Width + 2);
+    unsigned int x, y;
+
+    This = Errors;
+    Next = Errors + RowSize;
+
+    for (y = 0; y < Height; y++) {
+        int Step = ((Top + y) & 1) ? -1 : 1;
+        long Pixel = ((Top + y) & 1) ? (long)Width - 1 : 0;
+
+        memset(Next, '\0', RowSize * sizeof(int));
+        for (x = 0; x < Width; x++, Pixel += Step) {
+            size_t i = y * Source->Stride + Pixel * Source->Step;
+            unsigned long k = (unsigned long)y * Width + Pixel;
+            int *Here = This + 3 * (Pixel + 1);
+            int *Below = Next + 3 * (Pixel + 1);
+            int Wanted[3], Index, j, Error;
+
+            if (AlphaInput != NULL && AlphaInput[i] < AlphaThreshold) {
+                OutputBuffer[k] = (GifByteType)TransparentIndex;
+                continue;
+            }
+            Wanted[0] = ClampPrimary(RedInput[i] + Here[0] / 16);
+            Wanted[1] = ClampPrimary(GreenInput[i] + Here[1] / 16);
+            Wanted[2] = ClampPrimary(BlueInput[i] + Here[2] / 16);
+            Index = NearestCandidate(Map, Wanted[0], Wanted[1], Wanted[2]);
+            OutputBuffer[k] = (GifByteType)Index;
+
+            for (j = 0; j < 3; j++) {
+                Error = Wanted[j] - (j == 0 ? Map->Red[Index]
+                                     : j == 1 ? Map->Green[Index]
+                                     : Map->Blue[Index]);
+                Here[j + 3 * Step] += 7 * Error;
+                Below[j - 3 * Step] += 3 * Error;
+                Below[j] += 5 * Error;
+                Below[j + 3 * Step] += Error;
+            }
+        }
+        Swap = This;
+        This = Next;
+        Next = Swap;
+    }
+    if (This != Errors)
+        memcpy(Errors, This, RowSize * sizeof(int));
+}
+
+/******************************************************************************
+ Map Rows rows of Width pixels read through Source, which are rows Top
+ onward of an image, dithering them as Dither says; pixels with less
+ alpha than AlphaThreshold get TransparentIndex.  An image can so be
+ mapped a band at a time, top to bottom, with the same result as all at
+ once.  Errors carries Floyd-Steinberg error from band to band, as for
+ DitherFloydSteinberg(); it is not used by the other dithers, and may be
+ NULL for them.  Returns GIF_ERROR if Dither is unknown.
+******************************************************************************/
+int
+_GifDitherPaletteRows(const GifPaletteMapType *Map, int Dither,
+                      unsigned int Width, unsigned int Top,
+                      unsigned int Rows, const GifPixelSourceType *Source,
+                      int AlphaThreshold, int TransparentIndex,
+                      int *Errors, GifByteType *OutputBuffer)
+{
+    switch (Dither) {
+    case GIF_DITHER_NONE:
+        MapSource(Map, Width, 0, Rows, Source,
+                  AlphaThreshold, TransparentIndex, OutputBuffer);
+        return GIF_OK;
+    case GIF_DITHER_FLOYD_STEINBERG:
+        DitherFloydSteinberg(Map, Top, Width, Rows, Source,
+                             AlphaThreshold, TransparentIndex,
+                             Errors, OutputBuffer);
+        return GIF_OK;
+    case GIF_DITHER_BAYER:
+        DitherOrdered(Map, Bayer, 8, Top, Width, 0, Rows, Source,
+                      AlphaThreshold, TransparentIndex, OutputBuffer);
+        return GIF_OK;
+    case GIF_DITHER_BLUE_NOISE:
+        DitherOrdered(Map, BlueNoise, 32, Top, Width, 0, Rows, Source,
+                      AlphaThreshold, TransparentIndex, OutputBuffer);
+        return GIF_OK;
+    default:
+        return GIF_ERROR;
+    }
+}
+
+/******************************************************************************
+ Map a Width by Height image read through Source, dithering it as Dither
+ says; pixels with less alpha than AlphaThreshold get TransparentIndex.
+ Returns GIF_ERROR if memory is exhausted or Dither is unknown.
+******************************************************************************/
+int
+_GifDitherPaletteSource(const GifPaletteMapType *Map, int Dither,
+                        unsigned int Width, unsigned int Height,
+                        const GifPixelSourceType *Source,
+                        int AlphaThreshold, int TransparentIndex,
+                        GifByteType *OutputBuffer)
+{
+    int *Errors = NULL, Status;
+
+    if (Dither == GIF_DITHER_FLOYD_STEINBERG) {
+        Errors = (int *)calloc(_GIF_DITHER_ERRORS(Width), sizeof(int));
+        if (Errors == NULL)
+            return GIF_ERROR;
+    }
+    Status = _GifDitherPaletteRows(Map, Dither, Width, 0, Height, Source,
+                                   AlphaThreshold, TransparentIndex,
+                                   Errors, OutputBuffer);
+    free(Errors);
+
+    return Status;
+}
+
+/******************************************************************************
+ Like GifMapPaletteBuffer(), but the Width by Height image is dithered as
+ it is mapped, as Dither says: GIF_DITHER_NONE, GIF_DITHER_FLOYD_STEINBERG,
+ GIF_DITHER_BAYER or GIF_DITHER_BLUE_NOISE.  Returns GIF_ERROR if memory
+ is exhausted or Dither is unknown.
+******************************************************************************/
+int
+GifDitherPaletteBuffer(const GifPaletteMapType *Map, int Dither,
+                       unsigned int Width, unsigned int Height,
+                       const GifByteType *RedInput,
+                       const GifByteType *GreenInput,
+                       const GifByteType *BlueInput,
+                       GifByteType *OutputBuffer)
+{
+    GifPixelSourceType Source;
+
+    if (Dither == GIF_DITHER_NONE) {
+        GifMapPaletteBuffer(Map, (unsigned long)Width * Height,
+                            RedInput, GreenInput, BlueInput, OutputBuffer);
+        return GIF_OK;
+    }
+    _GifPlanarSource(&Source, RedInput, GreenInput, BlueInput, Width);
+    return _GifDitherPaletteSource(Map, Dither, Width, Height, &Source,
+                                   0, 0, OutputBuffer);
+}
+
+/******************************************************************************
+ GifDitherPaletteBuffer() for interleaved pixels: Height rows of Width
+ pixels laid out as Format says (GIF_PIXELS_RGB24, GIF_PIXELS_RGBA32 or
+ GIF_PIXELS_BGRA32), each row starting Stride bytes after the last.
+ Pixels with an alpha below AlphaThreshold are left out of the dithering
+ and given TransparentIndex instead.  Returns GIF_ERROR if memory is
+ exhausted or Dither or Format is unknown.
+******************************************************************************/
+int
+GifDitherPalettePixels(const GifPaletteMapType *Map, int Dither,
+                       unsigned int Width, unsigned int Height,
+                       const GifByteType *Pixels, int Format,
+                       size_t Stride, int AlphaThreshold,
+                       int TransparentIndex,
+                       GifByteType *OutputBuffer)
+{
+    GifPixelSourceType Source;
+
+    if (_GifInterleavedSource(&Source, Pixels, Format, Stride) == GIF_ERROR)
+        return GIF_ERROR;
+    return _GifDitherPaletteSource(Map, Dither, Width, Height, &Source,
+                                   AlphaThreshold, TransparentIndex,
+                                   OutputBuffer);
+}
+
+/* end */
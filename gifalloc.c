@@ -307,6 +307,8 @@ FreeLastSavedImage(GifFileType *GifFile)
     /* Deallocate the image data */
     if (sp->RasterBits != NULL)
         free((char *)sp->RasterBits);
+    free(sp->CompressedBits);
+    free(sp->CompressedRaster);
 
     /* Deallocate any extensions */
     GifFreeExtensions(&sp->ExtensionBlockCount, &sp->ExtensionBlocks);
@@ -341,6 +343,8 @@ GifMakeSavedImage(GifFileType *GifFile, const SavedImage *CopyFrom)
 
         if (CopyFrom != NULL) {
             memcpy((char *)sp, CopyFrom, sizeof(SavedImage));
+            sp->CompressedBits = NULL;
+            sp->CompressedRaster = NULL;
 
             /* 
              * Make our own allocated copies of the heap fields in the
@@ -372,6 +376,28 @@ GifMakeSavedImage(GifFileType *GifFile, const SavedImage *CopyFrom)
                    sizeof(GifPixelType) * CopyFrom->ImageDesc.Height *
                    CopyFrom->ImageDesc.Width);
 
+            /* then the compressed data, if the image has it */
+            if (CopyFrom->CompressedBits != NULL) {
+                sp->CompressedBits = (GifByteType *)malloc(
+                                     CopyFrom->CompressedLength);
+                if (CopyFrom->CompressedRaster != NULL)
+                    sp->CompressedRaster = (GifByteType *)malloc(
+                                         CopyFrom->CompressedPixels);
+                if (sp->CompressedBits == NULL
+                    || (CopyFrom->CompressedRaster != NULL
+                        && sp->CompressedRaster == NULL)) {
+                    sp->ExtensionBlockCount = 0;
+                    sp->ExtensionBlocks = NULL;
+                    FreeLastSavedImage(GifFile);
+                    return (SavedImage *)(NULL);
+                }
+                memcpy(sp->CompressedBits, CopyFrom->CompressedBits,
+                       CopyFrom->CompressedLength);
+                if (CopyFrom->CompressedRaster != NULL)
+                    memcpy(sp->CompressedRaster, CopyFrom->CompressedRaster,
+                           CopyFrom->CompressedPixels);
+            }
+
             /* finally, the extension blocks */
             if (CopyFrom->ExtensionBlocks != NULL) {
                 sp->ExtensionBlocks = (ExtensionBlock *)reallocarray(NULL,
@@ -410,6 +436,8 @@ GifFreeSavedImages(GifFileType *GifFile)
 
         if (sp->RasterBits != NULL)
             free((char *)sp->RasterBits);
+        free(sp->CompressedBits);
+        free(sp->CompressedRaster);
 	
 	GifFreeExtensions(&sp->ExtensionBlockCount, &sp->ExtensionBlocks);
     }
@@ -6,15 +6,15 @@ Sequentially read GIF records from stdin, process them, send them out.
 Most of the junk above `int main' isn't needed for the skeleton, but
 is likely to be for what you'll do with it.
 
-If you compile this, it will turn into an expensive GIF copying routine;
-stdin to stdout with no changes and minimal validation.  Well, it's a
-decent test of the low-level routines, anyway.
+If you compile this, it will turn into a GIF copying routine; stdin to
+stdout with no changes and minimal validation.  Well, it's a decent test
+of the low-level routines, anyway.
 
-Note: due to the vicissitudes of Lempel-Ziv compression, the output of this
-copier may not be bitwise identical to its input.  This can happen if you
-copy an image from a much more (or much *less*) memory-limited system; your
-compression may use more (or fewer) bits.  The uncompressed rasters should,
-however, be identical (you can check this with gifbuild -d).
+Images are moved as compressed data with DGifGetCompressedImage() and
+EGifPutCompressedImage(), so their LZW data comes out byte for byte as it
+went in, and dropping, reordering or splicing in images costs no LZW work
+at all.  Decode with DGifGetLine() and encode with EGifPutLine() instead if
+you need to get at the pixels.
 
 SPDX-License-Identifier: MIT
 
@@ -53,8 +53,9 @@ int main(int argc, char **argv)
 {
     GifFileType *GifFileIn = NULL, *GifFileOut = NULL;
     GifRecordType RecordType;
-    int CodeSize, ExtCode, ErrorCode;
-    GifByteType *CodeBlock, *Extension;
+    int ExtCode, ErrorCode;
+    GifByteType *Extension, *Data;
+    size_t DataLen;
 
     /*
      * Command-line processing goes here.
@@ -88,24 +89,17 @@ int main(int argc, char **argv)
 	    case IMAGE_DESC_RECORD_TYPE:
 		if (DGifGetImageDesc(GifFileIn) == GIF_ERROR)
 		    QuitGifError(GifFileIn, GifFileOut);
-		/* Put image descriptor to out file: */
-		if (EGifPutImageDesc(GifFileOut,
-		    GifFileIn->Image.Left, GifFileIn->Image.Top,
-		    GifFileIn->Image.Width, GifFileIn->Image.Height,
-		    GifFileIn->Image.Interlace,
-		    GifFileIn->Image.ColorMap) == GIF_ERROR)
-		    QuitGifError(GifFileIn, GifFileOut);
 
-		/* Now read image itself in decoded form as we dont really   */
-		/* care what we have there, and this is much faster.	     */
-		if (DGifGetCode(GifFileIn, &CodeSize, &CodeBlock) == GIF_ERROR ||
-		    EGifPutCode(GifFileOut, CodeSize, CodeBlock) == GIF_ERROR)
+		/* Now read image itself in compressed form as we dont really */
+		/* care what we have there, and put it out with its descriptor. */
+		if (DGifGetCompressedImage(GifFileIn, &Data, &DataLen) == GIF_ERROR)
 		    QuitGifError(GifFileIn, GifFileOut);
-		while (CodeBlock != NULL) {
-		    if (DGifGetCodeNext(GifFileIn, &CodeBlock) == GIF_ERROR ||
-			EGifPutCodeNext(GifFileOut, CodeBlock) == GIF_ERROR)
+		if (EGifPutCompressedImage(GifFileOut, &GifFileIn->Image,
+					   Data, DataLen) == GIF_ERROR) {
+		    free(Data);
 		    QuitGifError(GifFileIn, GifFileOut);
 		}
+		free(Data);
 		break;
 	    case EXTENSION_RECORD_TYPE:
 		/* pass through extension records */
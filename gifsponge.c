@@ -6,15 +6,17 @@ Slurp a GIF into core, operate on it, spew it out again.  Most of the
 junk above `int main' isn't needed for the skeleton, but is likely to
 be for what you'll do with it.
 
-If you compile this, it will turn into an expensive GIF copying routine;
-stdin to stdout with no changes and minimal validation.  Well, it's a
-decent test of DGifSlurp() and EGifSpew(), anyway.
-
-Note: due to the vicissitudes of Lempel-Ziv compression, the output of this
-copier may not be bitwise identical to its input.  This can happen if you
-copy an image from a much more (or much *less*) memory-limited system; your
-compression may use more (or fewer) bits.  The uncompressed rasters should,
-however, be identical (you can check this with gifbuild -d).
+If you compile this, it will turn into a GIF copying routine; stdin to
+stdout with no changes and minimal validation.  Well, it's a decent test
+of DGifSlurp() and EGifSpewParallel(), anyway.
+
+The input is slurped with DGifSetKeepCompressed() on, so images whose
+rasters you don't touch are written out with the LZW data they came in
+with, and only the ones you change are compressed again.  Without it,
+every image would be recompressed, and due to the vicissitudes of
+Lempel-Ziv compression the output might not be bitwise identical to the
+input, though the uncompressed rasters would be (you can check this with
+gifbuild -d).
 
 SPDX-License-Identifier: MIT
 
@@ -39,6 +41,8 @@ int main(int argc, char **argv)
 	PrintGifError(ErrorCode);
 	exit(EXIT_FAILURE);
     }
+    /* Images left alone below then needn't be compressed again. */
+    (void)DGifSetKeepCompressed(GifFileIn, true);
     if (DGifSlurp(GifFileIn) == GIF_ERROR) {
 	PrintGifError(GifFileIn->Error);
 	exit(EXIT_FAILURE);
@@ -71,11 +75,11 @@ int main(int argc, char **argv)
      * Note: don't do DGifCloseFile early, as this will
      * deallocate all the memory containing the GIF data!
      *
-     * Further note: EGifSpew() doesn't try to validity-check any of this
+     * Further note: EGifSpewParallel() doesn't try to validity-check any of this
      * data; it's *your* responsibility to keep your changes consistent.
      * Caveat hacker!
      */
-    if (EGifSpew(GifFileOut) == GIF_ERROR)
+    if (EGifSpewParallel(GifFileOut, 0) == GIF_ERROR)
 	PrintGifError(GifFileOut->Error);
 
     if (DGifCloseFile(GifFileIn, &ErrorCode) == GIF_ERROR)
@@ -94,6 +94,164 @@ struct operation {
     };
 };
 
+/*
+ * Edits that touch nothing but the screen descriptor, image descriptors
+ * and graphics control blocks leave the pixels alone, so for those the
+ * frames are carried through as the LZW data they came in as rather
+ * than decoded and compressed again.
+ */
+struct rawimage {
+    GifByteType *data;	/* as DGifGetCompressedImage() gives it */
+    size_t len;
+};
+
+/* like DGifSlurp(), but keep each image's compressed data, not its raster */
+static int rawslurp(GifFileType *GifFile, struct rawimage **raw)
+{
+    GifRecordType RecordType;
+    GifByteType *ExtData;
+    int ExtFunction;
+
+    *raw = NULL;
+    do {
+	if (DGifGetRecordType(GifFile, &RecordType) == GIF_ERROR)
+	    return GIF_ERROR;
+
+	switch (RecordType) {
+	case IMAGE_DESC_RECORD_TYPE:
+	{
+	    SavedImage *sp;
+	    struct rawimage *rp;
+
+	    if (DGifGetImageDesc(GifFile) == GIF_ERROR)
+		return GIF_ERROR;
+	    sp = &GifFile->SavedImages[GifFile->ImageCount - 1];
+	    rp = (struct rawimage *)realloc(*raw,
+			GifFile->ImageCount * sizeof(struct rawimage));
+	    if (rp == NULL) {
+		GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+		return GIF_ERROR;
+	    }
+	    *raw = rp;
+	    rp += GifFile->ImageCount - 1;
+	    if (DGifGetCompressedImage(GifFile, &rp->data, &rp->len) == GIF_ERROR)
+		return GIF_ERROR;
+
+	    if (GifFile->ExtensionBlocks) {
+		sp->ExtensionBlocks = GifFile->ExtensionBlocks;
+		sp->ExtensionBlockCount = GifFile->ExtensionBlockCount;
+
+		GifFile->ExtensionBlocks = NULL;
+		GifFile->ExtensionBlockCount = 0;
+	    }
+	    break;
+	}
+
+	case EXTENSION_RECORD_TYPE:
+	    if (DGifGetExtension(GifFile, &ExtFunction, &ExtData) == GIF_ERROR)
+		return GIF_ERROR;
+	    if (ExtData != NULL
+		&& GifAddExtensionBlock(&GifFile->ExtensionBlockCount,
+					&GifFile->ExtensionBlocks,
+					ExtFunction, ExtData[0],
+					&ExtData[1]) == GIF_ERROR)
+		return GIF_ERROR;
+	    for (;;) {
+		if (DGifGetExtensionNext(GifFile, &ExtData) == GIF_ERROR)
+		    return GIF_ERROR;
+		if (ExtData == NULL)
+		    break;
+		if (GifAddExtensionBlock(&GifFile->ExtensionBlockCount,
+					 &GifFile->ExtensionBlocks,
+					 CONTINUE_EXT_FUNC_CODE,
+					 ExtData[0], &ExtData[1]) == GIF_ERROR)
+		    return GIF_ERROR;
+	    }
+	    break;
+
+	default:
+	    break;
+	}
+    } while (RecordType != TERMINATE_RECORD_TYPE);
+
+    if (GifFile->ImageCount == 0) {
+	GifFile->Error = D_GIF_ERR_NO_IMAG_DSCR;
+	return GIF_ERROR;
+    }
+
+    return GIF_OK;
+}
+
+static int putextensions(GifFileType *GifFile,
+			 ExtensionBlock *blocks, int count)
+{
+    int j;
+
+    for (j = 0; j < count; j++) {
+	ExtensionBlock *ep = &blocks[j];
+
+	if (ep->Function != CONTINUE_EXT_FUNC_CODE
+	    && EGifPutExtensionLeader(GifFile, ep->Function) == GIF_ERROR)
+	    return GIF_ERROR;
+	if (EGifPutExtensionBlock(GifFile, ep->ByteCount, ep->Bytes) == GIF_ERROR)
+	    return GIF_ERROR;
+	if ((j == count - 1 || ep[1].Function != CONTINUE_EXT_FUNC_CODE)
+	    && EGifPutExtensionTrailer(GifFile) == GIF_ERROR)
+	    return GIF_ERROR;
+    }
+
+    return GIF_OK;
+}
+
+/* the counterpart of EGifSpew() for images read by rawslurp() */
+static int rawspew(GifFileType *GifFileIn, struct rawimage *raw,
+		   GifFileType *GifFileOut)
+{
+    int i;
+
+    GifFileOut->AspectByte = GifFileIn->AspectByte;
+    EGifSetGifVersion(GifFileOut,
+		      strcmp(EGifGetGifVersion(GifFileIn), GIF89_STAMP) == 0);
+    if (EGifPutScreenDesc(GifFileOut,
+			  GifFileIn->SWidth, GifFileIn->SHeight,
+			  GifFileIn->SColorResolution,
+			  GifFileIn->SBackGroundColor,
+			  GifFileIn->SColorMap) == GIF_ERROR)
+	return GIF_ERROR;
+
+    for (i = 0; i < GifFileIn->ImageCount; i++) {
+	SavedImage *sp = &GifFileIn->SavedImages[i];
+
+	if (putextensions(GifFileOut,
+			  sp->ExtensionBlocks,
+			  sp->ExtensionBlockCount) == GIF_ERROR)
+	    return GIF_ERROR;
+	if (EGifPutCompressedImage(GifFileOut, &sp->ImageDesc,
+				   raw[i].data, raw[i].len) == GIF_ERROR)
+	    return GIF_ERROR;
+    }
+
+    if (putextensions(GifFileOut,
+		      GifFileIn->ExtensionBlocks,
+		      GifFileIn->ExtensionBlockCount) == GIF_ERROR)
+	return GIF_ERROR;
+
+    return EGifCloseFile(GifFileOut, NULL);
+}
+
+/* write out a GIF that was encoded into memory, if it was */
+static void putmemory(GifByteType *buffer, size_t size)
+{
+    if (buffer == NULL)
+	return;
+    if (fwrite(buffer, 1, size, stdout) != size)
+    {
+	(void) fprintf(stderr, "giftool: write failed.\n");
+	exit(EXIT_FAILURE);
+    }
+    free(buffer);
+}
+
 int main(int argc, char **argv)
 {
     extern char	*optarg;	/* set by getopt */
@@ -101,7 +259,13 @@ int main(int argc, char **argv)
     struct operation operations[MAX_OPERATIONS];
     struct operation *top = operations;
     int selected[MAX_IMAGES], nselected = 0;
-    bool have_selection = false;
+    bool have_selection = false, optimize = false;
+    bool recode = false;
+    long writebuffer = -1, memory = -1;
+    GifByteType *outbuf = NULL;
+    size_t outsize = 0;
+    GifEncoderOptions options;
+    struct rawimage *raw = NULL;
     char *cp;
     int	i, status, ErrorCode;
     GifFileType *GifFileIn, *GifFileOut = (GifFileType *)NULL;
@@ -112,7 +276,8 @@ int main(int argc, char **argv)
      * getopt(3) here rather than Gershom's argument getter because
      * preserving the order of operations is important.
      */
-    while ((status = getopt(argc, argv, "a:b:d:f:i:n:p:s:u:x:")) != EOF)
+    EGifDefaultEncoderOptions(&options);
+    while ((status = getopt(argc, argv, "a:b:Cc:d:f:i:Ll:M:m:n:OS:p:s:u:w:x:")) != EOF)
     {
 	if (top >= operations + MAX_OPERATIONS) {
 	    (void)fprintf(stderr, "giftool: too many operations.");
@@ -131,6 +296,61 @@ int main(int argc, char **argv)
 	    top->color = atoi(optarg);
 	    break;
 
+	case 'c':
+	    /* an encoder setting, not an operation */
+	    if (strcmp(optarg, "full") == 0)
+		options.ClearPolicy = GIF_CLEAR_WHEN_FULL;
+	    else if (strcmp(optarg, "deferred") == 0)
+		options.ClearPolicy = GIF_CLEAR_DEFERRED;
+	    else if (strcmp(optarg, "adaptive") == 0)
+		options.ClearPolicy = GIF_CLEAR_ADAPTIVE;
+	    else {
+		(void)fprintf(stderr,
+			      "giftool: %s is not a valid clear policy.\n",
+			      optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    recode = true;
+	    continue;
+
+	case 'm':
+	    /* also an encoder setting */
+	    options.MaxCodeBits = atoi(optarg);
+	    recode = true;
+	    continue;
+
+	case 'M':
+	    /* encode into memory, in a buffer of this size or a growing one */
+	    memory = atol(optarg);
+	    if (memory < 0)
+	    {
+		(void) fprintf(stderr, "giftool: negative buffer size.\n");
+		exit(EXIT_FAILURE);
+	    }
+	    continue;
+
+	case 'C':
+	    /* another encoder setting */
+	    options.TrimColorMaps = true;
+	    recode = true;
+	    continue;
+
+	case 'l':
+	    /* lossy coding is an encoder setting too */
+	    options.LossyError = atoi(optarg);
+	    recode = true;
+	    continue;
+
+	case 'L':
+	    options.LossyDiffuse = true;
+	    continue;
+
+	case 'S':
+	    /* strips are compressed in parallel, so they're an encoder setting */
+	    options.StripHeight = atoi(optarg);
+	    recode = true;
+	    continue;
+
 	case 'd':
 	    top->mode = delaytime;
 	    top->delay = atoi(optarg);
@@ -144,6 +364,7 @@ int main(int argc, char **argv)
 	case 'i':
 	    top->mode = interlace;
 	    top->flag = getbool(optarg);
+	    recode = true;	/* the rows go out in another order */
 	    break;
 
 	case 'n':
@@ -167,7 +388,13 @@ int main(int argc, char **argv)
 		(void) fprintf(stderr, "giftool: bad selection.\n");
 		exit(EXIT_FAILURE);
 	    }
-	    break;
+	    continue;	/* applies to all the operations, not an operation */
+
+	case 'O':
+	    /* applies to the whole animation, after the operations */
+	    optimize = true;
+	    recode = true;
+	    continue;
 
 	case 'p':
 	case 's':
@@ -195,32 +422,59 @@ int main(int argc, char **argv)
 	    top->flag = getbool(optarg);
 	    break;
 
+	case 'w':
+	    /* how output is written, not what */
+	    writebuffer = atol(optarg);
+	    if (writebuffer < 0)
+	    {
+		(void) fprintf(stderr, "giftool: negative buffer size.\n");
+		exit(EXIT_FAILURE);
+	    }
+	    continue;
+
 	case 'x':
 	    top->mode = disposal;
 	    top->dispose = atoi(optarg);
 	    break;
 
 	default:
-	    fprintf(stderr, "usage: giftool [-b color] [-d delay] [-iI] [-t color] -[uU] [-x disposal]\n");
+	    fprintf(stderr, "usage: giftool [-b color] [-C] [-c clear] [-d delay] [-iI] [-M bytes] [-m bits] [-O] [-S rows] [-t color] -[uU] [-w bytes] [-x disposal]\n");
 	    break;
 	}
 
 	++top;
     }	
 
-    /* read in a GIF */
+    /* read in a GIF, without decoding it if the rasters aren't needed */
     if ((GifFileIn = DGifOpenFileHandle(0, &ErrorCode)) == NULL) {
 	PrintGifError(ErrorCode);
 	exit(EXIT_FAILURE);
     }
-    if (DGifSlurp(GifFileIn) == GIF_ERROR) {
+    if ((recode ? DGifSlurp(GifFileIn) : rawslurp(GifFileIn, &raw))
+	== GIF_ERROR) {
 	PrintGifError(GifFileIn->Error);
 	exit(EXIT_FAILURE);
     }
-    if ((GifFileOut = EGifOpenFileHandle(1, &ErrorCode)) == NULL) {
+    if (memory > 0)
+    {
+	outsize = (size_t)memory;
+	if ((outbuf = (GifByteType *)malloc(outsize)) == NULL)
+	{
+	    (void) fprintf(stderr, "giftool: out of memory.\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    if ((GifFileOut = (memory >= 0)
+	 ? EGifOpenMemory(&outbuf, &outsize, &ErrorCode)
+	 : EGifOpenFileHandle(1, &ErrorCode)) == NULL) {
 	PrintGifError(ErrorCode);
 	exit(EXIT_FAILURE);
     }
+    if (writebuffer >= 0
+	&& EGifSetWriteBufferSize(GifFileOut, (size_t)writebuffer) == GIF_ERROR) {
+	PrintGifError(GifFileOut->Error);
+	exit(EXIT_FAILURE);
+    }
 
     /* if the selection is defaulted, compute it; otherwise bounds-check it */
     if (!have_selection)
@@ -239,6 +493,10 @@ int main(int argc, char **argv)
     for (op = operations; op < top; op++)
 	switch (op->mode)
 	{
+	case aspect:
+	    GifFileIn->AspectByte = op->numerator;
+	    break;
+
 	case background:
 	    GifFileIn->SBackGroundColor = op->color; 
 	    break;
@@ -555,7 +813,23 @@ int main(int argc, char **argv)
 	    exit(EXIT_FAILURE);
 	}
 
+    if (optimize && GifOptimizeAnimation(GifFileIn) == GIF_ERROR) {
+	PrintGifError(GifFileIn->Error);
+	exit(EXIT_FAILURE);
+    }
+
     /* write out the results */
+    if (!recode) {
+	if (rawspew(GifFileIn, raw, GifFileOut) == GIF_ERROR)
+	    PrintGifError(GifFileOut->Error);
+	else {
+	    putmemory(outbuf, outsize);
+	    if (DGifCloseFile(GifFileIn, &ErrorCode) == GIF_ERROR)
+		PrintGifError(ErrorCode);
+	}
+	return 0;
+    }
+    GifFileOut->AspectByte = GifFileIn->AspectByte;
     GifFileOut->SWidth = GifFileIn->SWidth;
     GifFileOut->SHeight = GifFileIn->SHeight;
     GifFileOut->SColorResolution = GifFileIn->SColorResolution;
@@ -568,10 +842,15 @@ int main(int argc, char **argv)
     for (i = 0; i < GifFileIn->ImageCount; i++)
 	(void) GifMakeSavedImage(GifFileOut, &GifFileIn->SavedImages[i]);
 
-    if (EGifSpew(GifFileOut) == GIF_ERROR)
+    (void)EGifSetEncoderOptions(GifFileOut, &options);
+    if ((options.StripHeight > 0
+	 ? EGifSpewParallel(GifFileOut, 0) : EGifSpew(GifFileOut)) == GIF_ERROR)
 	PrintGifError(GifFileOut->Error);
-    else if (DGifCloseFile(GifFileIn, &ErrorCode) == GIF_ERROR)
-	PrintGifError(ErrorCode);
+    else {
+	putmemory(outbuf, outsize);
+	if (DGifCloseFile(GifFileIn, &ErrorCode) == GIF_ERROR)
+	    PrintGifError(ErrorCode);
+    }
 
     return 0;
 }
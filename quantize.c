@@ -15,35 +15,542 @@ SPDX-License-Identifier: MIT
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <pthread.h>
+#endif /* _WIN32 */
 #include "gif_lib.h"
 #include "gif_lib_private.h"
+#include "getarg.h"
 
 #define ABS(x)    ((x) > 0 ? (x) : (-(x)))
 
-#define COLOR_ARRAY_SIZE 32768
-#define BITS_PER_PRIM_COLOR 5
-#define MAX_PRIM_COLOR      0x1f
-
-static int SortRGBAxis;
+#define DEFAULT_BITS_PER_PRIM_COLOR 5
+#define MAX_BITS_PER_PRIM_COLOR     8
+#define DENSE_BITS_PER_PRIM_COLOR   6   /* Beyond this, colors are hashed */
+#define HASH_START_BITS             12  /* log2 of a new hash's size */
+#define MAX_QUANTIZE_THREADS        64
+#define MIN_THREAD_PIXELS           65536   /* Not worth a thread for less */
+#define DITHER_BAND_ROWS            32  /* Ordered dither maps repeat this */
+#define MAX_BUILDER_COLORS          (1L << 18)  /* Before precision is cut */
+#define DRIFT_SAMPLES               4096    /* Pixels a map is tried on */
 
 typedef struct QuantizedColorType {
     GifByteType RGB[3];
     GifByteType NewColorIndex;
-    long Count;
-    struct QuantizedColorType *Pnext;
+    uint32_t Key;        /* RGB packed together */
+    unsigned long Count; /* Pixels of this color; 0 for an empty slot */
 } QuantizedColorType;
 
+/*
+ * The colors sampled, at the chosen precision.  Up to 6 bits per primary
+ * this is a plain array over the whole color cube, indexed by Key; beyond
+ * that the cube would be too big, so only the colors actually seen are
+ * kept, in a hash table that grows as they turn up.
+ */
+typedef struct ColorTableType {
+    QuantizedColorType *Entries;
+    unsigned long Size;          /* Entries allocated, a power of 2 */
+    unsigned long NumEntries;    /* Distinct colors sampled */
+    int Bits;                    /* Per primary color */
+    int HashShift;               /* 32 less log2(Size) */
+    bool Dense;                  /* Entries is indexed by Key */
+    uint32_t KeyPart[3][256];    /* Each primary's share of a Key */
+} ColorTableType;
+
+/* One thread's share of a pass over the pixels. */
+typedef struct QuantizeJobType {
+    ColorTableType *Table;       /* Job 0 samples into this; all map by it */
+    ColorTableType Own;          /* Other jobs sample a hashed table here */
+    uint32_t *Counts;            /* ...and a dense table here */
+    const GifPixelSourceType *Source;
+    int AlphaThreshold;          /* Less alpha than this is transparent */
+    unsigned long Transparent;   /* Transparent pixels sampled */
+    GifByteType *Output;
+    const GifColorType *ColorMap;
+    int TransparentIndex;
+    const GifPaletteMapType *PaletteMap;   /* Map by this, if not NULL */
+    int Dither;
+    unsigned int Width;
+    unsigned int First, Last;    /* Rows */
+    int MaxRGBError[3];
+    int Status;
+} QuantizeJobType;
+
+/* Colors sampled from many images, to choose one color map for them all. */
+struct GifPaletteBuilderType {
+    GifQuantizeOptions Options;
+    ColorTableType Table;
+    unsigned long Transparent;       /* Transparent pixels sampled */
+    GifPaletteMapType *PaletteMap;   /* Onto the colors, once chosen */
+    int TransparentIndex;
+};
+
+/* A color map a frame quantizer may draw frames with. */
+typedef struct FrameMapType {
+    ColorMapObject *ColorMap;        /* NULL until one is chosen */
+    GifPaletteMapType *PaletteMap;   /* Onto its colors */
+    int TransparentIndex;
+    double Error;                    /* RMS error on the frame it was for */
+} FrameMapType;
+
+/* Quantizes a run of frames, keeping a color map while it still fits. */
+struct GifFrameQuantizerType {
+    GifPaletteBuilderType *Builder;  /* Samples the frames colors are for */
+    FrameMapType Global;             /* The first colors chosen */
+    FrameMapType Local;              /* The last, if chosen since */
+    int ColorMapSize;                /* Most colors to choose */
+    double MaxDrift;                 /* RMS error it may gain, in levels */
+};
+
 typedef struct NewColorMapType {
     GifByteType RGBMin[3], RGBWidth[3];
-    unsigned int NumEntries; /* # of QuantizedColorType in linked list below */
+    unsigned int First;  /* Where the box's colors start in the color list */
+    unsigned int NumEntries; /* # of QuantizedColorType in the box */
     unsigned long Count; /* Total number of pixels in all the entries */
-    QuantizedColorType *QuantizedColors;
 } NewColorMapType;
 
 static int SubdivColorMap(NewColorMapType * NewColorSubdiv,
                           unsigned int ColorMapSize,
-                          unsigned int *NewColorMapSize);
-static int SortCmpRtn(const void *Entry1, const void *Entry2);
+                          unsigned int *NewColorMapSize,
+                          QuantizedColorType **ColorList,
+                          QuantizedColorType **Scratch,
+                          int Bits);
+
+#define COLOR_KEY(Table, Red, Green, Blue) \
+    ((Table)->KeyPart[0][Red] | (Table)->KeyPart[1][Green] | \
+     (Table)->KeyPart[2][Blue])
+#define COLOR_HASH(Key, Shift)  (((uint32_t)(Key) * 2654435761U) >> (Shift))
+
+/******************************************************************************
+ Make an empty color table for Bits bits per primary color.
+******************************************************************************/
+static int
+ColorTableInit(ColorTableType *Table, int Bits)
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        Table->KeyPart[0][i] = ((uint32_t)i >> (8 - Bits)) << (2 * Bits);
+        Table->KeyPart[1][i] = ((uint32_t)i >> (8 - Bits)) << Bits;
+        Table->KeyPart[2][i] = (uint32_t)i >> (8 - Bits);
+    }
+    Table->Bits = Bits;
+    Table->Dense = (Bits <= DENSE_BITS_PER_PRIM_COLOR);
+    Table->Size = 1UL << (Table->Dense ? 3 * Bits : HASH_START_BITS);
+    Table->HashShift = 32 - HASH_START_BITS;
+    Table->NumEntries = 0;
+    Table->Entries = (QuantizedColorType *)calloc(Table->Size,
+                                                  sizeof(QuantizedColorType));
+
+    return Table->Entries != NULL ? GIF_OK : GIF_ERROR;
+}
+
+/******************************************************************************
+ Double a hashed color table.
+******************************************************************************/
+static int
+ColorTableGrow(ColorTableType *Table)
+{
+    QuantizedColorType *Old = Table->Entries;
+    unsigned long i, Slot, OldSize = Table->Size;
+
+    Table->Entries = (QuantizedColorType *)calloc(2 * OldSize,
+                                                  sizeof(QuantizedColorType));
+    if (Table->Entries == NULL) {
+        Table->Entries = Old;
+        return GIF_ERROR;
+    }
+    Table->Size = 2 * OldSize;
+    Table->HashShift--;
+    for (i = 0; i < OldSize; i++)
+        if (Old[i].Count > 0) {
+            Slot = COLOR_HASH(Old[i].Key, Table->HashShift);
+            while (Table->Entries[Slot].Count > 0)
+                Slot = (Slot + 1) & (Table->Size - 1);
+            Table->Entries[Slot] = Old[i];
+        }
+    free((char *)Old);
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Find the entry for color Key in a hashed table, if it has been sampled,
+ else NULL.
+******************************************************************************/
+static QuantizedColorType *
+ColorTableFind(const ColorTableType *Table, uint32_t Key)
+{
+    unsigned long Slot;
+
+    for (Slot = COLOR_HASH(Key, Table->HashShift);
+         Table->Entries[Slot].Count > 0;
+         Slot = (Slot + 1) & (Table->Size - 1))
+        if (Table->Entries[Slot].Key == Key)
+            return &Table->Entries[Slot];
+    return NULL;
+}
+
+/******************************************************************************
+ Set up Entry as the one for color Key.
+******************************************************************************/
+static void
+ColorTableSetKey(ColorTableType *Table, QuantizedColorType *Entry,
+                 uint32_t Key)
+{
+    uint32_t Mask = (1U << Table->Bits) - 1;
+
+    Entry->Key = Key;
+    Entry->RGB[0] = Key >> (2 * Table->Bits);
+    Entry->RGB[1] = (Key >> Table->Bits) & Mask;
+    Entry->RGB[2] = Key & Mask;
+    Entry->NewColorIndex = 0;
+    Table->NumEntries++;
+}
+
+/******************************************************************************
+ Find the entry for color Key in a hashed table, making an empty one if
+ it's new.  Returns NULL if memory is exhausted.  The caller must count a
+ pixel in a new entry before adding another color.
+******************************************************************************/
+static QuantizedColorType *
+ColorTableAdd(ColorTableType *Table, uint32_t Key)
+{
+    unsigned long Slot;
+
+    if (2 * (Table->NumEntries + 1) > Table->Size
+        && ColorTableGrow(Table) == GIF_ERROR)
+        return NULL;
+    for (Slot = COLOR_HASH(Key, Table->HashShift);
+         Table->Entries[Slot].Count > 0
+             && Table->Entries[Slot].Key != Key;
+         Slot = (Slot + 1) & (Table->Size - 1))
+        continue;
+    if (Table->Entries[Slot].Count == 0)
+        ColorTableSetKey(Table, &Table->Entries[Slot], Key);
+
+    return &Table->Entries[Slot];
+}
+
+/******************************************************************************
+ A dense table's pixels are only counted as they are sampled; set up the
+ entries of the colors that turned up afterwards.
+******************************************************************************/
+static void
+ColorTableFillDense(ColorTableType *Table)
+{
+    unsigned long Key;
+
+    Table->NumEntries = 0;
+    for (Key = 0; Key < Table->Size; Key++)
+        if (Table->Entries[Key].Count > 0)
+            ColorTableSetKey(Table, &Table->Entries[Key], (uint32_t)Key);
+}
+
+/******************************************************************************
+ Halve the precision of a hashed color table, merging the colors that
+ then look alike, so that it takes less room.  Returns GIF_ERROR if memory
+ is exhausted, leaving the table as it was.
+******************************************************************************/
+static int
+ColorTableReduce(ColorTableType *Table)
+{
+    ColorTableType Coarser;
+    QuantizedColorType *Old, *New;
+    int Shift = 8 - Table->Bits;
+    unsigned long k;
+    uint32_t Key;
+
+    if (ColorTableInit(&Coarser, Table->Bits - 1) == GIF_ERROR)
+        return GIF_ERROR;
+    for (k = 0; k < Table->Size; k++) {
+        Old = &Table->Entries[k];
+        if (Old->Count == 0)
+            continue;
+        Key = COLOR_KEY(&Coarser, Old->RGB[0] << Shift, Old->RGB[1] << Shift,
+                        Old->RGB[2] << Shift);
+        if (Coarser.Dense)
+            New = &Coarser.Entries[Key];
+        else if ((New = ColorTableAdd(&Coarser, Key)) == NULL) {
+            free((char *)Coarser.Entries);
+            return GIF_ERROR;
+        }
+        New->Count += Old->Count;
+    }
+    if (Coarser.Dense)
+        ColorTableFillDense(&Coarser);
+
+    free((char *)Table->Entries);
+    *Table = Coarser;
+    return GIF_OK;
+}
+
+/******************************************************************************
+ The precision Options asks for, within what the color table can do.
+******************************************************************************/
+static int
+QuantizeBits(const GifQuantizeOptions *Options)
+{
+    if (Options->BitsPerPrimary < 1)
+        return 1;
+    if (Options->BitsPerPrimary > MAX_BITS_PER_PRIM_COLOR)
+        return MAX_BITS_PER_PRIM_COLOR;
+    return Options->BitsPerPrimary;
+}
+
+/******************************************************************************
+ How many threads to share a pass over a Width by Height image between:
+ as many as Options asks for, or one per online CPU if it asks for 0 or
+ less, but not so many that a thread gets little to do.
+******************************************************************************/
+static int
+QuantizeThreads(const GifQuantizeOptions *Options,
+                unsigned int Width, unsigned int Height)
+{
+#ifdef _WIN32
+    (void)Options;
+    (void)Width;
+    (void)Height;
+    return 1;
+#else
+    unsigned long Pixels = (unsigned long)Width * Height;
+    long Threads = Options->Threads;
+
+    if (Threads <= 0)
+        Threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (Threads > MAX_QUANTIZE_THREADS)
+        Threads = MAX_QUANTIZE_THREADS;
+    if ((unsigned long)Threads > Pixels / MIN_THREAD_PIXELS)
+        Threads = (long)(Pixels / MIN_THREAD_PIXELS);
+    /* The other threads' dense counts are 32 bits. */
+    if (Threads < 1
+        || (unsigned long)(Height / Threads + 1) * Width > UINT32_MAX)
+        Threads = 1;
+    return (int)Threads;
+#endif /* _WIN32 */
+}
+
+/******************************************************************************
+ Run Work on each of Count jobs, each on its own thread but the first,
+ which this thread does, and wait for them all.  A job whose thread can't
+ be started is done here too.
+******************************************************************************/
+static void
+RunJobs(void *(*Work)(void *), QuantizeJobType *Jobs, int Count)
+{
+    int i;
+#ifndef _WIN32
+    pthread_t Threads[MAX_QUANTIZE_THREADS];
+    bool Started[MAX_QUANTIZE_THREADS];
+
+    for (i = 1; i < Count; i++)
+        Started[i] = (pthread_create(&Threads[i], NULL, Work, &Jobs[i]) == 0);
+    (void)Work(&Jobs[0]);
+    for (i = 1; i < Count; i++)
+        if (Started[i])
+            (void)pthread_join(Threads[i], NULL);
+        else
+            (void)Work(&Jobs[i]);
+#else
+    for (i = 0; i < Count; i++)
+        (void)Work(&Jobs[i]);
+#endif /* _WIN32 */
+}
+
+/******************************************************************************
+ Count the colors of a job's rows.  The first job counts straight into
+ the shared color table; the others into their own, to be merged after.
+ A dense table is only counted in here, its colors filled in later.
+ Transparent pixels are only counted.
+******************************************************************************/
+static void *
+SampleColors(void *Arg)
+{
+    QuantizeJobType *Job = (QuantizeJobType *)Arg;
+    ColorTableType *Table = Job->Table;
+    const GifByteType *Red = Job->Source->Red, *Green = Job->Source->Green,
+        *Blue = Job->Source->Blue, *Alpha = Job->Source->Alpha;
+    size_t i, Step = Job->Source->Step;
+    uint32_t *Counts = Job->Counts;
+    QuantizedColorType *QuantizedColor = NULL;
+    uint32_t Key, LastKey = 0;
+    unsigned long Transparent = 0;
+    unsigned int x, y;
+
+    if (!Table->Dense && Job->Own.Entries != NULL)
+        Table = &Job->Own;
+    for (y = Job->First; y < Job->Last; y++) {
+        i = y * Job->Source->Stride;
+        if (Counts != NULL)
+            for (x = 0; x < Job->Width; x++, i += Step) {
+                if (Alpha != NULL && Alpha[i] < Job->AlphaThreshold)
+                    Transparent++;
+                else
+                    Counts[COLOR_KEY(Table, Red[i], Green[i], Blue[i])]++;
+            }
+        else if (Table->Dense)
+            for (x = 0; x < Job->Width; x++, i += Step) {
+                if (Alpha != NULL && Alpha[i] < Job->AlphaThreshold)
+                    Transparent++;
+                else
+                    Table->Entries[COLOR_KEY(Table, Red[i], Green[i],
+                                             Blue[i])].Count++;
+            }
+        else
+            for (x = 0; x < Job->Width; x++, i += Step) {
+                if (Alpha != NULL && Alpha[i] < Job->AlphaThreshold) {
+                    Transparent++;
+                    continue;
+                }
+                Key = COLOR_KEY(Table, Red[i], Green[i], Blue[i]);
+                if (QuantizedColor == NULL || Key != LastKey) {
+                    if ((QuantizedColor = ColorTableAdd(Table, Key)) == NULL) {
+                        Job->Status = GIF_ERROR;
+                        return NULL;
+                    }
+                    LastKey = Key;
+                }
+                QuantizedColor->Count++;
+            }
+    }
+
+    Job->Transparent = Transparent;
+    Job->Status = GIF_OK;
+    return NULL;
+}
+
+/******************************************************************************
+ Add what the other jobs counted into the first job's color table.  The
+ totals don't depend on how the pixels were shared out, and nothing after
+ depends on the order the colors are in, so the result is the same as
+ sampling on one thread.  Returns GIF_ERROR if memory is exhausted.
+******************************************************************************/
+static int
+MergeColors(ColorTableType *Table, const QuantizeJobType *Jobs, int Count)
+{
+    QuantizedColorType *QuantizedColor;
+    unsigned long k;
+    int i;
+
+    for (i = 1; i < Count; i++) {
+        if (Table->Dense)
+            for (k = 0; k < Table->Size; k++)
+                Table->Entries[k].Count += Jobs[i].Counts[k];
+        else
+            for (k = 0; k < Jobs[i].Own.Size; k++) {
+                if (Jobs[i].Own.Entries[k].Count == 0)
+                    continue;
+                QuantizedColor = ColorTableAdd(Table,
+                                               Jobs[i].Own.Entries[k].Key);
+                if (QuantizedColor == NULL)
+                    return GIF_ERROR;
+                QuantizedColor->Count += Jobs[i].Own.Entries[k].Count;
+            }
+    }
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Map a job's rows to the new colors: through the color table, or, if
+ dithering, through the palette map.
+******************************************************************************/
+static void *
+MapColors(void *Arg)
+{
+    QuantizeJobType *Job = (QuantizeJobType *)Arg;
+    const ColorTableType *Table = Job->Table;
+    const GifByteType *Red = Job->Source->Red, *Green = Job->Source->Green,
+        *Blue = Job->Source->Blue, *Alpha = Job->Source->Alpha;
+    size_t i, Step = Job->Source->Step;
+    GifByteType *Output;
+    const QuantizedColorType *QuantizedColor = NULL;
+    uint32_t Key, LastKey = 0;
+    unsigned int x, y;
+    int Index;
+
+    if (Job->PaletteMap != NULL) {
+        GifPixelSourceType Band = *Job->Source;
+
+        _GifSkipSourceRows(&Band, Job->First);
+        Job->Status = _GifDitherPaletteSource(Job->PaletteMap, Job->Dither,
+                                              Job->Width,
+                                              Job->Last - Job->First, &Band,
+                                              Job->AlphaThreshold,
+                                              Job->TransparentIndex,
+                                              Job->Output
+                                              + (size_t)Job->First
+                                                * Job->Width);
+        return NULL;
+    }
+
+    for (y = Job->First; y < Job->Last; y++) {
+        Output = Job->Output + (size_t)y * Job->Width;
+        for (x = 0, i = y * Job->Source->Stride; x < Job->Width;
+             x++, i += Step) {
+            if (Alpha != NULL && Alpha[i] < Job->AlphaThreshold) {
+                Output[x] = Job->TransparentIndex;
+                continue;
+            }
+            Key = COLOR_KEY(Table, Red[i], Green[i], Blue[i]);
+            if (Table->Dense)
+                QuantizedColor = &Table->Entries[Key];
+            else if (QuantizedColor == NULL || Key != LastKey) {
+                QuantizedColor = ColorTableFind(Table, Key);
+                LastKey = Key;
+            }
+            Index = QuantizedColor->NewColorIndex;
+            Output[x] = Index;
+#ifdef DEBUG
+            {
+                const GifColorType *Color = &Job->ColorMap[Index];
+                int *MaxRGBError = Job->MaxRGBError;
+
+                if (MaxRGBError[0] < ABS(Color->Red - Red[i]))
+                    MaxRGBError[0] = ABS(Color->Red - Red[i]);
+                if (MaxRGBError[1] < ABS(Color->Green - Green[i]))
+                    MaxRGBError[1] = ABS(Color->Green - Green[i]);
+                if (MaxRGBError[2] < ABS(Color->Blue - Blue[i]))
+                    MaxRGBError[2] = ABS(Color->Blue - Blue[i]);
+            }
+#endif /* DEBUG */
+        }
+    }
+
+    Job->Status = GIF_OK;
+    return NULL;
+}
+
+/******************************************************************************
+ Free what jobs other than the first sampled into.
+******************************************************************************/
+static void
+FreeJobs(QuantizeJobType *Jobs, int Count)
+{
+    int i;
+
+    for (i = 1; i < Count; i++) {
+        free((char *)Jobs[i].Own.Entries);
+        free((char *)Jobs[i].Counts);
+    }
+    free((char *)Jobs);
+}
+
+/******************************************************************************
+ Fill in the quantizer options the plain GifQuantizeBuffer() uses.
+******************************************************************************/
+void
+GifDefaultQuantizeOptions(GifQuantizeOptions *Options)
+{
+    memset(Options, '\0', sizeof(GifQuantizeOptions));
+    Options->BitsPerPrimary = DEFAULT_BITS_PER_PRIM_COLOR;
+    Options->Threads = 1;
+    Options->AlphaThreshold = 128;
+}
 
 /******************************************************************************
  Quantize high resolution image into lower one. Input image consists of a
@@ -55,6 +562,8 @@ static int SortCmpRtn(const void *Entry1, const void *Entry2);
  ColorMapSize specifies size of color map up to 256 and will be updated to
  real size before returning.
    Also non of the parameter are allocated by this routine.
+   All working storage is on the stack or the heap, so any number of
+ these may run at once.
    This function returns GIF_OK if successful, GIF_ERROR otherwise.
 ******************************************************************************/
 int
@@ -67,41 +576,143 @@ GifQuantizeBuffer(unsigned int Width,
                GifByteType * OutputBuffer,
                GifColorType * OutputColorMap) {
 
-    unsigned int Index, NumOfEntries;
-    int i, j, MaxRGBError[3];
-    unsigned int NewColorMapSize;
-    long Red, Green, Blue;
-    NewColorMapType NewColorSubdiv[256];
-    QuantizedColorType *ColorArrayEntries, *QuantizedColor;
+    GifQuantizeOptions Options;
 
-    ColorArrayEntries = (QuantizedColorType *)malloc(
-                           sizeof(QuantizedColorType) * COLOR_ARRAY_SIZE);
-    if (ColorArrayEntries == NULL) {
-        return GIF_ERROR;
+    GifDefaultQuantizeOptions(&Options);
+    return GifQuantizeBufferWithOptions(Width, Height, ColorMapSize,
+                                        RedInput, GreenInput, BlueInput,
+                                        OutputBuffer, OutputColorMap,
+                                        &Options);
+}
+
+/******************************************************************************
+ Set up Threads jobs to share a pass over the rows of a Width by Height
+ image read through Source.  If they are to sample into Table, the jobs
+ past the first get tables of their own to count into.  Returns NULL if
+ memory is exhausted.
+******************************************************************************/
+static QuantizeJobType *
+MakeJobs(ColorTableType *Table, int Threads,
+         unsigned int Width, unsigned int Height,
+         const GifPixelSourceType *Source, int AlphaThreshold)
+{
+    QuantizeJobType *Job;
+    int i;
+
+    Job = (QuantizeJobType *)calloc(Threads, sizeof(QuantizeJobType));
+    if (Job == NULL)
+        return NULL;
+    for (i = 0; i < Threads; i++) {
+        Job[i].Table = Table;
+        Job[i].Source = Source;
+        Job[i].AlphaThreshold = AlphaThreshold;
+        Job[i].TransparentIndex = NO_TRANSPARENT_COLOR;
+        Job[i].Width = Width;
+        Job[i].First = (unsigned long)Height * i / Threads;
+        Job[i].Last = (unsigned long)Height * (i + 1) / Threads;
+        if (i == 0 || Table == NULL)
+            continue;
+        if (Table->Dense)
+            Job[i].Counts = (uint32_t *)calloc(Table->Size, sizeof(uint32_t));
+        else if (ColorTableInit(&Job[i].Own, Table->Bits) == GIF_ERROR)
+            Job[i].Own.Entries = NULL;
+        if (Job[i].Counts == NULL && Job[i].Own.Entries == NULL) {
+            FreeJobs(Job, i + 1);
+            return NULL;
+        }
     }
 
-    for (i = 0; i < COLOR_ARRAY_SIZE; i++) {
-        ColorArrayEntries[i].RGB[0] = i >> (2 * BITS_PER_PRIM_COLOR);
-        ColorArrayEntries[i].RGB[1] = (i >> BITS_PER_PRIM_COLOR) &
-           MAX_PRIM_COLOR;
-        ColorArrayEntries[i].RGB[2] = i & MAX_PRIM_COLOR;
-        ColorArrayEntries[i].Count = 0;
+    return Job;
+}
+
+/******************************************************************************
+ Sample the colors of the jobs' rows into their table, adding the
+ transparent pixels among them to *Transparent.  Returns GIF_ERROR if
+ memory is exhausted.
+******************************************************************************/
+static int
+SampleJobs(QuantizeJobType *Jobs, int Count, unsigned long *Transparent)
+{
+    ColorTableType *Table = Jobs[0].Table;
+    int i;
+
+    RunJobs(SampleColors, Jobs, Count);
+    for (i = 0; i < Count; i++) {
+        if (Jobs[i].Status != GIF_OK)
+            return GIF_ERROR;
+        *Transparent += Jobs[i].Transparent;
     }
+    if (MergeColors(Table, Jobs, Count) == GIF_ERROR)
+        return GIF_ERROR;
+    if (Table->Dense)
+        ColorTableFillDense(Table);
 
-    /* Sample the colors and their distribution: */
-    for (i = 0; i < (int)(Width * Height); i++) {
-        Index = ((RedInput[i] >> (8 - BITS_PER_PRIM_COLOR)) <<
-                  (2 * BITS_PER_PRIM_COLOR)) +
-                ((GreenInput[i] >> (8 - BITS_PER_PRIM_COLOR)) <<
-                  BITS_PER_PRIM_COLOR) +
-                (BlueInput[i] >> (8 - BITS_PER_PRIM_COLOR));
-        ColorArrayEntries[Index].Count++;
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Map the jobs' rows onto PaletteMap, dithering as Dither says.  The jobs
+ take bands of rows that start where the ordered dither maps do, so the
+ result doesn't depend on how the rows are shared out; error diffusion
+ can only be done in one go.  Returns GIF_ERROR if memory is exhausted.
+******************************************************************************/
+static int
+DitherJobs(QuantizeJobType *Jobs, int Count,
+           const GifPaletteMapType *PaletteMap, int Dither,
+           unsigned int Height)
+{
+    unsigned long Band = (Height + Count - 1) / Count;
+    int i;
+
+    if (Dither == GIF_DITHER_FLOYD_STEINBERG)
+        Band = Height;
+    Band = (Band + DITHER_BAND_ROWS - 1) / DITHER_BAND_ROWS * DITHER_BAND_ROWS;
+    for (i = 0; i < Count; i++) {
+        if (Band * i >= Height)
+            break;
+        Jobs[i].PaletteMap = PaletteMap;
+        Jobs[i].Dither = Dither;
+        Jobs[i].First = Band * i;
+        Jobs[i].Last = Band * (i + 1) < Height ? Band * (i + 1) : Height;
     }
+    Count = i;
+
+    RunJobs(MapColors, Jobs, Count);
+    for (i = 0; i < Count; i++)
+        if (Jobs[i].Status != GIF_OK)
+            return GIF_ERROR;
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Choose up to MaxColors colors for the pixels sampled into Table by median
+ cut, put them in OutputColorMap and their number in *NewColorMapSize,
+ and note in each entry of Table which of them it is mapped to.  Returns
+ GIF_ERROR if memory is exhausted.
+******************************************************************************/
+static int
+ChooseColors(ColorTableType *Table, int MaxColors,
+             GifColorType *OutputColorMap, unsigned int *NewColorMapSize)
+{
+    unsigned int Index, NumOfEntries;
+    int i, j, Bits = Table->Bits;
+    unsigned long k, Pixels = 0;
+    long Red, Green, Blue;
+    NewColorMapType NewColorSubdiv[256];
+    QuantizedColorType *QuantizedColor, **ColorList, **Scratch;
+
+    ColorList = (QuantizedColorType **)malloc(
+                   sizeof(QuantizedColorType *) * 2 *
+                   (Table->NumEntries > 0 ? Table->NumEntries : 1));
+    if (ColorList == NULL)
+        return GIF_ERROR;
+    Scratch = ColorList + Table->NumEntries;
 
     /* Put all the colors in the first entry of the color map, and call the
-     * recursive subdivision process.  */
+     * subdivision process.  */
     for (i = 0; i < 256; i++) {
-        NewColorSubdiv[i].QuantizedColors = NULL;
+        NewColorSubdiv[i].First = 0;
         NewColorSubdiv[i].Count = NewColorSubdiv[i].NumEntries = 0;
         for (j = 0; j < 3; j++) {
             NewColorSubdiv[i].RGBMin[j] = 0;
@@ -109,110 +720,995 @@ GifQuantizeBuffer(unsigned int Width,
         }
     }
 
-    /* Find the non empty entries in the color table and chain them: */
-    for (i = 0; i < COLOR_ARRAY_SIZE; i++)
-        if (ColorArrayEntries[i].Count > 0)
-            break;
-    QuantizedColor = NewColorSubdiv[0].QuantizedColors = &ColorArrayEntries[i];
-    NumOfEntries = 1;
-    while (++i < COLOR_ARRAY_SIZE)
-        if (ColorArrayEntries[i].Count > 0) {
-            QuantizedColor->Pnext = &ColorArrayEntries[i];
-            QuantizedColor = &ColorArrayEntries[i];
-            NumOfEntries++;
+    /* Find the non empty entries in the color table and list them: */
+    NumOfEntries = 0;
+    for (k = 0; k < Table->Size; k++)
+        if (Table->Entries[k].Count > 0) {
+            ColorList[NumOfEntries++] = &Table->Entries[k];
+            Pixels += Table->Entries[k].Count;
         }
-    QuantizedColor->Pnext = NULL;
 
     NewColorSubdiv[0].NumEntries = NumOfEntries; /* Different sampled colors */
-    NewColorSubdiv[0].Count = ((long)Width) * Height; /* Pixels */
-    NewColorMapSize = 1;
-    if (SubdivColorMap(NewColorSubdiv, *ColorMapSize, &NewColorMapSize) !=
-       GIF_OK) {
-        free((char *)ColorArrayEntries);
+    NewColorSubdiv[0].Count = Pixels;
+    *NewColorMapSize = 1;
+    if (SubdivColorMap(NewColorSubdiv, MaxColors, NewColorMapSize,
+                       ColorList, Scratch, Bits) != GIF_OK) {
+        free((char *)ColorList);
         return GIF_ERROR;
     }
-    if (NewColorMapSize < *ColorMapSize) {
-        /* And clear rest of color map: */
-        for (i = NewColorMapSize; i < *ColorMapSize; i++)
-            OutputColorMap[i].Red = OutputColorMap[i].Green =
-                OutputColorMap[i].Blue = 0;
-    }
 
     /* Average the colors in each entry to be the color to be used in the
      * output color map, and plug it into the output color map itself. */
-    for (i = 0; i < NewColorMapSize; i++) {
+    for (i = 0; i < (int)*NewColorMapSize; i++) {
         if ((j = NewColorSubdiv[i].NumEntries) > 0) {
-            QuantizedColor = NewColorSubdiv[i].QuantizedColors;
+            unsigned long W = NewColorSubdiv[i].Count;
             Red = Green = Blue = 0;
-            while (QuantizedColor) {
+            for (Index = 0; Index < (unsigned int)j; Index++) {
+                QuantizedColor = ColorList[NewColorSubdiv[i].First + Index];
                 QuantizedColor->NewColorIndex = i;
-                Red += QuantizedColor->RGB[0];
-                Green += QuantizedColor->RGB[1];
-                Blue += QuantizedColor->RGB[2];
-                QuantizedColor = QuantizedColor->Pnext;
+                Red += QuantizedColor->RGB[0] * QuantizedColor->Count;
+                Green += QuantizedColor->RGB[1] * QuantizedColor->Count;
+                Blue += QuantizedColor->RGB[2] * QuantizedColor->Count;
             }
-            OutputColorMap[i].Red = (Red << (8 - BITS_PER_PRIM_COLOR)) / j;
-            OutputColorMap[i].Green = (Green << (8 - BITS_PER_PRIM_COLOR)) / j;
-            OutputColorMap[i].Blue = (Blue << (8 - BITS_PER_PRIM_COLOR)) / j;
-        }
+            OutputColorMap[i].Red = (Red << (8 - Bits)) / W;
+            OutputColorMap[i].Green = (Green << (8 - Bits)) / W;
+            OutputColorMap[i].Blue = (Blue << (8 - Bits)) / W;
+        } else  /* Only if no pixels were sampled */
+            OutputColorMap[i].Red = OutputColorMap[i].Green =
+                OutputColorMap[i].Blue = 0;
+    }
+
+    free((char *)ColorList);
+    return GIF_OK;
+}
+
+/******************************************************************************
+ A palette map onto the first ColorCount of Colors.
+******************************************************************************/
+static GifPaletteMapType *
+MakeColorsPaletteMap(GifColorType *Colors, int ColorCount)
+{
+    ColorMapObject ColorMap;
+
+    ColorMap.ColorCount = ColorCount;
+    ColorMap.BitsPerPixel = GifBitSize(ColorCount);
+    ColorMap.SortFlag = false;
+    ColorMap.Colors = Colors;
+
+    return GifMakePaletteMap(&ColorMap);
+}
+
+/******************************************************************************
+ The quantizer proper, reading its input through Source.  If any pixels
+ are transparent, one slot of the color map is kept back for them, and
+ its index put in *TransparentIndex; otherwise that is set to
+ NO_TRANSPARENT_COLOR.
+******************************************************************************/
+static int
+QuantizeSource(unsigned int Width,
+               unsigned int Height,
+               int *ColorMapSize,
+               const GifPixelSourceType *Source,
+               GifByteType * OutputBuffer,
+               GifColorType * OutputColorMap,
+               int *TransparentIndex,
+               const GifQuantizeOptions *Options) {
+
+    int i, Threads, Status, MaxColors = *ColorMapSize, Transparency;
+    unsigned int NewColorMapSize;
+    unsigned long Transparent = 0;
+    ColorTableType ColorTable;
+    QuantizeJobType *Job;
+    GifPaletteMapType *PaletteMap;
+
+    if (ColorTableInit(&ColorTable, QuantizeBits(Options)) == GIF_ERROR)
+        return GIF_ERROR;
+
+    /* The passes over the pixels are shared between threads, each of which
+     * gets its own band of rows.  Sample the colors and their distribution,
+     * and choose the new ones: */
+    Threads = QuantizeThreads(Options, Width, Height);
+    Job = MakeJobs(&ColorTable, Threads, Width, Height, Source,
+                   Options->AlphaThreshold);
+    if (Job == NULL
+        || SampleJobs(Job, Threads, &Transparent) == GIF_ERROR
+        || (Transparent > 0 && --MaxColors < 1)
+        || ChooseColors(&ColorTable, MaxColors, OutputColorMap,
+                        &NewColorMapSize) == GIF_ERROR) {
+        if (Job != NULL)
+            FreeJobs(Job, Threads);
+        free((char *)ColorTable.Entries);
+        return GIF_ERROR;
     }
 
+    /* And clear rest of color map: */
+    for (i = NewColorMapSize; i < *ColorMapSize; i++)
+        OutputColorMap[i].Red = OutputColorMap[i].Green =
+            OutputColorMap[i].Blue = 0;
+
+    /* The transparent pixels get the slot after the colors: */
+    Transparency = NO_TRANSPARENT_COLOR;
+    if (Transparent > 0)
+        Transparency = NewColorMapSize++;
+    for (i = 0; i < Threads; i++) {
+        Job[i].Output = OutputBuffer;
+        Job[i].ColorMap = OutputColorMap;
+        Job[i].TransparentIndex = Transparency;
+    }
+    if (TransparentIndex != NULL)
+        *TransparentIndex = Transparency;
+
     /* Finally scan the input buffer again and put the mapped index in the
-     * output buffer.  */
-    MaxRGBError[0] = MaxRGBError[1] = MaxRGBError[2] = 0;
-    for (i = 0; i < (int)(Width * Height); i++) {
-        Index = ((RedInput[i] >> (8 - BITS_PER_PRIM_COLOR)) <<
-                 (2 * BITS_PER_PRIM_COLOR)) +
-                ((GreenInput[i] >> (8 - BITS_PER_PRIM_COLOR)) <<
-                 BITS_PER_PRIM_COLOR) +
-                (BlueInput[i] >> (8 - BITS_PER_PRIM_COLOR));
-        Index = ColorArrayEntries[Index].NewColorIndex;
-        OutputBuffer[i] = Index;
-        if (MaxRGBError[0] < ABS(OutputColorMap[Index].Red - RedInput[i]))
-            MaxRGBError[0] = ABS(OutputColorMap[Index].Red - RedInput[i]);
-        if (MaxRGBError[1] < ABS(OutputColorMap[Index].Green - GreenInput[i]))
-            MaxRGBError[1] = ABS(OutputColorMap[Index].Green - GreenInput[i]);
-        if (MaxRGBError[2] < ABS(OutputColorMap[Index].Blue - BlueInput[i]))
-            MaxRGBError[2] = ABS(OutputColorMap[Index].Blue - BlueInput[i]);
+     * output buffer.  A dithered image is mapped to the nearest of the new
+     * colors but for the transparent slot, with the pixels nudged first;
+     * the color table is no help there. */
+    if (Options->Dither != GIF_DITHER_NONE) {
+        PaletteMap = MakeColorsPaletteMap(OutputColorMap,
+                                          NewColorMapSize - (Transparent > 0));
+        Status = PaletteMap != NULL
+            && DitherJobs(Job, Threads, PaletteMap, Options->Dither,
+                          Height) == GIF_OK ? GIF_OK : GIF_ERROR;
+        GifFreePaletteMap(PaletteMap);
+    } else {
+        RunJobs(MapColors, Job, Threads);
+        for (i = 0, Status = GIF_OK; i < Threads; i++)
+            if (Job[i].Status != GIF_OK)
+                Status = GIF_ERROR;
     }
 
 #ifdef DEBUG
-    fprintf(stderr,
-            "Quantization L(0) errors: Red = %d, Green = %d, Blue = %d.\n",
-            MaxRGBError[0], MaxRGBError[1], MaxRGBError[2]);
+    if (Options->Dither == GIF_DITHER_NONE) {
+        int j;
+
+        for (i = 1; i < Threads; i++)
+            for (j = 0; j < 3; j++)
+                if (Job[0].MaxRGBError[j] < Job[i].MaxRGBError[j])
+                    Job[0].MaxRGBError[j] = Job[i].MaxRGBError[j];
+        fprintf(stderr,
+                "Quantization L(0) errors: Red = %d, Green = %d, Blue = %d.\n",
+                Job[0].MaxRGBError[0], Job[0].MaxRGBError[1],
+                Job[0].MaxRGBError[2]);
+    }
 #endif /* DEBUG */
 
-    free((char *)ColorArrayEntries);
+    FreeJobs(Job, Threads);
+    free((char *)ColorTable.Entries);
+
+    if (Status == GIF_OK)
+        *ColorMapSize = NewColorMapSize;
+    return Status;
+}
+
+/******************************************************************************
+ GifQuantizeBuffer(), tuned by Options.  BitsPerPrimary is how many of the
+ top bits of each primary color tell colors apart, from 1 to 8; 5 by
+ default.  More keep smooth gradients smooth, at some cost in time and
+ memory.  Dither, GIF_DITHER_NONE by default, picks how the image is
+ dithered onto the new colors, as in GifDitherPaletteBuffer().  Threads
+ is how many threads share the work; the result is the same however many.
+******************************************************************************/
+int
+GifQuantizeBufferWithOptions(unsigned int Width,
+                             unsigned int Height,
+                             int *ColorMapSize,
+                             GifByteType * RedInput,
+                             GifByteType * GreenInput,
+                             GifByteType * BlueInput,
+                             GifByteType * OutputBuffer,
+                             GifColorType * OutputColorMap,
+                             const GifQuantizeOptions *Options) {
+
+    GifPixelSourceType Source;
+
+    _GifPlanarSource(&Source, RedInput, GreenInput, BlueInput, Width);
+    return QuantizeSource(Width, Height, ColorMapSize, &Source,
+                          OutputBuffer, OutputColorMap, NULL, Options);
+}
+
+/******************************************************************************
+ Like GifQuantizeBufferWithOptions(), but for interleaved pixels: Height
+ rows of Width pixels laid out as Format says (GIF_PIXELS_RGB24,
+ GIF_PIXELS_RGBA32 or GIF_PIXELS_BGRA32), each row starting Stride bytes
+ after the last.  Pixels with an alpha below Options->AlphaThreshold are
+ transparent: they are left out of the choice of colors, and if there are
+ any, the new color map's last entry is kept back for them, its index
+ returned in *TransparentIndex; otherwise that is NO_TRANSPARENT_COLOR.
+ *ColorMapSize counts that entry, so at most *ColorMapSize - 1 colors are
+ chosen.  TransparentIndex may be NULL.
+******************************************************************************/
+int
+GifQuantizePixels(unsigned int Width,
+                  unsigned int Height,
+                  int *ColorMapSize,
+                  const GifByteType *Pixels,
+                  int Format,
+                  size_t Stride,
+                  GifByteType * OutputBuffer,
+                  GifColorType * OutputColorMap,
+                  int *TransparentIndex,
+                  const GifQuantizeOptions *Options) {
+
+    GifPixelSourceType Source;
+
+    if (_GifInterleavedSource(&Source, Pixels, Format, Stride) == GIF_ERROR)
+        return GIF_ERROR;
+    return QuantizeSource(Width, Height, ColorMapSize, &Source,
+                          OutputBuffer, OutputColorMap, TransparentIndex,
+                          Options);
+}
 
-    *ColorMapSize = NewColorMapSize;
+/******************************************************************************
+ Quantize a Width by Height image of interleaved pixels, as
+ GifQuantizePixels() takes them, into a new image of GifFile at (Left,
+ Top), with a local color map of at most ColorMapSize entries.  If any
+ of the pixels are transparent they get the entry kept back for them,
+ and the image a graphics control block naming it as the transparent
+ color, so nothing is left to patch up afterwards; the delay and
+ disposal in it can be changed with DGifSavedExtensionToGCB() and
+ EGifGCBToSavedExtension().  Returns the new image, or NULL if memory is
+ exhausted, Format is unknown or ColorMapSize is too small, in which
+ case GifFile is left as it was.
+******************************************************************************/
+SavedImage *
+GifQuantizeSavedImage(GifFileType *GifFile, int Left, int Top,
+                      unsigned int Width, unsigned int Height,
+                      const GifByteType *Pixels, int Format, size_t Stride,
+                      int ColorMapSize, const GifQuantizeOptions *Options)
+{
+    GifColorType Colors[256];
+    GraphicsControlBlock GCB;
+    ColorMapObject *ColorMap;
+    GifByteType *RasterBits;
+    SavedImage *Image;
+    int TransparentIndex;
+
+    if (ColorMapSize > 256)
+        ColorMapSize = 256;
+    memset(Colors, '\0', sizeof(Colors));
+    RasterBits = (GifByteType *)malloc((size_t)Width * Height);
+    if (RasterBits == NULL)
+        return NULL;
+    if (GifQuantizePixels(Width, Height, &ColorMapSize, Pixels, Format,
+                          Stride, RasterBits, Colors, &TransparentIndex,
+                          Options) == GIF_ERROR
+        || (ColorMap = GifMakeMapObject(1 << GifBitSize(ColorMapSize),
+                                        Colors)) == NULL) {
+        free((char *)RasterBits);
+        return NULL;
+    }
+    if ((Image = GifMakeSavedImage(GifFile, NULL)) == NULL) {
+        GifFreeMapObject(ColorMap);
+        free((char *)RasterBits);
+        return NULL;
+    }
+    Image->ImageDesc.Left = Left;
+    Image->ImageDesc.Top = Top;
+    Image->ImageDesc.Width = Width;
+    Image->ImageDesc.Height = Height;
+    Image->ImageDesc.Interlace = false;
+    Image->ImageDesc.ColorMap = ColorMap;
+    Image->RasterBits = RasterBits;
 
+    if (TransparentIndex != NO_TRANSPARENT_COLOR) {
+        GCB.DisposalMode = DISPOSAL_UNSPECIFIED;
+        GCB.UserInputFlag = false;
+        GCB.DelayTime = 0;
+        GCB.TransparentColor = TransparentIndex;
+        if (EGifGCBToSavedExtension(&GCB, GifFile,
+                                    GifFile->ImageCount - 1) == GIF_ERROR) {
+            /* take the image back out rather than leave it half made */
+            GifFreeExtensions(&Image->ExtensionBlockCount,
+                              &Image->ExtensionBlocks);
+            GifFreeMapObject(ColorMap);
+            free((char *)RasterBits);
+            --GifFile->ImageCount;
+            return NULL;
+        }
+    }
+
+    return Image;
+}
+
+/******************************************************************************
+ Start choosing one color map for a run of images, such as the frames of
+ an animation, to be quantized as Options says (or by default, if it is
+ NULL).  Returns NULL if memory is exhausted.
+******************************************************************************/
+GifPaletteBuilderType *
+GifMakePaletteBuilder(const GifQuantizeOptions *Options)
+{
+    GifPaletteBuilderType *Builder;
+
+    Builder = (GifPaletteBuilderType *)malloc(sizeof(GifPaletteBuilderType));
+    if (Builder == NULL)
+        return NULL;
+    if (Options != NULL)
+        Builder->Options = *Options;
+    else
+        GifDefaultQuantizeOptions(&Builder->Options);
+    if (ColorTableInit(&Builder->Table,
+                       QuantizeBits(&Builder->Options)) == GIF_ERROR) {
+        free((char *)Builder);
+        return NULL;
+    }
+    Builder->Transparent = 0;
+    Builder->PaletteMap = NULL;
+    Builder->TransparentIndex = NO_TRANSPARENT_COLOR;
+
+    return Builder;
+}
+
+/******************************************************************************
+ Add the colors of an image read through Source to those sampled.  A
+ hashed table that has got too big is cut to a lower precision, so the
+ builder's memory doesn't grow with the number of images.
+******************************************************************************/
+static int
+SampleBuilderSource(GifPaletteBuilderType *Builder,
+                    unsigned int Width, unsigned int Height,
+                    const GifPixelSourceType *Source)
+{
+    ColorTableType *Table = &Builder->Table;
+    int Threads = QuantizeThreads(&Builder->Options, Width, Height), Status;
+    QuantizeJobType *Job;
+
+    Job = MakeJobs(Table, Threads, Width, Height, Source,
+                   Builder->Options.AlphaThreshold);
+    if (Job == NULL)
+        return GIF_ERROR;
+    Status = SampleJobs(Job, Threads, &Builder->Transparent);
+    FreeJobs(Job, Threads);
+    while (Status == GIF_OK && !Table->Dense
+           && Table->NumEntries > MAX_BUILDER_COLORS)
+        Status = ColorTableReduce(Table);
+
+    return Status;
+}
+
+/******************************************************************************
+ Add the colors of a Width by Height image, given as separate planes, to
+ those the color map is to be chosen for.  Returns GIF_ERROR if memory is
+ exhausted.
+******************************************************************************/
+int
+GifSamplePaletteBuffer(GifPaletteBuilderType *Builder,
+                       unsigned int Width, unsigned int Height,
+                       const GifByteType *RedInput,
+                       const GifByteType *GreenInput,
+                       const GifByteType *BlueInput)
+{
+    GifPixelSourceType Source;
+
+    _GifPlanarSource(&Source, RedInput, GreenInput, BlueInput, Width);
+    return SampleBuilderSource(Builder, Width, Height, &Source);
+}
+
+/******************************************************************************
+ GifSamplePaletteBuffer() for interleaved pixels, as GifQuantizePixels()
+ takes them.  Returns GIF_ERROR if memory is exhausted or Format is
+ unknown.
+******************************************************************************/
+int
+GifSamplePalettePixels(GifPaletteBuilderType *Builder,
+                       unsigned int Width, unsigned int Height,
+                       const GifByteType *Pixels, int Format, size_t Stride)
+{
+    GifPixelSourceType Source;
+
+    if (_GifInterleavedSource(&Source, Pixels, Format, Stride) == GIF_ERROR)
+        return GIF_ERROR;
+    return SampleBuilderSource(Builder, Width, Height, &Source);
+}
+
+/******************************************************************************
+ Choose up to ColorMapSize colors for all the images sampled so far, as
+ GifQuantizePixels() would for one of them, and return them as a new
+ color map object; its size is rounded up to a power of 2, as GIF needs.
+ If any pixels were transparent, one slot is kept back for them, its index
+ put in *TransparentIndex (if that is not NULL); otherwise that is
+ NO_TRANSPARENT_COLOR.  The images can then be mapped onto the colors
+ with GifQuantizeFrameBuffer() or GifQuantizeFramePixels(), and more
+ sampled and the colors chosen again if need be.  Returns NULL, leaving
+ no colors to map onto, if memory is exhausted or there is no room for
+ any colors.
+******************************************************************************/
+ColorMapObject *
+GifBuildPaletteColorMap(GifPaletteBuilderType *Builder, int ColorMapSize,
+                        int *TransparentIndex)
+{
+    GifColorType Colors[256];
+    unsigned int NewColorMapSize;
+    int MaxColors = ColorMapSize < 256 ? ColorMapSize : 256;
+    ColorMapObject *ColorMap;
+
+    GifFreePaletteMap(Builder->PaletteMap);
+    Builder->PaletteMap = NULL;
+    if ((Builder->Transparent > 0 && --MaxColors < 1) || MaxColors < 1
+        || ChooseColors(&Builder->Table, MaxColors, Colors,
+                        &NewColorMapSize) == GIF_ERROR)
+        return NULL;
+    Builder->PaletteMap = MakeColorsPaletteMap(Colors, NewColorMapSize);
+    if (Builder->PaletteMap == NULL)
+        return NULL;
+
+    /* The transparent pixels get the slot after the colors: */
+    Builder->TransparentIndex = NO_TRANSPARENT_COLOR;
+    if (Builder->Transparent > 0) {
+        Colors[NewColorMapSize].Red = Colors[NewColorMapSize].Green =
+            Colors[NewColorMapSize].Blue = 0;
+        Builder->TransparentIndex = NewColorMapSize++;
+    }
+    ColorMap = GifMakeMapObject(1 << GifBitSize(NewColorMapSize), NULL);
+    if (ColorMap == NULL) {
+        /* no map object to go with it, so no palette either */
+        GifFreePaletteMap(Builder->PaletteMap);
+        Builder->PaletteMap = NULL;
+        return NULL;
+    }
+    memcpy(ColorMap->Colors, Colors, NewColorMapSize * sizeof(GifColorType));
+    if (TransparentIndex != NULL)
+        *TransparentIndex = Builder->TransparentIndex;
+
+    return ColorMap;
+}
+
+/******************************************************************************
+ Map an image read through Source onto PaletteMap, as Options says, with
+ its transparent pixels going to TransparentIndex.
+******************************************************************************/
+static int
+MapFrameSource(const GifQuantizeOptions *Options,
+               const GifPaletteMapType *PaletteMap, int TransparentIndex,
+               unsigned int Width, unsigned int Height,
+               const GifPixelSourceType *Source, GifByteType *OutputBuffer)
+{
+    int i, Threads = QuantizeThreads(Options, Width, Height);
+    int Status;
+    QuantizeJobType *Job;
+
+    Job = MakeJobs(NULL, Threads, Width, Height, Source,
+                   Options->AlphaThreshold);
+    if (Job == NULL)
+        return GIF_ERROR;
+    for (i = 0; i < Threads; i++) {
+        Job[i].Output = OutputBuffer;
+        Job[i].TransparentIndex = TransparentIndex;
+    }
+    Status = DitherJobs(Job, Threads, PaletteMap, Options->Dither, Height);
+    FreeJobs(Job, Threads);
+
+    return Status;
+}
+
+/******************************************************************************
+ Map an image read through Source onto the colors last chosen.
+******************************************************************************/
+static int
+QuantizeFrameSource(const GifPaletteBuilderType *Builder,
+                    unsigned int Width, unsigned int Height,
+                    const GifPixelSourceType *Source,
+                    GifByteType *OutputBuffer)
+{
+    if (Builder->PaletteMap == NULL)
+        return GIF_ERROR;
+    return MapFrameSource(&Builder->Options, Builder->PaletteMap,
+                          Builder->TransparentIndex, Width, Height, Source,
+                          OutputBuffer);
+}
+
+/******************************************************************************
+ Map a Width by Height image, given as separate planes, onto the color map
+ last built, dithering it as the builder's options say, and put the color
+ indexes in OutputBuffer.  The image need not be one of those sampled.
+ Returns GIF_ERROR if memory is exhausted or no color map has been built.
+******************************************************************************/
+int
+GifQuantizeFrameBuffer(const GifPaletteBuilderType *Builder,
+                       unsigned int Width, unsigned int Height,
+                       const GifByteType *RedInput,
+                       const GifByteType *GreenInput,
+                       const GifByteType *BlueInput,
+                       GifByteType *OutputBuffer)
+{
+    GifPixelSourceType Source;
+
+    _GifPlanarSource(&Source, RedInput, GreenInput, BlueInput, Width);
+    return QuantizeFrameSource(Builder, Width, Height, &Source,
+                               OutputBuffer);
+}
+
+/******************************************************************************
+ GifQuantizeFrameBuffer() for interleaved pixels; those with less alpha
+ than the builder's AlphaThreshold get the transparent index.  Returns
+ GIF_ERROR if memory is exhausted, no color map has been built or Format
+ is unknown.
+******************************************************************************/
+int
+GifQuantizeFramePixels(const GifPaletteBuilderType *Builder,
+                       unsigned int Width, unsigned int Height,
+                       const GifByteType *Pixels, int Format, size_t Stride,
+                       GifByteType *OutputBuffer)
+{
+    GifPixelSourceType Source;
+
+    if (_GifInterleavedSource(&Source, Pixels, Format, Stride) == GIF_ERROR)
+        return GIF_ERROR;
+    return QuantizeFrameSource(Builder, Width, Height, &Source,
+                               OutputBuffer);
+}
+
+/******************************************************************************
+ How many rows of a Width pixel image to read at a time from a row
+ source: enough for each thread to have a whole dither band.
+******************************************************************************/
+static unsigned int
+SourceBandRows(const GifQuantizeOptions *Options, unsigned int Width)
+{
+    return DITHER_BAND_ROWS * QuantizeThreads(Options, Width,
+                                 DITHER_BAND_ROWS * MAX_QUANTIZE_THREADS);
+}
+
+/******************************************************************************
+ Read rows Top to Top + Rows - 1 from ReadRow into Band, RowSize bytes
+ apart.
+******************************************************************************/
+static int
+ReadSourceBand(GifReadRowFunc ReadRow, void *UserData,
+               unsigned int Top, unsigned int Rows, size_t RowSize,
+               GifByteType *Band)
+{
+    unsigned int y;
+
+    for (y = 0; y < Rows; y++)
+        if (ReadRow(UserData, Top + y, Band + y * RowSize) == GIF_ERROR)
+            return GIF_ERROR;
     return GIF_OK;
 }
 
 /******************************************************************************
- Routine to subdivide the RGB space recursively using median cut in each
- axes alternatingly until ColorMapSize different cubes exists.
- The biggest cube in one dimension is subdivide unless it has only one entry.
+ Allocate a band of Rows rows of Width pixels laid out as Format says,
+ and set up *Source to read it.  Returns NULL if memory is exhausted or
+ Format is unknown.
+******************************************************************************/
+static GifByteType *
+MakeSourceBand(unsigned int Width, unsigned int Rows, int Format,
+               GifPixelSourceType *Source)
+{
+    /* Room for 4 bytes a pixel, the most any format takes. */
+    GifByteType *Band = (GifByteType *)malloc((size_t)4 * Width * Rows);
+
+    if (Band == NULL)
+        return NULL;
+    if (_GifInterleavedSource(Source, Band, Format, 0) == GIF_ERROR) {
+        free((char *)Band);
+        return NULL;
+    }
+    Source->Stride = Source->Step * Width;
+    return Band;
+}
+
+/******************************************************************************
+ Add the colors of a Width by Height image to those sampled, reading it a
+ row at a time through ReadRow, so that only a band of rows is ever in
+ memory, however big the image.  ReadRow is called for rows 0 to
+ Height - 1 in order, with UserData, to put each as interleaved pixels
+ laid out as Format says.  Returns GIF_ERROR if memory is exhausted,
+ Format is unknown or ReadRow fails.
+******************************************************************************/
+int
+GifSamplePaletteRows(GifPaletteBuilderType *Builder,
+                     unsigned int Width, unsigned int Height, int Format,
+                     GifReadRowFunc ReadRow, void *UserData)
+{
+    unsigned int Top, Rows, BandRows = SourceBandRows(&Builder->Options,
+                                                      Width);
+    GifPixelSourceType Source;
+    GifByteType *Band;
+    int Status = GIF_OK;
+
+    if ((Band = MakeSourceBand(Width, BandRows, Format, &Source)) == NULL)
+        return GIF_ERROR;
+    for (Top = 0; Status == GIF_OK && Top < Height; Top += Rows) {
+        Rows = Height - Top < BandRows ? Height - Top : BandRows;
+        Status = ReadSourceBand(ReadRow, UserData, Top, Rows,
+                                Source.Stride, Band);
+        if (Status == GIF_OK)
+            Status = SampleBuilderSource(Builder, Width, Rows, &Source);
+    }
+    free((char *)Band);
+
+    return Status;
+}
+
+/******************************************************************************
+ Map a Width by Height image onto the color map last built, as
+ GifQuantizeFramePixels() would, reading it through ReadRow as
+ GifSamplePaletteRows() does, and write each band of rows as it is done
+ to GifFile with EGifPutLine(), after the caller has put the image
+ descriptor.  The image need not be in memory at any point, so one too
+ big for it can be quantized by sampling it with GifSamplePaletteRows(),
+ building the color map, and then reading it again with this.  Returns
+ GIF_ERROR, with GifFile->Error saying why, if no color map has been
+ built (E_GIF_ERR_NO_COLOR_MAP), memory is exhausted or Format is
+ unknown (E_GIF_ERR_NOT_ENOUGH_MEM), or writing fails; or if ReadRow
+ fails, leaving GifFile->Error as it was.
+******************************************************************************/
+int
+GifPutQuantizedRows(const GifPaletteBuilderType *Builder,
+                    GifFileType *GifFile,
+                    unsigned int Width, unsigned int Height, int Format,
+                    GifReadRowFunc ReadRow, void *UserData)
+{
+    unsigned int Top, Rows, BandRows = SourceBandRows(&Builder->Options,
+                                                      Width);
+    int Dither = Builder->Options.Dither, *Errors = NULL, Status = GIF_OK;
+    GifPixelSourceType Source;
+    GifByteType *Band, *OutputBuffer;
+
+    if (Builder->PaletteMap == NULL) {
+        GifFile->Error = E_GIF_ERR_NO_COLOR_MAP;
+        return GIF_ERROR;
+    }
+    Band = MakeSourceBand(Width, BandRows, Format, &Source);
+    OutputBuffer = (GifByteType *)malloc((size_t)Width * BandRows);
+    /* Floyd-Steinberg error runs on from band to band: */
+    if (Dither == GIF_DITHER_FLOYD_STEINBERG)
+        Errors = (int *)calloc(_GIF_DITHER_ERRORS(Width), sizeof(int));
+    if (Band == NULL || OutputBuffer == NULL
+        || (Dither == GIF_DITHER_FLOYD_STEINBERG && Errors == NULL)) {
+        GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+        Status = GIF_ERROR;
+    }
+
+    for (Top = 0; Status == GIF_OK && Top < Height; Top += Rows) {
+        Rows = Height - Top < BandRows ? Height - Top : BandRows;
+        if (ReadSourceBand(ReadRow, UserData, Top, Rows,
+                           Source.Stride, Band) == GIF_ERROR) {
+            Status = GIF_ERROR;
+            break;
+        }
+        if (Errors != NULL)
+            Status = _GifDitherPaletteRows(Builder->PaletteMap, Dither,
+                                           Width, Top, Rows, &Source,
+                                           Builder->Options.AlphaThreshold,
+                                           Builder->TransparentIndex,
+                                           Errors, OutputBuffer);
+        else
+            /* Bands start on a whole dither band, so can be split up. */
+            Status = QuantizeFrameSource(Builder, Width, Rows, &Source,
+                                         OutputBuffer);
+        if (Status == GIF_OK)
+            Status = EGifPutLine(GifFile, OutputBuffer,
+                                 (int)(Width * Rows));
+        else
+            GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+    }
+    free((char *)Band);
+    free((char *)OutputBuffer);
+    free((char *)Errors);
+
+    return Status;
+}
+
+/******************************************************************************
+ Free a palette builder that is no longer needed.
+******************************************************************************/
+void
+GifFreePaletteBuilder(GifPaletteBuilderType *Builder)
+{
+    if (Builder != NULL) {
+        GifFreePaletteMap(Builder->PaletteMap);
+        free((char *)Builder->Table.Entries);
+        free((char *)Builder);
+    }
+}
+
+/******************************************************************************
+ Start quantizing a run of frames, such as a screen recording, whose colors
+ change little from one to the next.  The colors chosen for the first
+ frame are meant to be the global color map, and each later frame is
+ mapped onto them as long as they still fit it: as long as the root mean
+ square error of the colors they give a sample of the frame's pixels is
+ no more than MaxDrift levels (of 255) worse than it was for the first
+ frame.  A frame they don't fit is mapped onto the colors last chosen for
+ a later frame, if those fit it in the same way, and only if neither does
+ are up to ColorMapSize new colors chosen, as Options says (or by default,
+ if it is NULL).  Returns NULL if memory is exhausted.
+******************************************************************************/
+GifFrameQuantizerType *
+GifMakeFrameQuantizer(const GifQuantizeOptions *Options, int ColorMapSize,
+                      int MaxDrift)
+{
+    GifFrameQuantizerType *Quantizer;
+
+    Quantizer = (GifFrameQuantizerType *)malloc(sizeof(GifFrameQuantizerType));
+    if (Quantizer == NULL)
+        return NULL;
+    if ((Quantizer->Builder = GifMakePaletteBuilder(Options)) == NULL) {
+        free((char *)Quantizer);
+        return NULL;
+    }
+    memset(&Quantizer->Global, '\0', sizeof(FrameMapType));
+    memset(&Quantizer->Local, '\0', sizeof(FrameMapType));
+    Quantizer->ColorMapSize = ColorMapSize;
+    Quantizer->MaxDrift = MaxDrift;
+
+    return Quantizer;
+}
+
+/******************************************************************************
+ Whether any pixel read through Source has less alpha than AlphaThreshold.
+******************************************************************************/
+static bool
+AnyTransparent(unsigned int Width, unsigned int Height,
+               const GifPixelSourceType *Source, int AlphaThreshold)
+{
+    unsigned int x, y;
+    size_t i;
+
+    if (Source->Alpha == NULL)
+        return false;
+    for (y = 0; y < Height; y++)
+        for (x = 0, i = y * Source->Stride; x < Width; x++, i += Source->Step)
+            if (Source->Alpha[i] < AlphaThreshold)
+                return true;
+    return false;
+}
+
+/******************************************************************************
+ The root mean square error of Map's colors over a sample of the opaque
+ pixels read through Source, spread over the whole image.
+******************************************************************************/
+static double
+SampledError(const GifFrameQuantizerType *Quantizer, const FrameMapType *Map,
+             unsigned int Width, unsigned int Height,
+             const GifPixelSourceType *Source)
+{
+    const GifColorType *Colors = Map->ColorMap->Colors;
+    unsigned long j, k, Pixels = (unsigned long)Width * Height;
+    unsigned long Step, Samples = 0;
+    double Sum = 0;
+    int Index, dr, dg, db;
+    size_t i;
+
+    Step = Pixels > DRIFT_SAMPLES ? Pixels / DRIFT_SAMPLES : 1;
+    for (j = 0; j * Step < Pixels; j++) {
+        /* Jitter within the step, so as not to sample the same columns. */
+        k = j * Step + (j * 2654435761UL) % Step;
+        i = k / Width * Source->Stride + k % Width * Source->Step;
+        if (Source->Alpha != NULL
+            && Source->Alpha[i] < Quantizer->Builder->Options.AlphaThreshold)
+            continue;
+        Index = GifMapPaletteColor(Map->PaletteMap, Source->Red[i],
+                                   Source->Green[i], Source->Blue[i]);
+        dr = Source->Red[i] - Colors[Index].Red;
+        dg = Source->Green[i] - Colors[Index].Green;
+        db = Source->Blue[i] - Colors[Index].Blue;
+        Sum += dr * dr + dg * dg + db * db;
+        Samples++;
+    }
+
+    return Samples > 0 ? sqrt(Sum / Samples) : 0;
+}
+
+/******************************************************************************
+ Whether Map's colors fit the frame read through Source: whether they have
+ been chosen, have a slot for the frame's transparent pixels if it has any,
+ and have not drifted too far from it.
+******************************************************************************/
+static bool
+FrameMapFits(const GifFrameQuantizerType *Quantizer, const FrameMapType *Map,
+             unsigned int Width, unsigned int Height,
+             const GifPixelSourceType *Source, bool Transparent)
+{
+    return Map->ColorMap != NULL
+           && (Map->TransparentIndex != NO_TRANSPARENT_COLOR || !Transparent)
+           && SampledError(Quantizer, Map, Width, Height, Source)
+              <= Map->Error + Quantizer->MaxDrift;
+}
+
+/******************************************************************************
+ Free Map's colors, leaving it with none chosen.
+******************************************************************************/
+static void
+FreeFrameMap(FrameMapType *Map)
+{
+    GifFreeMapObject(Map->ColorMap);
+    GifFreePaletteMap(Map->PaletteMap);
+    memset(Map, '\0', sizeof(FrameMapType));
+}
+
+/******************************************************************************
+ Choose new colors for the frame read through Source, into Map.
+******************************************************************************/
+static int
+ChooseFrameMap(GifFrameQuantizerType *Quantizer, FrameMapType *Map,
+               unsigned int Width, unsigned int Height,
+               const GifPixelSourceType *Source)
+{
+    GifPaletteBuilderType *Builder = Quantizer->Builder;
+    ColorMapObject *ColorMap;
+    int TransparentIndex;
+
+    free((char *)Builder->Table.Entries);
+    Builder->Transparent = 0;
+    if (ColorTableInit(&Builder->Table,
+                       QuantizeBits(&Builder->Options)) == GIF_ERROR)
+        return GIF_ERROR;
+    if (SampleBuilderSource(Builder, Width, Height, Source) == GIF_ERROR
+        || (ColorMap = GifBuildPaletteColorMap(Builder,
+                                               Quantizer->ColorMapSize,
+                                               &TransparentIndex)) == NULL)
+        return GIF_ERROR;
+
+    /* The frame quantizer, not the builder, keeps the palette map now. */
+    FreeFrameMap(Map);
+    Map->ColorMap = ColorMap;
+    Map->PaletteMap = Builder->PaletteMap;
+    Map->TransparentIndex = TransparentIndex;
+    Builder->PaletteMap = NULL;
+    Map->Error = SampledError(Quantizer, Map, Width, Height, Source);
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Quantize the next frame, read through Source.
+******************************************************************************/
+static int
+QuantizeNextSource(GifFrameQuantizerType *Quantizer,
+                   unsigned int Width, unsigned int Height,
+                   const GifPixelSourceType *Source,
+                   GifByteType *OutputBuffer,
+                   const ColorMapObject **ColorMap, bool *Local,
+                   int *TransparentIndex)
+{
+    const FrameMapType *Map;
+    bool Transparent;
+
+    Transparent = AnyTransparent(Width, Height, Source,
+                                 Quantizer->Builder->Options.AlphaThreshold);
+    if (Quantizer->Global.ColorMap == NULL) {
+        if (ChooseFrameMap(Quantizer, &Quantizer->Global,
+                           Width, Height, Source) == GIF_ERROR)
+            return GIF_ERROR;
+        Map = &Quantizer->Global;
+    } else if (FrameMapFits(Quantizer, &Quantizer->Global,
+                            Width, Height, Source, Transparent))
+        Map = &Quantizer->Global;
+    else if (FrameMapFits(Quantizer, &Quantizer->Local,
+                          Width, Height, Source, Transparent))
+        Map = &Quantizer->Local;
+    else {
+        if (ChooseFrameMap(Quantizer, &Quantizer->Local,
+                           Width, Height, Source) == GIF_ERROR)
+            return GIF_ERROR;
+        Map = &Quantizer->Local;
+    }
+
+    if (MapFrameSource(&Quantizer->Builder->Options, Map->PaletteMap,
+                       Map->TransparentIndex, Width, Height, Source,
+                       OutputBuffer) == GIF_ERROR)
+        return GIF_ERROR;
+    *ColorMap = Map->ColorMap;
+    *Local = (Map == &Quantizer->Local);
+    if (TransparentIndex != NULL)
+        *TransparentIndex = Map->TransparentIndex;
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Quantize the next Width by Height frame, given as separate planes, and
+ put its color indexes in OutputBuffer.  *ColorMap is set to the color map
+ the frame is drawn with, which belongs to the quantizer and lasts until
+ the next frame is quantized.  The first frame's is the one to make the
+ global color map.  *Local is set to false if the frame is drawn with
+ that, so it needs no color map of its own, and to true if it must be
+ written with *ColorMap as its local color map; a map chosen after the
+ first is kept while it fits, and so is repeated as the local map of each
+ frame drawn with it.  *TransparentIndex, if not NULL, is set to the slot
+ of *ColorMap kept for transparent pixels, or NO_TRANSPARENT_COLOR.
+ Returns GIF_ERROR if memory is exhausted.
+******************************************************************************/
+int
+GifQuantizeNextFrameBuffer(GifFrameQuantizerType *Quantizer,
+                           unsigned int Width, unsigned int Height,
+                           const GifByteType *RedInput,
+                           const GifByteType *GreenInput,
+                           const GifByteType *BlueInput,
+                           GifByteType *OutputBuffer,
+                           const ColorMapObject **ColorMap, bool *Local,
+                           int *TransparentIndex)
+{
+    GifPixelSourceType Source;
+
+    _GifPlanarSource(&Source, RedInput, GreenInput, BlueInput, Width);
+    return QuantizeNextSource(Quantizer, Width, Height, &Source,
+                              OutputBuffer, ColorMap, Local,
+                              TransparentIndex);
+}
+
+/******************************************************************************
+ GifQuantizeNextFrameBuffer() for interleaved pixels, as GifQuantizePixels()
+ takes them.  Returns GIF_ERROR if memory is exhausted or Format is
+ unknown.
+******************************************************************************/
+int
+GifQuantizeNextFramePixels(GifFrameQuantizerType *Quantizer,
+                           unsigned int Width, unsigned int Height,
+                           const GifByteType *Pixels, int Format,
+                           size_t Stride, GifByteType *OutputBuffer,
+                           const ColorMapObject **ColorMap, bool *Local,
+                           int *TransparentIndex)
+{
+    GifPixelSourceType Source;
+
+    if (_GifInterleavedSource(&Source, Pixels, Format, Stride) == GIF_ERROR)
+        return GIF_ERROR;
+    return QuantizeNextSource(Quantizer, Width, Height, &Source,
+                              OutputBuffer, ColorMap, Local,
+                              TransparentIndex);
+}
+
+/******************************************************************************
+ Free a frame quantizer that is no longer needed, and its color maps.
+******************************************************************************/
+void
+GifFreeFrameQuantizer(GifFrameQuantizerType *Quantizer)
+{
+    if (Quantizer != NULL) {
+        FreeFrameMap(&Quantizer->Global);
+        FreeFrameMap(&Quantizer->Local);
+        GifFreePaletteBuilder(Quantizer->Builder);
+        free((char *)Quantizer);
+    }
+}
+
+/******************************************************************************
+ Routine to subdivide the RGB space using median cut in each axes
+ alternatingly until ColorMapSize different cubes exists.
+ The cube subdivided is the one whose widest axis, squared and weighted by
+ the pixels in it, is biggest, unless it has only one entry; so crowded
+ cubes get cut before big empty ones.  As a cube is cut, it is shrunk to
+ the colors actually in it along that axis.
+ Each cube's colors are a run of ColorList.  To split one, its pixels are
+ counted into a histogram along the axis, a slice for each value it can
+ take at the precision in use, whose running sum finds the median slice,
+ and the run is partitioned around it; so a split costs time in proportion
+ to the colors in the cube and the slices of the axis, with no sorting.
+ Colors in the same slice always stay together.
  Returns GIF_ERROR if failed, otherwise GIF_OK.
 *******************************************************************************/
 static int
 SubdivColorMap(NewColorMapType * NewColorSubdiv,
                unsigned int ColorMapSize,
-               unsigned int *NewColorMapSize) {
+               unsigned int *NewColorMapSize,
+               QuantizedColorType **ColorList,
+               QuantizedColorType **Scratch,
+               int Bits) {
 
     unsigned int i, j, Index = 0;
-    QuantizedColorType *QuantizedColor, **SortArray;
+    QuantizedColorType **Colors, **Upper;
+    unsigned long Histogram[1 << MAX_BITS_PER_PRIM_COLOR];
+    unsigned int Entries[1 << MAX_BITS_PER_PRIM_COLOR];
+    const unsigned int MaxPrimColor = (1U << Bits) - 1;
 
     while (ColorMapSize > *NewColorMapSize) {
         /* Find candidate for subdivision: */
-	long Sum, Count;
-        int MaxSize = -1;
-	unsigned int NumEntries, MinColor, MaxColor;
+        unsigned long Half, Count;
+        double MaxSize = -1, Size;
+        int SortRGBAxis = 0;
+        unsigned int NumEntries, MinColor, MaxColor, Low, Split, High;
+        NewColorMapType *Box, *NewBox;
+
         for (i = 0; i < *NewColorMapSize; i++) {
             for (j = 0; j < 3; j++) {
-                if ((((int)NewColorSubdiv[i].RGBWidth[j]) > MaxSize) &&
+                Size = (double)NewColorSubdiv[i].RGBWidth[j]
+                    * NewColorSubdiv[i].RGBWidth[j] * NewColorSubdiv[i].Count;
+                if ((Size > MaxSize) && (Size > 0) &&
                       (NewColorSubdiv[i].NumEntries > 1)) {
-                    MaxSize = NewColorSubdiv[i].RGBWidth[j];
+                    MaxSize = Size;
                     Index = i;
                     SortRGBAxis = j;
                 }
@@ -223,84 +1719,87 @@ SubdivColorMap(NewColorMapType * NewColorSubdiv,
             return GIF_OK;
 
         /* Split the entry Index into two along the axis SortRGBAxis: */
+        Box = &NewColorSubdiv[Index];
+        Colors = ColorList + Box->First;
 
-        /* Sort all elements in that entry along the given axis and split at
-         * the median.  */
-        SortArray = (QuantizedColorType **)malloc(
-                      sizeof(QuantizedColorType *) * 
-                      NewColorSubdiv[Index].NumEntries);
-        if (SortArray == NULL)
-            return GIF_ERROR;
-        for (j = 0, QuantizedColor = NewColorSubdiv[Index].QuantizedColors;
-             j < NewColorSubdiv[Index].NumEntries && QuantizedColor != NULL;
-             j++, QuantizedColor = QuantizedColor->Pnext)
-            SortArray[j] = QuantizedColor;
-
-	/*
-	 * Because qsort isn't stable, this can produce differing 
-	 * results for the order of tuples depending on platform
-	 * details of how qsort() is implemented.
-	 *
-	 * We mitigate this problem by sorting on all three axes rather
-	 * than only the one specied by SortRGBAxis; that way the instability
-	 * can only become an issue if there are multiple color indices
-	 * referring to identical RGB tuples.  Older versions of this 
-	 * sorted on only the one axis.
-	 */
-        qsort(SortArray, NewColorSubdiv[Index].NumEntries,
-              sizeof(QuantizedColorType *), SortCmpRtn);
-
-        /* Relink the sorted list into one: */
-        for (j = 0; j < NewColorSubdiv[Index].NumEntries - 1; j++)
-            SortArray[j]->Pnext = SortArray[j + 1];
-        SortArray[NewColorSubdiv[Index].NumEntries - 1]->Pnext = NULL;
-        NewColorSubdiv[Index].QuantizedColors = QuantizedColor = SortArray[0];
-        free((char *)SortArray);
-
-        /* Now simply add the Counts until we have half of the Count: */
-        Sum = NewColorSubdiv[Index].Count / 2 - QuantizedColor->Count;
-        NumEntries = 1;
-        Count = QuantizedColor->Count;
-        while (QuantizedColor->Pnext != NULL &&
-	       (Sum -= QuantizedColor->Pnext->Count) >= 0 &&
-               QuantizedColor->Pnext->Pnext != NULL) {
-            QuantizedColor = QuantizedColor->Pnext;
-            NumEntries++;
-            Count += QuantizedColor->Count;
+        /* Histogram the entry's pixels and colors along that axis.  */
+        for (j = 0; j <= MaxPrimColor; j++) {
+            Histogram[j] = 0;
+            Entries[j] = 0;
+        }
+        for (j = 0; j < Box->NumEntries; j++) {
+            Histogram[Colors[j]->RGB[SortRGBAxis]] += Colors[j]->Count;
+            Entries[Colors[j]->RGB[SortRGBAxis]]++;
+        }
+        for (Low = 0; Entries[Low] == 0; Low++)
+            continue;
+        for (High = MaxPrimColor; Entries[High] == 0; High--)
+            continue;
+
+        /* Shrink the box on this axis to the colors actually in it; if
+         * they are all in one slice, the axis can't be cut at all. */
+        Box->RGBMin[SortRGBAxis] = Low << (8 - Bits);
+        Box->RGBWidth[SortRGBAxis] = (High - Low) << (8 - Bits);
+        if (Low == High)
+            continue;
+
+        /* Now simply add up the slice Counts for as long as that takes the
+         * first half nearer half of the Count, leaving at least one slice
+         * for the second half: */
+        Half = Box->Count / 2;
+        Split = Low;
+        Count = Histogram[Low];
+        NumEntries = Entries[Low];
+        for (j = Low + 1; j < High; j++) {
+            if (Entries[j] == 0)
+                continue;
+            if (Count >= Half
+                || (Count + Histogram[j] > Half
+                    && Count + Histogram[j] - Half > Half - Count))
+                break;
+            Split = j;
+            Count += Histogram[j];
+            NumEntries += Entries[j];
         }
-        /* Save the values of the last color of the first half, and first
-         * of the second half so we can update the Bounding Boxes later.
-         * Also as the colors are quantized and the BBoxes are full 0..255,
-         * they need to be rescaled.
+        /* The last color of the first half, and first of the second half,
+         * so we can update the Bounding Boxes later.  Also as the colors
+         * are quantized and the BBoxes are full 0..255, they need to be
+         * rescaled.
          */
-        MaxColor = QuantizedColor->RGB[SortRGBAxis]; /* Max. of first half */
-	/* coverity[var_deref_op] */
-        MinColor = QuantizedColor->Pnext->RGB[SortRGBAxis]; /* of second */
-        MaxColor <<= (8 - BITS_PER_PRIM_COLOR);
-        MinColor <<= (8 - BITS_PER_PRIM_COLOR);
-
-        /* Partition right here: */
-        NewColorSubdiv[*NewColorMapSize].QuantizedColors =
-           QuantizedColor->Pnext;
-        QuantizedColor->Pnext = NULL;
-        NewColorSubdiv[*NewColorMapSize].Count = Count;
-        NewColorSubdiv[Index].Count -= Count;
-        NewColorSubdiv[*NewColorMapSize].NumEntries =
-           NewColorSubdiv[Index].NumEntries - NumEntries;
-        NewColorSubdiv[Index].NumEntries = NumEntries;
+        MaxColor = Split;
+        for (MinColor = Split + 1; Entries[MinColor] == 0; MinColor++)
+            continue;
+        MaxColor <<= (8 - Bits);
+        MinColor <<= (8 - Bits);
+
+        /* Partition right here, keeping the order within each half; the
+         * second half waits in Scratch while the first is packed down. */
+        Upper = Scratch;
+        for (i = j = 0; j < Box->NumEntries; j++)
+            if (Colors[j]->RGB[SortRGBAxis] <= Split)
+                Colors[i++] = Colors[j];
+            else
+                *Upper++ = Colors[j];
+        memcpy(Colors + NumEntries, Scratch,
+               (Box->NumEntries - NumEntries) * sizeof(QuantizedColorType *));
+
+        NewBox = &NewColorSubdiv[*NewColorMapSize];
+        NewBox->First = Box->First + NumEntries;
+        NewBox->NumEntries = Box->NumEntries - NumEntries;
+        NewBox->Count = Box->Count - Count;
+        Box->NumEntries = NumEntries;
+        Box->Count = Count;
         for (j = 0; j < 3; j++) {
-            NewColorSubdiv[*NewColorMapSize].RGBMin[j] =
-               NewColorSubdiv[Index].RGBMin[j];
-            NewColorSubdiv[*NewColorMapSize].RGBWidth[j] =
-               NewColorSubdiv[Index].RGBWidth[j];
+            NewBox->RGBMin[j] = Box->RGBMin[j];
+            NewBox->RGBWidth[j] = Box->RGBWidth[j];
         }
-        NewColorSubdiv[*NewColorMapSize].RGBWidth[SortRGBAxis] =
-           NewColorSubdiv[*NewColorMapSize].RGBMin[SortRGBAxis] +
-           NewColorSubdiv[*NewColorMapSize].RGBWidth[SortRGBAxis] - MinColor;
-        NewColorSubdiv[*NewColorMapSize].RGBMin[SortRGBAxis] = MinColor;
+        NewBox->RGBWidth[SortRGBAxis] =
+           NewBox->RGBMin[SortRGBAxis] +
+           NewBox->RGBWidth[SortRGBAxis] - MinColor;
+        NewBox->RGBMin[SortRGBAxis] = MinColor;
 
-        NewColorSubdiv[Index].RGBWidth[SortRGBAxis] =
-           MaxColor - NewColorSubdiv[Index].RGBMin[SortRGBAxis];
+        Box->RGBWidth[SortRGBAxis] =
+           MaxColor - Box->RGBMin[SortRGBAxis];
 
         (*NewColorMapSize)++;
     }
@@ -308,25 +1807,4 @@ SubdivColorMap(NewColorMapType * NewColorSubdiv,
     return GIF_OK;
 }
 
-/****************************************************************************
- Routine called by qsort to compare two entries.
-*****************************************************************************/
-
-static int
-SortCmpRtn(const void *Entry1,
-           const void *Entry2) {
-	   QuantizedColorType *entry1 = (*((QuantizedColorType **) Entry1));
-	   QuantizedColorType *entry2 = (*((QuantizedColorType **) Entry2));
-
-	   /* sort on all axes of the color space! */
-	   int hash1 = entry1->RGB[SortRGBAxis] * 256 * 256
-	   			+ entry1->RGB[(SortRGBAxis+1) % 3] * 256
-				+ entry1->RGB[(SortRGBAxis+2) % 3];
-	   int hash2 = entry2->RGB[SortRGBAxis] * 256 * 256
-	   			+ entry2->RGB[(SortRGBAxis+1) % 3] * 256
-				+ entry2->RGB[(SortRGBAxis+2) % 3];
-
-    return hash1 - hash2;
-}
-
 /* end */